@@ -361,6 +361,11 @@ int Jim_ProcessEvents(Jim_Interp *interp, int flags)
         }
     }
 
+#ifdef JIM_REFERENCES
+    /* Let the reference collector make some progress between events */
+    Jim_CollectIfNeeded(interp);
+#endif
+
     /* Note that we want call select() even if there are no
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
@@ -150,8 +150,8 @@ static int set_array_int_value(Jim_Interp *interp, Jim_Obj *container, const cha
     Jim_Obj *valobj = Jim_NewWideObj(interp, value);
 
     if (Jim_SetDictKeysVector(interp, container, &nameobj, 1, valobj, JIM_ERRMSG) != JIM_OK) {
-        Jim_FreeObj(interp, nameobj);
-        Jim_FreeObj(interp, valobj);
+        Jim_FreeNewObj(interp, nameobj);
+        Jim_FreeNewObj(interp, valobj);
         return JIM_ERR;
     }
     return JIM_OK;
@@ -164,8 +164,8 @@ static int set_array_string_value(Jim_Interp *interp, Jim_Obj *container, const
     Jim_Obj *valobj = Jim_NewStringObj(interp, value, -1);
 
     if (Jim_SetDictKeysVector(interp, container, &nameobj, 1, valobj, JIM_ERRMSG) != JIM_OK) {
-        Jim_FreeObj(interp, nameobj);
-        Jim_FreeObj(interp, valobj);
+        Jim_FreeNewObj(interp, nameobj);
+        Jim_FreeNewObj(interp, valobj);
         return JIM_ERR;
     }
     return JIM_OK;
@@ -49,208 +49,230 @@
 #define JIM_INTEGER_SPACE 24
 #define MAX_FLOAT_WIDTH 320
 
-/**
- * Apply the printf-like format in fmtObjPtr with the given arguments.
+/* Raised if a width or precision doesn't fit in an int, or the result would be too long */
+static const char * const tooLarge = "format result too large";
+
+/* -----------------------------------------------------------------------------
+ * Compiled format strings
  *
- * Returns a new object with zero reference count if OK, or NULL on error.
+ * A format string is parsed once into a program of parts, each holding
+ * the literal text that precedes a conversion and the conversion itself.
+ * The program is kept as the internal representation of the format object,
+ * so a format string used repeatedly is only parsed the first time.
+ *
+ * Everything that depends on the arguments (indices, '*' widths and
+ * precisions) is still checked as the program runs, in the same order as
+ * before, so errors are unchanged. A malformed format string compiles up
+ * to the offending part, which raises the error when it is reached.
+ *
+ * The program is a single allocation, with the literal text (where "%%"
+ * is already reduced to "%") following the parts.
+ * ---------------------------------------------------------------------------*/
+
+#define JIM_FMT_MINUS       0x0001  /* '-' flag */
+#define JIM_FMT_ZERO        0x0002  /* '0' flag */
+#define JIM_FMT_SPACE       0x0004  /* ' ' flag */
+#define JIM_FMT_PLUS        0x0008  /* '+' flag */
+#define JIM_FMT_ALT         0x0010  /* '#' flag */
+#define JIM_FMT_WIDTH_ARG   0x0020  /* Width is '*' */
+#define JIM_FMT_PRECISION   0x0040  /* Precision was given with '.' */
+#define JIM_FMT_PREC_ARG    0x0080  /* Precision is '*' */
+#define JIM_FMT_SHORT       0x0100  /* 'h' modifier */
+#define JIM_FMT_POSITION    0x0200  /* XPG3 "%n$" position */
+#define JIM_FMT_XPG         0x0400  /* XPG3 positions are in use */
+#define JIM_FMT_SEQUENTIAL  0x0800  /* Sequential conversions are in use */
+#define JIM_FMT_END         0x1000  /* Trailing literal text only */
+
+typedef struct Jim_FormatPart {
+    int literal;                /* Offset of the preceding literal text */
+    int literalLen;             /* and its length */
+    int flags;                  /* JIM_FMT_... */
+    int position;               /* Argument index, if JIM_FMT_POSITION */
+    long width;
+    long precision;
+    int conv;                   /* The conversion character */
+    const char *error;          /* If set, raised when the part is reached */
+} Jim_FormatPart;
+
+typedef struct Jim_FormatProgram {
+    int size;                   /* Size of the whole allocation */
+    int count;                  /* Number of parts */
+    int text;                   /* Offset of the literal text */
+    int reserve;                /* Expected size of the result, less %s arguments */
+    Jim_FormatPart part[1];
+} Jim_FormatProgram;
+
+static void FreeFormatInternalRep(Jim_Interp *interp, Jim_Obj *objPtr);
+static void DupFormatInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr);
+
+static const Jim_ObjType formatObjType = {
+    "format",
+    FreeFormatInternalRep,
+    DupFormatInternalRep,
+    NULL,
+    JIM_TYPE_NONE,
+};
+
+static void FreeFormatInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    JIM_NOTUSED(interp);
+    Jim_Free(objPtr->internalRep.ptr);
+}
+
+static void DupFormatInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
+{
+    Jim_FormatProgram *prog = srcPtr->internalRep.ptr;
+
+    JIM_NOTUSED(interp);
+    dupPtr->internalRep.ptr = Jim_Alloc(prog->size);
+    memcpy(dupPtr->internalRep.ptr, prog, prog->size);
+    dupPtr->typePtr = &formatObjType;
+}
+
+/**
+ * Parses the format string into a newly allocated program.
  */
-Jim_Obj *Jim_FormatString(Jim_Interp *interp, Jim_Obj *fmtObjPtr, int objc, Jim_Obj *const *objv)
+static Jim_FormatProgram *JimCompileFormat(const char *format, int formatLen)
 {
-    const char *span, *format, *formatEnd, *msg;
-    int numBytes = 0, objIndex = 0, gotXpg = 0, gotSequential = 0;
     static const char * const mixedXPG =
 	    "cannot mix \"%\" and \"%n$\" conversion specifiers";
-    static const char * const badIndex[2] = {
-	"not enough arguments for all format specifiers",
-	"\"%n$\" argument index out of range"
-    };
-    int formatLen;
-    Jim_Obj *resultPtr;
-
-    /* A single buffer is used to store numeric fields (with sprintf())
-     * This buffer is allocated/reallocated as necessary
-     */
-    char *num_buffer = NULL;
-    int num_buffer_size = 0;
-
-    span = format = Jim_GetString(fmtObjPtr, &formatLen);
-    formatEnd = format + formatLen;
-    resultPtr = Jim_NewStringObj(interp, "", 0);
+    const char *formatEnd = format + formatLen;
+    Jim_FormatProgram *prog;
+    Jim_FormatPart *part;
+    char *text;
+    int maxParts, size, i;
+    int textLen = 0, gotXpg = 0, gotSequential = 0;
+
+    /* Every conversion starts with a '%' */
+    for (i = 0, maxParts = 1; i < formatLen; i++) {
+	if (format[i] == '%') {
+	    maxParts++;
+	}
+    }
+    size = sizeof(*prog) + (maxParts - 1) * sizeof(*part) + formatLen + 1;
+    prog = Jim_Alloc(size);
+    prog->size = size;
+    prog->text = (char *)&prog->part[maxParts] - (char *)prog;
+    prog->reserve = 0;
+    text = (char *)prog + prog->text;
+
+    part = &prog->part[0];
+    part->literal = 0;
+    part->flags = 0;
+    part->conv = 0;
+    part->error = NULL;
 
     while (format != formatEnd) {
 	char *end;
-	int gotMinus, sawFlag;
-	int gotPrecision, useShort;
-	long width, precision;
-	int newXpg;
-	int ch;
-	int step;
-	int doubleType;
-	char pad = ' ';
-	char spec[2*JIM_INTEGER_SPACE + 12];
-	char *p;
-
-	int formatted_chars;
-	int formatted_bytes;
-	const char *formatted_buf;
+	int ch, step;
 
 	step = utf8_tounicode(format, &ch);
 	format += step;
 	if (ch != '%') {
-	    numBytes += step;
+	    memcpy(text + textLen, format - step, step);
+	    textLen += step;
 	    continue;
 	}
-	if (numBytes) {
-	    Jim_AppendString(interp, resultPtr, span, numBytes);
-	    numBytes = 0;
-	}
-
-	/*
-	 * Saw a % : process the format specifier.
-	 *
-	 * Step 0. Handle special case of escaped format marker (i.e., %%).
-	 */
 
 	step = utf8_tounicode(format, &ch);
 	if (ch == '%') {
-	    span = format;
-	    numBytes = step;
+	    /* Escaped format marker */
+	    text[textLen++] = '%';
 	    format += step;
 	    continue;
 	}
 
-	/*
-	 * Step 1. XPG3 position specifier
-	 */
+	part->literalLen = textLen - part->literal;
 
-	newXpg = 0;
+	/* XPG3 position specifier */
 	if (isdigit(ch)) {
 	    int position = strtoul(format, &end, 10);
 	    if (*end == '$') {
-		newXpg = 1;
-		objIndex = position - 1;
+		part->flags |= JIM_FMT_POSITION;
+		part->position = position - 1;
 		format = end + 1;
 		step = utf8_tounicode(format, &ch);
 	    }
 	}
-	if (newXpg) {
+	if (part->flags & JIM_FMT_POSITION) {
 	    if (gotSequential) {
-		msg = mixedXPG;
-		goto errorMsg;
+		part->error = mixedXPG;
+		break;
 	    }
 	    gotXpg = 1;
+	    part->flags |= JIM_FMT_XPG;
 	} else {
 	    if (gotXpg) {
-		msg = mixedXPG;
-		goto errorMsg;
+		part->error = mixedXPG;
+		break;
 	    }
 	    gotSequential = 1;
-	}
-	if ((objIndex < 0) || (objIndex >= objc)) {
-	    msg = badIndex[gotXpg];
-	    goto errorMsg;
+	    part->flags |= JIM_FMT_SEQUENTIAL;
 	}
 
-	/*
-	 * Step 2. Set of flags. Also build up the sprintf spec.
-	 */
-	p = spec;
-	*p++ = '%';
-
-	gotMinus = 0;
-	sawFlag = 1;
-	do {
-	    switch (ch) {
-	    case '-':
-		gotMinus = 1;
-		break;
-	    case '0':
-		pad = ch;
-		break;
-	    case ' ':
-	    case '+':
-	    case '#':
+	/* Flags */
+	for (;;) {
+	    if (ch == '-') {
+		part->flags |= JIM_FMT_MINUS;
+	    } else if (ch == '0') {
+		part->flags |= JIM_FMT_ZERO;
+	    } else if (ch == ' ') {
+		part->flags |= JIM_FMT_SPACE;
+	    } else if (ch == '+') {
+		part->flags |= JIM_FMT_PLUS;
+	    } else if (ch == '#') {
+		part->flags |= JIM_FMT_ALT;
+	    } else {
 		break;
-	    default:
-		sawFlag = 0;
-		continue;
 	    }
-	    *p++ = ch;
 	    format += step;
 	    step = utf8_tounicode(format, &ch);
-	} while (sawFlag);
-
-	/*
-	 * Step 3. Minimum field width.
-	 */
+	}
 
-	width = 0;
+	/* Minimum field width */
+	part->width = 0;
 	if (isdigit(ch)) {
-	    width = strtoul(format, &end, 10);
+	    unsigned long width = strtoul(format, &end, 10);
+
+	    if (width > INT_MAX) {
+		part->error = tooLarge;
+		break;
+	    }
+	    part->width = width;
 	    format = end;
 	    step = utf8_tounicode(format, &ch);
 	} else if (ch == '*') {
-	    if (objIndex >= objc - 1) {
-		msg = badIndex[gotXpg];
-		goto errorMsg;
-	    }
-	    if (Jim_GetLong(interp, objv[objIndex], &width) != JIM_OK) {
-		goto error;
-	    }
-	    if (width < 0) {
-		width = -width;
-		if (!gotMinus) {
-		    *p++ = '-';
-		    gotMinus = 1;
-		}
-	    }
-	    objIndex++;
+	    part->flags |= JIM_FMT_WIDTH_ARG;
 	    format += step;
 	    step = utf8_tounicode(format, &ch);
 	}
 
-	/*
-	 * Step 4. Precision.
-	 */
-
-	gotPrecision = precision = 0;
+	/* Precision. A '*' takes an argument even without the '.' */
+	part->precision = 0;
 	if (ch == '.') {
-	    gotPrecision = 1;
+	    part->flags |= JIM_FMT_PRECISION;
 	    format += step;
 	    step = utf8_tounicode(format, &ch);
 	}
 	if (isdigit(ch)) {
-	    precision = strtoul(format, &end, 10);
+	    unsigned long precision = strtoul(format, &end, 10);
+
+	    if (precision > INT_MAX) {
+		part->error = tooLarge;
+		break;
+	    }
+	    part->precision = precision;
 	    format = end;
 	    step = utf8_tounicode(format, &ch);
 	} else if (ch == '*') {
-	    if (objIndex >= objc - 1) {
-		msg = badIndex[gotXpg];
-		goto errorMsg;
-	    }
-	    if (Jim_GetLong(interp, objv[objIndex], &precision) != JIM_OK) {
-		goto error;
-	    }
-
-	    /*
-	     * TODO: Check this truncation logic.
-	     */
-
-	    if (precision < 0) {
-		precision = 0;
-	    }
-	    objIndex++;
+	    part->flags |= JIM_FMT_PREC_ARG;
 	    format += step;
 	    step = utf8_tounicode(format, &ch);
 	}
 
-	/*
-	 * Step 5. Length modifier.
-	 */
-
-	useShort = 0;
+	/* Length modifier */
 	if (ch == 'h') {
-	    useShort = 1;
+	    part->flags |= JIM_FMT_SHORT;
 	    format += step;
 	    step = utf8_tounicode(format, &ch);
 	} else if (ch == 'l') {
@@ -264,34 +286,305 @@ Jim_Obj *Jim_FormatString(Jim_Interp *interp, Jim_Obj *fmtObjPtr, int objc, Jim_
 	}
 
 	format += step;
-	span = format;
-
-	/*
-	 * Step 6. The actual conversion character.
-	 */
 
+	/* The actual conversion character */
 	if (ch == 'i') {
 	    ch = 'd';
 	}
+	part->conv = ch;
 
-	doubleType = 0;
-
-	/* Each valid conversion will set:
-	 * formatted_buf   - the result to be added
-	 * formatted_chars - the length of formatted_buf in characters
-	 * formatted_bytes - the length of formatted_buf in bytes
-	 */
 	switch (ch) {
+	case 's':
+	    /* Plus the length of the argument, which is only known later */
+	    prog->reserve += part->width < MAX_FLOAT_WIDTH ? part->width : MAX_FLOAT_WIDTH;
+	    break;
+	case 'c':
+	case 'd':
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'g':
+	case 'G':
+	    prog->reserve += part->width < JIM_INTEGER_SPACE ? JIM_INTEGER_SPACE :
+		part->width < MAX_FLOAT_WIDTH ? part->width : MAX_FLOAT_WIDTH;
+	    break;
+	default:
+	    /* An invalid conversion, which always raises an error, so
+	     * nothing after it is needed */
+	    goto done;
+	}
+
+	part++;
+	part->literal = textLen;
+	part->flags = 0;
+	part->conv = 0;
+	part->error = NULL;
+    }
+
+    if (format == formatEnd && !part->error) {
+	part->literalLen = textLen - part->literal;
+	part->flags = JIM_FMT_END;
+    }
+
+  done:
+    prog->count = part - prog->part + 1;
+    prog->reserve += textLen;
+    return prog;
+}
+
+/* The result is built in a single buffer, which becomes the string
+ * representation of the result object.
+ */
+typedef struct Jim_FormatBuf {
+    char *buf;
+    int len;
+    int size;
+} Jim_FormatBuf;
+
+/**
+ * Returns space for at least 'need' more bytes (and a null terminator)
+ * at the end of the buffer, or NULL if the result would be longer than INT_MAX - 1.
+ */
+static char *JimFormatSpace(Jim_FormatBuf *out, long need)
+{
+    if (need < 0 || need > INT_MAX - 1 - out->len) {
+	return NULL;
+    }
+    if (out->len + need >= out->size) {
+	int size = out->len + need + 1;
+
+	out->size = size <= INT_MAX / 2 ? size * 2 : INT_MAX;
+	out->buf = Jim_Realloc(out->buf, out->size);
+    }
+    return out->buf + out->len;
+}
+
+/**
+ * Appends 'bytes' bytes of 'str', which is 'chars' characters long,
+ * padded to 'width' characters.
+ */
+static int JimFormatPadded(Jim_FormatBuf *out, const char *str, int bytes, int chars,
+    long width, int left, char pad)
+{
+    int fill = chars < width ? width - chars : 0;
+    char *dst = JimFormatSpace(out, (long)fill + bytes);
+
+    if (dst == NULL) {
+	return JIM_ERR;
+    }
+    if (!left) {
+	memset(dst, pad, fill);
+	dst += fill;
+    }
+    memcpy(dst, str, bytes);
+    dst += bytes;
+    if (left) {
+	memset(dst, pad, fill);
+	dst += fill;
+    }
+    out->len = dst - out->buf;
+    return JIM_OK;
+}
+
+/**
+ * Appends a decimal integer as "%d" would, without snprintf().
+ */
+static int JimFormatDecimal(Jim_FormatBuf *out, jim_wide w, long width, int flags)
+{
+    char num[JIM_INTEGER_SPACE];
+    const char *digits = num;
+    int ndigits = Jim_WideToString(num, w);
+    char sign = 0;
+    int fill;
+    char *dst;
+
+    if (w < 0) {
+	sign = '-';
+	digits++;
+	ndigits--;
+    } else if (flags & JIM_FMT_PLUS) {
+	sign = '+';
+    } else if (flags & JIM_FMT_SPACE) {
+	sign = ' ';
+    }
+    fill = width - ndigits - (sign != 0);
+    if (fill < 0) {
+	fill = 0;
+    }
+
+    dst = JimFormatSpace(out, (long)fill + 1 + ndigits);
+    if (dst == NULL) {
+	return JIM_ERR;
+    }
+    if (!(flags & (JIM_FMT_MINUS | JIM_FMT_ZERO))) {
+	memset(dst, ' ', fill);
+	dst += fill;
+    }
+    if (sign) {
+	*dst++ = sign;
+    }
+    if ((flags & (JIM_FMT_MINUS | JIM_FMT_ZERO)) == JIM_FMT_ZERO) {
+	memset(dst, '0', fill);
+	dst += fill;
+    }
+    memcpy(dst, digits, ndigits);
+    dst += ndigits;
+    if (flags & JIM_FMT_MINUS) {
+	memset(dst, ' ', fill);
+	dst += fill;
+    }
+    out->len = dst - out->buf;
+    return JIM_OK;
+}
+
+/**
+ * Apply the printf-like format in fmtObjPtr with the given arguments.
+ *
+ * Returns a new object with zero reference count if OK, or NULL on error.
+ */
+Jim_Obj *Jim_FormatString(Jim_Interp *interp, Jim_Obj *fmtObjPtr, int objc, Jim_Obj *const *objv)
+{
+    static const char * const badIndex[2] = {
+	"not enough arguments for all format specifiers",
+	"\"%n$\" argument index out of range"
+    };
+    Jim_FormatProgram *prog;
+    Jim_FormatProgram *copy = NULL;
+    Jim_FormatBuf out;
+    const char *text;
+    const char *msg;
+    int i, objIndex = 0;
+
+    if (fmtObjPtr->typePtr != &formatObjType) {
+	int formatLen;
+	const char *format = Jim_GetString(fmtObjPtr, &formatLen);
+
+	prog = JimCompileFormat(format, formatLen);
+	Jim_FreeIntRep(interp, fmtObjPtr);
+	fmtObjPtr->typePtr = &formatObjType;
+	fmtObjPtr->internalRep.ptr = prog;
+    }
+    prog = fmtObjPtr->internalRep.ptr;
+
+    /* Getting the value of an argument may change its internal representation,
+     * so if the format object is also an argument, run a private copy of the program */
+    for (i = 0; i < objc; i++) {
+	if (objv[i] == fmtObjPtr) {
+	    copy = Jim_Alloc(prog->size);
+	    memcpy(copy, prog, prog->size);
+	    prog = copy;
+	    break;
+	}
+    }
+    text = (const char *)prog + prog->text;
+
+    out.len = 0;
+    out.size = prog->reserve + 1;
+    out.buf = Jim_Alloc(out.size);
+
+    for (i = 0; i < prog->count; i++) {
+	const Jim_FormatPart *part = &prog->part[i];
+	int flags = part->flags;
+	long width, precision;
+	char spec[2*JIM_INTEGER_SPACE + 12];
+	char *p;
+
+	if (part->error) {
+	    msg = part->error;
+	    goto errorMsg;
+	}
+
+	p = JimFormatSpace(&out, part->literalLen);
+	if (p == NULL) {
+	    msg = tooLarge;
+	    goto errorMsg;
+	}
+	memcpy(p, text + part->literal, part->literalLen);
+	out.len += part->literalLen;
+
+	if (flags & JIM_FMT_END) {
+	    break;
+	}
+
+	if (flags & JIM_FMT_POSITION) {
+	    objIndex = part->position;
+	}
+	if ((objIndex < 0) || (objIndex >= objc)) {
+	    msg = badIndex[(flags & JIM_FMT_XPG) != 0];
+	    goto errorMsg;
+	}
+
+	width = part->width;
+	if (flags & JIM_FMT_WIDTH_ARG) {
+	    if (objIndex >= objc - 1) {
+		msg = badIndex[(flags & JIM_FMT_XPG) != 0];
+		goto errorMsg;
+	    }
+	    if (Jim_GetLong(interp, objv[objIndex], &width) != JIM_OK) {
+		goto error;
+	    }
+	    if (width > INT_MAX || width < -INT_MAX) {
+		msg = tooLarge;
+		goto errorMsg;
+	    }
+	    if (width < 0) {
+		width = -width;
+		flags |= JIM_FMT_MINUS;
+	    }
+	    objIndex++;
+	}
+
+	precision = part->precision;
+	if (flags & JIM_FMT_PREC_ARG) {
+	    if (objIndex >= objc - 1) {
+		msg = badIndex[(flags & JIM_FMT_XPG) != 0];
+		goto errorMsg;
+	    }
+	    if (Jim_GetLong(interp, objv[objIndex], &precision) != JIM_OK) {
+		goto error;
+	    }
+	    if (precision > INT_MAX) {
+		msg = tooLarge;
+		goto errorMsg;
+	    }
+
+	    /*
+	     * TODO: Check this truncation logic.
+	     */
+
+	    if (precision < 0) {
+		precision = 0;
+	    }
+	    objIndex++;
+	}
+
+	switch (part->conv) {
 	case '\0':
 	    msg = "format string ended in middle of field specifier";
 	    goto errorMsg;
 	case 's': {
-	    formatted_buf = Jim_GetString(objv[objIndex], &formatted_bytes);
-	    formatted_chars = Jim_Utf8Length(interp, objv[objIndex]);
-	    if (gotPrecision && (precision < formatted_chars)) {
-		/* Need to build a (null terminated) truncated string */
-		formatted_chars = precision;
-		formatted_bytes = utf8_index(formatted_buf, precision);
+	    int bytes, chars;
+	    const char *str = Jim_GetString(objv[objIndex], &bytes);
+
+	    if (width || (flags & JIM_FMT_PRECISION)) {
+		chars = Jim_Utf8Length(interp, objv[objIndex]);
+		if ((flags & JIM_FMT_PRECISION) && (precision < chars)) {
+		    chars = precision;
+		    bytes = utf8_index(str, precision);
+		}
+	    }
+	    else {
+		/* No padding or truncation, so no need to count characters */
+		chars = 0;
+	    }
+	    if (JimFormatPadded(&out, str, bytes, chars, width, flags & JIM_FMT_MINUS,
+		    (flags & JIM_FMT_ZERO) ? '0' : ' ') != JIM_OK) {
+		msg = tooLarge;
+		goto errorMsg;
 	    }
 	    break;
 	}
@@ -301,34 +594,66 @@ Jim_Obj *Jim_FormatString(Jim_Interp *interp, Jim_Obj *fmtObjPtr, int objc, Jim_
 	    if (Jim_GetWide(interp, objv[objIndex], &code) != JIM_OK) {
 		goto error;
 	    }
-	    /* Just store the value in the 'spec' buffer */
-	    formatted_bytes = utf8_fromunicode(spec, code);
-	    formatted_buf = spec;
-	    formatted_chars = 1;
+	    if (JimFormatPadded(&out, spec, utf8_fromunicode(spec, code), 1, width,
+		    flags & JIM_FMT_MINUS, (flags & JIM_FMT_ZERO) ? '0' : ' ') != JIM_OK) {
+		msg = tooLarge;
+		goto errorMsg;
+	    }
 	    break;
 	}
 
-	case 'e':
-	case 'E':
-	case 'f':
-	case 'g':
-	case 'G':
-	    doubleType = 1;
-	    /* fall through */
 	case 'd':
+	    if (!(flags & (JIM_FMT_PRECISION | JIM_FMT_SHORT | JIM_FMT_ALT))) {
+		/* Common enough to be worth avoiding snprintf() */
+		jim_wide w;
+
+		if (Jim_GetWide(interp, objv[objIndex], &w) != JIM_OK) {
+		    goto error;
+		}
+		if (JimFormatDecimal(&out, w, width, flags) != JIM_OK) {
+		    msg = tooLarge;
+		    goto errorMsg;
+		}
+		break;
+	    }
+	    /* fall through */
 	case 'u':
 	case 'o':
 	case 'x':
-	case 'X': {
-	    jim_wide w;
-	    double d;
+	case 'X':
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'g':
+	case 'G': {
+	    int doubleType = strchr("eEfgG", part->conv) != NULL;
+	    jim_wide w = 0;
+	    double d = 0;
 	    int length;
+	    char *dst;
 
-	    /* Fill in the width and precision */
+	    /* Build up the sprintf spec */
+	    p = spec;
+	    *p++ = '%';
+	    if (flags & JIM_FMT_MINUS) {
+		*p++ = '-';
+	    }
+	    if (flags & JIM_FMT_ZERO) {
+		*p++ = '0';
+	    }
+	    if (flags & JIM_FMT_SPACE) {
+		*p++ = ' ';
+	    }
+	    if (flags & JIM_FMT_PLUS) {
+		*p++ = '+';
+	    }
+	    if (flags & JIM_FMT_ALT) {
+		*p++ = '#';
+	    }
 	    if (width) {
 		p += sprintf(p, "%ld", width);
 	    }
-	    if (gotPrecision) {
+	    if (flags & JIM_FMT_PRECISION) {
 		p += sprintf(p, ".%ld", precision);
 	    }
 
@@ -344,9 +669,9 @@ Jim_Obj *Jim_FormatString(Jim_Interp *interp, Jim_Obj *fmtObjPtr, int objc, Jim_
 		    goto error;
 		}
 		length = JIM_INTEGER_SPACE;
-		if (useShort) {
+		if (flags & JIM_FMT_SHORT) {
 		    *p++ = 'h';
-		    if (ch == 'd') {
+		    if (part->conv == 'd') {
 			w = (short)w;
 		    }
 		    else {
@@ -363,70 +688,59 @@ Jim_Obj *Jim_FormatString(Jim_Interp *interp, Jim_Obj *fmtObjPtr, int objc, Jim_
 		}
 	    }
 
-	    *p++ = (char) ch;
+	    *p++ = (char) part->conv;
 	    *p = '\0';
 
 	    /* Adjust length for width and precision */
 	    if (width > length) {
 		length = width;
 	    }
-	    if (gotPrecision) {
+	    if (flags & JIM_FMT_PRECISION) {
+		if (precision > INT_MAX - length) {
+		    msg = tooLarge;
+		    goto errorMsg;
+		}
 		length += precision;
 	    }
 
-	    /* Increase the size of the buffer if needed */
-	    if (num_buffer_size < length + 1) {
-		num_buffer_size = length + 1;
-		num_buffer = Jim_Realloc(num_buffer, num_buffer_size);
+	    /* Format straight into the result */
+	    dst = JimFormatSpace(&out, length);
+	    if (dst == NULL) {
+		msg = tooLarge;
+		goto errorMsg;
 	    }
-
 	    if (doubleType) {
-		snprintf(num_buffer, length + 1, spec, d);
+		snprintf(dst, length + 1, spec, d);
 	    }
 	    else {
-		formatted_bytes = snprintf(num_buffer, length + 1, spec, w);
+		snprintf(dst, length + 1, spec, w);
 	    }
-	    formatted_chars = formatted_bytes = strlen(num_buffer);
-	    formatted_buf = num_buffer;
+	    out.len += strlen(dst);
 	    break;
 	}
 
 	default: {
 	    /* Just reuse the 'spec' buffer */
-	    spec[0] = ch;
+	    spec[0] = part->conv;
 	    spec[1] = '\0';
 	    Jim_SetResultFormatted(interp, "bad field specifier \"%s\"", spec);
 	    goto error;
 	}
 	}
 
-	if (!gotMinus) {
-	    while (formatted_chars < width) {
-		Jim_AppendString(interp, resultPtr, &pad, 1);
-		formatted_chars++;
-	    }
-	}
-
-	Jim_AppendString(interp, resultPtr, formatted_buf, formatted_bytes);
-
-	while (formatted_chars < width) {
-	    Jim_AppendString(interp, resultPtr, &pad, 1);
-	    formatted_chars++;
+	if (flags & JIM_FMT_SEQUENTIAL) {
+	    objIndex++;
 	}
-
-	objIndex += gotSequential;
-    }
-    if (numBytes) {
-	Jim_AppendString(interp, resultPtr, span, numBytes);
     }
 
-    Jim_Free(num_buffer);
-    return resultPtr;
+    Jim_Free(copy);
+    out.buf[out.len] = '\0';
+    return Jim_NewStringObjNoAlloc(interp, out.buf, out.len);
 
   errorMsg:
     Jim_SetResultString(interp, msg, -1);
   error:
-    Jim_FreeNewObj(interp, resultPtr);
-    Jim_Free(num_buffer);
+    Jim_Free(copy);
+    Jim_Free(out.buf);
     return NULL;
 }
@@ -50,10 +50,10 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <limits.h>
+#include <float.h>
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
-#include <setjmp.h>
 
 #include "jim.h"
 #include "jimautoconf.h"
@@ -117,10 +117,23 @@ static void JimPanicDump(int panic_condition, const char *fmt, ...);
  * Jim_InvalidateStringRep knows about it and doesn't try to free it. */
 static char JimEmptyStringRep[] = "";
 
+/* True if the string rep of the object was not separately allocated */
+#define JimStringRepIsShort(objPtr) \
+    ((objPtr)->bytes == JimEmptyStringRep || (objPtr)->bytes == (objPtr)->inlineBytes)
+
+#define JimFreeStringRep(objPtr) \
+    do { \
+        if ((objPtr)->bytes != NULL && !JimStringRepIsShort(objPtr)) \
+            Jim_Free((objPtr)->bytes); \
+    } while (0)
+
 /* -----------------------------------------------------------------------------
  * Required prototypes of not exported functions
  * ---------------------------------------------------------------------------*/
 static void JimChangeCallFrameId(Jim_Interp *interp, Jim_CallFrame *cf);
+static unsigned int JimObjectHTSeededHashFunction(const void *key, unsigned int seed);
+static Jim_Obj *JimNewUnsharedIntObj(Jim_Interp *interp, jim_wide wideValue);
+static void JimReleaseSmallInt(Jim_Interp *interp, Jim_Obj *objPtr);
 static void JimFreeCallFrame(Jim_Interp *interp, Jim_CallFrame *cf, int flags);
 static int ListSetIndex(Jim_Interp *interp, Jim_Obj *listPtr, int listindex, Jim_Obj *newObjPtr,
     int flags);
@@ -130,11 +143,13 @@ static void SetDictSubstFromAny(Jim_Interp *interp, Jim_Obj *objPtr);
 static void JimSetFailedEnumResult(Jim_Interp *interp, const char *arg, const char *badtype,
     const char *prefix, const char *const *tablePtr, const char *name);
 static int JimCallProcedure(Jim_Interp *interp, Jim_Cmd *cmd, int argc, Jim_Obj *const *argv);
+static void JimFreeLocalSlots(Jim_Interp *interp, struct Jim_LocalSlots *localSlots);
 static int JimGetWideNoErr(Jim_Interp *interp, Jim_Obj *objPtr, jim_wide * widePtr);
 static int JimSign(jim_wide w);
 static int JimValidName(Jim_Interp *interp, const char *type, Jim_Obj *nameObjPtr);
 static void JimPrngSeed(Jim_Interp *interp, unsigned char *seed, int seedLen);
 static void JimRandomBytes(Jim_Interp *interp, void *dest, unsigned int len);
+static void JimSystemRandomBytes(Jim_Interp *interp, void *dest, unsigned int len);
 
 
 /* Fast access to the int (wide) value of an object which is known to be of int type */
@@ -250,6 +265,16 @@ static int JimGlobMatch(const char *pattern, const char *string, int nocase)
                 if (!pattern[0]) {
                     return 1;   /* match */
                 }
+                if (!nocase && !strchr("?[\\", pattern[0]) && (pattern[0] & 0xc0) != 0x80) {
+                    /* The next char is a literal, so only try where it occurs.
+                     * strchr() is usually vectorised. */
+                    while ((string = strchr(string, pattern[0])) != NULL) {
+                        if (JimGlobMatch(pattern, string, nocase))
+                            return 1;       /* match */
+                        string++;
+                    }
+                    return 0;       /* no match */
+                }
                 while (*string) {
                     /* Recursive call - Does the remaining pattern match anywhere? */
                     if (JimGlobMatch(pattern, string, nocase))
@@ -259,6 +284,9 @@ static int JimGlobMatch(const char *pattern, const char *string, int nocase)
                 return 0;       /* no match */
 
             case '?':
+                if (!*string) {
+                    return 0;   /* nothing to match */
+                }
                 string += utf8_tounicode(string, &c);
                 break;
 
@@ -349,29 +377,55 @@ static int JimStringCompareLen(const char *s1, const char *s2, int maxchars, int
     return 0;
 }
 
-/* Search 's1' inside 's2', starting to search from char 'index' of 's2'.
- * The index of the first occurrence of s1 in s2 is returned.
- * If s1 is not found inside s2, -1 is returned. */
-static int JimStringFirst(const char *s1, int l1, const char *s2, int l2, int idx)
+/* Like memrchr(), which is not portable.
+ * Compares a word at a time until the word containing 'c' is found.
+ */
+static const char *JimFindByteReverse(const char *s, int len, int c)
 {
-    int i;
-    int l1bytelen;
+    const unsigned long ones = (unsigned long)-1 / 0xff;
+    const unsigned long pattern = ones * (unsigned char)c;
 
-    if (!l1 || !l2 || l1 > l2) {
-        return -1;
+    while (len >= (int)sizeof(unsigned long)) {
+        unsigned long w;
+
+        memcpy(&w, s + len - sizeof(w), sizeof(w));
+        w ^= pattern;
+        if ((w - ones) & ~w & (ones << 7)) {
+            /* This word has a zero byte, so contains 'c' */
+            break;
+        }
+        len -= sizeof(w);
     }
-    if (idx < 0)
-        idx = 0;
-    s2 += utf8_index(s2, idx);
+    while (len--) {
+        if (s[len] == (char)c) {
+            return s + len;
+        }
+    }
+    return NULL;
+}
 
-    l1bytelen = utf8_index(s1, l1);
+/**
+ * Search 's1' inside 's2'.
+ *
+ * Note: Lengths and return value are in bytes, not chars.
+ */
+static int JimStringFirst(const char *s1, int l1, const char *s2, int l2)
+{
+    const char *p = s2;
+    const char *last = s2 + l2 - l1;
 
-    for (i = idx; i <= l2 - l1; i++) {
-        int c;
-        if (memcmp(s2, s1, l1bytelen) == 0) {
-            return i;
+    if (!l1 || l1 > l2) {
+        return -1;
+    }
+
+    /* memchr() is usually vectorised, so use it to find candidates */
+    while ((p = memchr(p, *s1, last - p + 1)) != NULL) {
+        if (memcmp(p + 1, s1 + 1, l1 - 1) == 0) {
+            return p - s2;
+        }
+        if (p++ == last) {
+            break;
         }
-        s2 += utf8_tounicode(s2, &c);
     }
     return -1;
 }
@@ -387,33 +441,65 @@ static int JimStringLast(const char *s1, int l1, const char *s2, int l2)
         return -1;
 
     /* Now search for the needle */
-    for (p = s2 + l2 - 1; p != s2 - 1; p--) {
-        if (*p == *s1 && memcmp(s1, p, l1) == 0) {
+    while ((p = JimFindByteReverse(s2, l2, *s1)) != NULL) {
+        if (memcmp(s1, p, l1) == 0) {
             return p - s2;
         }
+        l2 = p - s2;
     }
     return -1;
 }
 
-#ifdef JIM_UTF8
-/**
- * Note: Lengths and return value are in chars.
- */
-static int JimStringLastUtf8(const char *s1, int l1, const char *s2, int l2)
-{
-    int n = JimStringLast(s1, utf8_index(s1, l1), s2, utf8_index(s2, l2));
-    if (n > 0) {
-        n = utf8_strlen(s2, n);
-    }
-    return n;
-}
-#endif
+/* -----------------------------------------------------------------------------
+ * Number formatting and parsing
+ * ---------------------------------------------------------------------------*/
+#define JIM_INTEGER_SPACE 24
+
+/* The decimal digit pairs "00" to "99", so integers can be formatted two digits at a time */
+static const char JimDigitPairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
 
 int Jim_WideToString(char *buf, jim_wide wideValue)
 {
-    const char *fmt = "%" JIM_WIDE_MODIFIER;
+    char tmp[JIM_INTEGER_SPACE];
+    char *p = tmp + sizeof(tmp);
+    unsigned jim_wide value = wideValue;
+    int len;
+
+    if (wideValue < 0) {
+        /* Unsigned negation is well defined, even for JIM_WIDE_MIN */
+        value = -value;
+    }
+    while (value >= 100) {
+        int i = (int)(value % 100) * 2;
 
-    return sprintf(buf, fmt, wideValue);
+        value /= 100;
+        *--p = JimDigitPairs[i + 1];
+        *--p = JimDigitPairs[i];
+    }
+    if (value >= 10) {
+        *--p = JimDigitPairs[value * 2 + 1];
+        *--p = JimDigitPairs[value * 2];
+    }
+    else {
+        *--p = '0' + (int)value;
+    }
+    if (wideValue < 0) {
+        *--p = '-';
+    }
+    len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return len;
 }
 
 /**
@@ -440,21 +526,397 @@ static int JimCheckConversion(const char *str, const char *endptr)
     return JIM_OK;
 }
 
+/* The number of decimal digits that can never overflow a jim_wide */
+#define JIM_WIDE_SAFE_DIGITS (sizeof(jim_wide) >= 8 ? 18 : 9)
+
 int Jim_StringToWide(const char *str, jim_wide * widePtr, int base)
 {
     char *endptr;
 
+    if (base == 0 || base == 10) {
+        /* Fast path for a plain decimal integer that is too short to overflow.
+         * Anything else (white space, a radix prefix, octal, a possible overflow)
+         * is left to strtoull().
+         */
+        const char *p = str + (*str == '-' || *str == '+');
+        const char *end = p + JIM_WIDE_SAFE_DIGITS;
+        jim_wide value = 0;
+
+        if (*p >= '1' && *p <= '9') {
+            while (p < end && *p >= '0' && *p <= '9') {
+                value = value * 10 + (*p++ - '0');
+            }
+        }
+        else if (*p == '0') {
+            p++;
+        }
+        if (*p == '\0' && p != str && isdigit(UCHAR(p[-1]))) {
+            *widePtr = *str == '-' ? -value : value;
+            return JIM_OK;
+        }
+    }
+
     *widePtr = strtoull(str, &endptr, base);
 
     return JimCheckConversion(str, endptr);
 }
 
+#ifdef HAVE_LONG_LONG
+/* Shortest round-trip formatting of doubles with the Grisu3 algorithm, from
+ * Florian Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with Integers".
+ *
+ * Values are held as "do-it-yourself" floating point numbers, f * 2^e, with a 64 bit f.
+ * Grisu3 produces the shortest digits that read back as the original value (the closest
+ * to it, if there is a choice), or reports that it can't be sure, in which case an exact
+ * search with sprintf() and strtod() is used instead.
+ */
+typedef struct {
+    unsigned long long f;
+    int e;
+} JimDiyFp;
+
+/* Normalised approximations of 10^k for k = -348, -340, ... 340 */
+static const unsigned long long JimCachedPowersF[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const short JimCachedPowersE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const unsigned long long JimPow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static JimDiyFp JimDiyFpMake(unsigned long long f, int e)
+{
+    JimDiyFp r;
+
+    r.f = f;
+    r.e = e;
+    return r;
+}
+
+static JimDiyFp JimDiyFpNormalize(JimDiyFp x)
+{
+    while (!(x.f & (1ULL << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/* Returns the upper 64 bits of the 128 bit product, rounded */
+static JimDiyFp JimDiyFpMultiply(JimDiyFp x, JimDiyFp y)
+{
+    const unsigned long long M32 = 0xFFFFFFFFULL;
+    unsigned long long a = x.f >> 32;
+    unsigned long long b = x.f & M32;
+    unsigned long long c = y.f >> 32;
+    unsigned long long d = y.f & M32;
+    unsigned long long ac = a * c;
+    unsigned long long bc = b * c;
+    unsigned long long ad = a * d;
+    unsigned long long bd = b * d;
+    unsigned long long tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1ULL << 31);
+
+    return JimDiyFpMake(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64);
+}
+
+/**
+ * Nudges the last digit of 'buf' towards w while it stays within the unsafe interval,
+ * then checks that the result is provably the closest shortest representation.
+ *
+ * 'tooHigh' is the distance from the upper end of the unsafe interval to w, and 'unit'
+ * the error of the scaled values. All quantities are in the same (scaled) units.
+ * Returns 0 if the result can't be guaranteed.
+ */
+static int JimGrisuRoundWeed(char *buf, int len, unsigned long long tooHigh,
+    unsigned long long unsafe, unsigned long long rest, unsigned long long tenKappa,
+    unsigned long long unit)
+{
+    unsigned long long smallDist = tooHigh - unit;
+    unsigned long long bigDist = tooHigh + unit;
+
+    while (rest < smallDist && unsafe - rest >= tenKappa &&
+        (rest + tenKappa < smallDist || smallDist - rest >= rest + tenKappa - smallDist)) {
+        buf[len - 1]--;
+        rest += tenKappa;
+    }
+    /* If the digit could also be decremented for the far end of w's error, it is ambiguous */
+    if (rest < bigDist && unsafe - rest >= tenKappa &&
+        (rest + tenKappa < bigDist || bigDist - rest > rest + tenKappa - bigDist)) {
+        return 0;
+    }
+    /* Must be safely inside the interval, allowing for the error in its bounds */
+    return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+/**
+ * Produces the shortest digits of the (positive, finite, non-zero) 'value' into 'buf'
+ * with the Grisu3 algorithm and sets *K such that value = digits * 10^K.
+ *
+ * Returns the number of digits, at most 17, or 0 in the rare cases (about 0.5%)
+ * where Grisu3 can't prove its result is the shortest and closest.
+ */
+static int JimGrisu3(double value, char *buf, int *K)
+{
+    unsigned long long bits;
+    JimDiyFp v, w, mp, mm, cached, one;
+    unsigned long long unsafe, integrals, fractionals, tooHigh, unit = 1;
+    double dk;
+    int k, index, kappa, len = 0;
+
+    memcpy(&bits, &value, sizeof(bits));
+    v.f = bits & ((1ULL << 52) - 1);
+    if (bits >> 52) {
+        v.f += 1ULL << 52;
+        v.e = (int)(bits >> 52) - 1075;
+    }
+    else {
+        /* Subnormal */
+        v.e = -1074;
+    }
+
+    /* The boundaries halfway to the neighbouring doubles, with mm sharing mp's exponent */
+    mp = JimDiyFpNormalize(JimDiyFpMake((v.f << 1) + 1, v.e - 1));
+    if (v.f == 1ULL << 52 && v.e > -1074) {
+        /* The gap below a power of two is half the size */
+        mm = JimDiyFpMake((v.f << 2) - 1, v.e - 2);
+    }
+    else {
+        mm = JimDiyFpMake((v.f << 1) - 1, v.e - 1);
+    }
+    mm.f <<= mm.e - mp.e;
+    mm.e = mp.e;
+
+    /* Choose a power of ten that brings the exponent of the products into [-60, -32] */
+    dk = (-61 - mp.e) * 0.30102999566398114 + 347;
+    k = (int)dk;
+    if (dk - k > 0.0) {
+        k++;
+    }
+    index = (k >> 3) + 1;
+    *K = -(-348 + index * 8);
+    cached = JimDiyFpMake(JimCachedPowersF[index], JimCachedPowersE[index]);
+
+    w = JimDiyFpMultiply(JimDiyFpNormalize(v), cached);
+    mp = JimDiyFpMultiply(mp, cached);
+    mm = JimDiyFpMultiply(mm, cached);
+
+    /* Each product is out by less than one unit, so widen the boundaries into the
+     * "unsafe" interval, which certainly contains every value that reads back as 'value'.
+     * Digits are generated until the remainder falls within it.
+     */
+    mp.f += unit;
+    mm.f -= unit;
+    unsafe = mp.f - mm.f;
+    tooHigh = mp.f - w.f;
+    one = JimDiyFpMake(1ULL << -mp.e, mp.e);
+    integrals = mp.f >> -one.e;
+    fractionals = mp.f & (one.f - 1);
+    for (kappa = 10; kappa > 1 && integrals < JimPow10[kappa - 1]; kappa--) {
+    }
+    while (kappa > 0) {
+        unsigned long long d = integrals / JimPow10[kappa - 1];
+        unsigned long long rest;
+
+        integrals %= JimPow10[kappa - 1];
+        if (d || len) {
+            buf[len++] = '0' + (int)d;
+        }
+        kappa--;
+        rest = (integrals << -one.e) + fractionals;
+        if (rest < unsafe) {
+            *K += kappa;
+            return JimGrisuRoundWeed(buf, len, tooHigh, unsafe, rest,
+                JimPow10[kappa] << -one.e, unit) ? len : 0;
+        }
+    }
+    for (;;) {
+        int d;
+
+        fractionals *= 10;
+        unit *= 10;
+        unsafe *= 10;
+        d = (int)(fractionals >> -one.e);
+        if (d || len) {
+            buf[len++] = '0' + d;
+        }
+        fractionals &= one.f - 1;
+        kappa--;
+        if (fractionals < unsafe) {
+            *K += kappa;
+            return JimGrisuRoundWeed(buf, len, tooHigh * unit, unsafe, fractionals,
+                one.f, unit) ? len : 0;
+        }
+    }
+}
+
+/**
+ * The exact (but slow) fallback for JimGrisu3(), with the same result.
+ * Tries increasing precision until the correctly rounded digits read back as 'value'.
+ */
+static int JimShortestDigits(double value, char *buf, int *K)
+{
+    char tmp[32];
+    const char *p;
+    int prec, len = 0;
+
+    for (prec = 0; prec < 17; prec++) {
+        sprintf(tmp, "%.*e", prec, value);
+        if (strtod(tmp, NULL) == value) {
+            break;
+        }
+    }
+    for (p = tmp; *p != 'e'; p++) {
+        if (*p != '.') {
+            buf[len++] = *p;
+        }
+    }
+    *K = atoi(p + 1) - (len - 1);
+    return len;
+}
+
+/**
+ * Formats a finite double in the style of "%.17g", but with the shortest digits
+ * that round-trip, and always with a decimal point or exponent.
+ */
+static int JimFormatDouble(char *buf, double doubleValue)
+{
+    char digits[20];
+    unsigned long long bits;
+    int len, K, exp10, i;
+    char *p = buf;
+
+    memcpy(&bits, &doubleValue, sizeof(bits));
+    if (bits >> 63) {
+        *p++ = '-';
+        doubleValue = -doubleValue;
+    }
+    if (doubleValue == 0) {
+        memcpy(p, "0.0", 4);
+        return p - buf + 3;
+    }
+
+    len = JimGrisu3(doubleValue, digits, &K);
+    if (len == 0) {
+        len = JimShortestDigits(doubleValue, digits, &K);
+    }
+    /* The decimal exponent of the leading digit */
+    exp10 = len + K - 1;
+
+    if (exp10 < -4 || exp10 >= 17) {
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, len - 1);
+            p += len - 1;
+        }
+        *p++ = 'e';
+        if (exp10 < 0) {
+            *p++ = '-';
+            exp10 = -exp10;
+        }
+        else {
+            *p++ = '+';
+        }
+        if (exp10 >= 100) {
+            *p++ = '0' + exp10 / 100;
+            exp10 %= 100;
+        }
+        *p++ = JimDigitPairs[exp10 * 2];
+        *p++ = JimDigitPairs[exp10 * 2 + 1];
+    }
+    else if (exp10 < 0) {
+        *p++ = '0';
+        *p++ = '.';
+        for (i = -1; i > exp10; i--) {
+            *p++ = '0';
+        }
+        memcpy(p, digits, len);
+        p += len;
+    }
+    else if (len <= exp10 + 1) {
+        memcpy(p, digits, len);
+        p += len;
+        for (i = len; i <= exp10; i++) {
+            *p++ = '0';
+        }
+        *p++ = '.';
+        *p++ = '0';
+    }
+    else {
+        memcpy(p, digits, exp10 + 1);
+        p += exp10 + 1;
+        *p++ = '.';
+        memcpy(p, digits + exp10 + 1, len - exp10 - 1);
+        p += len - exp10 - 1;
+    }
+    *p = '\0';
+    return p - buf;
+}
+#endif
+
 int Jim_DoubleToString(char *buf, double doubleValue)
 {
     int len;
     int i;
 
-    len = sprintf(buf, "%.12g", doubleValue);
+#ifdef HAVE_LONG_LONG
+    if (doubleValue - doubleValue == 0) {
+        /* Finite */
+        return JimFormatDouble(buf, doubleValue);
+    }
+    len = sprintf(buf, "%g", doubleValue);
+#else
+    /* Use the fewest digits that read back as the same value */
+    for (i = 15; ; i++) {
+        len = sprintf(buf, "%.*g", i, doubleValue);
+        if (i == 17 || strtod(buf, NULL) == doubleValue) {
+            break;
+        }
+    }
+#endif
 
     /* Add a final ".0" if necessary */
     for (i = 0; i < len; i++) {
@@ -488,6 +950,85 @@ int Jim_DoubleToString(char *buf, double doubleValue)
     return i;
 }
 
+/**
+ * Fast path for Jim_StringToDouble().
+ *
+ * A plain decimal number such as "-12.375" or "6.02e23" with at most 15 significant
+ * digits and a small exponent is the quotient or product of two exactly representable
+ * doubles, so a single correctly rounded division or multiplication gives the same
+ * result as strtod().
+ *
+ * Returns 1 if *doublePtr was set, or 0 if strtod() is needed.
+ */
+static int JimStringToDoubleFast(const char *str, double *doublePtr)
+{
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *p = str + (*str == '-' || *str == '+');
+    const char *start = p;
+    double mantissa = 0;
+    int sigDigits = 0;
+    int exp10 = 0;
+
+    for (; isdigit(UCHAR(*p)); p++) {
+        if (mantissa || *p != '0') {
+            if (++sigDigits > 15) {
+                return 0;
+            }
+            mantissa = mantissa * 10 + (*p - '0');
+        }
+    }
+    if (*p == '.') {
+        for (p++; isdigit(UCHAR(*p)); p++) {
+            if (mantissa || *p != '0') {
+                if (++sigDigits > 15) {
+                    return 0;
+                }
+                mantissa = mantissa * 10 + (*p - '0');
+            }
+            exp10--;
+        }
+        if (p == start + 1) {
+            /* Just a decimal point */
+            return 0;
+        }
+    }
+    else if (p == start) {
+        return 0;
+    }
+    if (*p == 'e' || *p == 'E') {
+        int neg = 0;
+        int e = 0;
+
+        p++;
+        if (*p == '-' || *p == '+') {
+            neg = (*p++ == '-');
+        }
+        if (!isdigit(UCHAR(*p))) {
+            return 0;
+        }
+        for (; isdigit(UCHAR(*p)); p++) {
+            if (e < 1000) {
+                e = e * 10 + (*p - '0');
+            }
+        }
+        exp10 += neg ? -e : e;
+    }
+    if (*p || exp10 < -22 || exp10 > 22) {
+        return 0;
+    }
+    mantissa = exp10 < 0 ? mantissa / pow10[-exp10] : mantissa * pow10[exp10];
+    *doublePtr = *str == '-' ? -mantissa : mantissa;
+    return 1;
+#else
+    /* Without strict double evaluation, double rounding could give a different result */
+    return 0;
+#endif
+}
+
 int Jim_StringToDouble(const char *str, double *doublePtr)
 {
     char *endptr;
@@ -495,6 +1036,10 @@ int Jim_StringToDouble(const char *str, double *doublePtr)
     /* Callers can check for underflow via ERANGE */
     errno = 0;
 
+    if (JimStringToDoubleFast(str, doublePtr)) {
+        return JIM_OK;
+    }
+
     *doublePtr = strtod(str, &endptr);
 
     return JimCheckConversion(str, endptr);
@@ -619,19 +1164,97 @@ unsigned int Jim_IntHashFunction(unsigned int key)
     return key;
 }
 
-/* Generic hash function (we are using to multiply by 9 and add the byte
- * as Tcl) */
+/* MurmurHash3 (x86, 32 bit) by Austin Appleby, which consumes the key
+ * a word at a time and distributes well even when keys share long
+ * prefixes or suffixes.
+ *
+ * The seed is the initial state, so keys that collide with one seed
+ * are unrelated with another.
+ */
+static unsigned int JimHashBytes(const unsigned char *buf, int len, unsigned int seed)
+{
+    const unsigned int c1 = 0xcc9e2d51;
+    const unsigned int c2 = 0x1b873593;
+    unsigned int h = seed;
+    unsigned int k;
+    int n = len;
+
+    for (; n >= 4; n -= 4, buf += 4) {
+        /* Byte order doesn't matter, only that it is consistent */
+        memcpy(&k, buf, 4);
+        k *= c1;
+        k = (k << 15) | (k >> 17);
+        k *= c2;
+        h ^= k;
+        h = (h << 13) | (h >> 19);
+        h = h * 5 + 0xe6546b64;
+    }
+
+    k = 0;
+    switch (n) {
+        case 3:
+            k ^= buf[2] << 16;
+            /* fall through */
+        case 2:
+            k ^= buf[1] << 8;
+            /* fall through */
+        case 1:
+            k ^= buf[0];
+            k *= c1;
+            k = (k << 15) | (k >> 17);
+            k *= c2;
+            h ^= k;
+    }
+
+    h ^= (unsigned int)len;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Generic hash function for strings */
 unsigned int Jim_GenHashFunction(const unsigned char *buf, int len)
 {
-    unsigned int h = 0;
-
-    while (len--)
-        h += (h << 3) + *buf++;
-    return h;
+    return JimHashBytes(buf, len, 0);
 }
 
 /* ----------------------------- API implementation ------------------------- */
 
+/* The hash table uses open addressing with linear probing.
+ * Entries are stored directly in the table, along with the hash of their key
+ * so that most non-matching entries can be skipped without comparing keys,
+ * and so that the table can grow without rehashing any keys.
+ *
+ * An empty slot has key == NULL. A deleted entry is marked with
+ * JIM_HT_DELETED rather than moving other entries, so an iterator
+ * remains valid if the entry it returned is deleted.
+ *
+ * Growing or shrinking the table is incremental, so that no single insertion
+ * has to move every entry. A new table is allocated and the old one is kept
+ * in ht->oldtable while its entries are migrated, JIM_HT_REHASH_SLOTS slots
+ * at a time, by each insertion and deletion. In the meantime lookups
+ * check both tables.
+ *
+ * Iterators visit the old table and then the current table, so entries must
+ * not move between them during iteration. Creating the first iterator completes
+ * any migration in progress, and migration is suspended while there are active
+ * iterators. If the table grows during iteration, its entries stay in the old
+ * table and only entries added during iteration go into the new one. Should that
+ * fill up too, only the current table is rebuilt, and an iterator that then
+ * reaches it stops, as it holds no entries that were there when iteration began.
+ * So every entry present when iteration began is returned exactly once.
+ */
+static char JimHashDeletedKey;
+#define JIM_HT_DELETED ((void *)&JimHashDeletedKey)
+
+/* Number of slots of the old table migrated by each insertion or deletion.
+ * A table that is at most 3/4 full is migrated before the new table
+ * (at least twice the size) can fill up again */
+#define JIM_HT_REHASH_SLOTS 16
+
 /* reset a hashtable already initialized with ht_init().
  * NOTE: This function should only called by ht_destroy(). */
 static void JimResetHashTable(Jim_HashTable *ht)
@@ -641,6 +1264,11 @@ static void JimResetHashTable(Jim_HashTable *ht)
     ht->sizemask = 0;
     ht->used = 0;
     ht->collisions = 0;
+    ht->deleted = 0;
+    ht->oldtable = NULL;
+    ht->oldsize = 0;
+    ht->oldused = 0;
+    ht->rehashidx = 0;
 }
 
 /* Initialize the hash table */
@@ -649,78 +1277,166 @@ int Jim_InitHashTable(Jim_HashTable *ht, const Jim_HashTableType *type, void *pr
     JimResetHashTable(ht);
     ht->type = type;
     ht->privdata = privDataPtr;
+    ht->uniq = 0;
+    ht->iterators = 0;
+    ht->rebuilds = 0;
     return JIM_OK;
 }
 
-/* Resize the table to the minimal size that contains all the elements,
- * but with the invariant of a USER/BUCKETS ration near to <= 1 */
-void Jim_ResizeHashTable(Jim_HashTable *ht)
+/* Initialize a hash table whose keys may come from untrusted input.
+ * The interpreter's random seed is the initial state of each hash,
+ * so that colliding keys can't be chosen in advance.
+ * The type must have a seededHashFunction.
+ */
+static void JimInitSeededHashTable(Jim_Interp *interp, Jim_HashTable *ht, const Jim_HashTableType *type)
 {
-    int minimal = ht->used;
-
-    if (minimal < JIM_HT_INITIAL_SIZE)
-        minimal = JIM_HT_INITIAL_SIZE;
-    Jim_ExpandHashTable(ht, minimal);
+    Jim_InitHashTable(ht, type, interp);
+    ht->uniq = interp->hashSeed;
 }
 
-/* Expand or create the hashtable */
-void Jim_ExpandHashTable(Jim_HashTable *ht, unsigned int size)
+/* Migrates up to 'slots' slots of the old table into the current table,
+ * and frees the old table once it is empty. */
+static void JimRehashStep(Jim_HashTable *ht, unsigned int slots)
 {
-    Jim_HashTable n;            /* the new hashtable */
-    unsigned int realsize = JimHashTableNextPower(size), i;
+    while (slots-- && ht->oldused) {
+        Jim_HashEntry *he = &ht->oldtable[ht->rehashidx++];
 
-    /* the size is invalid if it is smaller than the number of
-     * elements already inside the hashtable */
-     if (size <= ht->used)
-        return;
+        if (he->key && he->key != JIM_HT_DELETED) {
+            Jim_HashEntry *dest;
+            unsigned int i;
+
+            /* The key can't already be in the current table */
+            for (i = he->hash & ht->sizemask; (dest = &ht->table[i])->key; i = (i + 1) & ht->sizemask) {
+                if (dest->key == JIM_HT_DELETED) {
+                    ht->deleted--;
+                    break;
+                }
+            }
+            *dest = *he;
+            /* Not NULL, since that could end the probe sequence
+             * of an entry still to be migrated */
+            he->key = JIM_HT_DELETED;
+            ht->oldused--;
+        }
+    }
+    if (ht->oldtable && ht->oldused == 0) {
+        Jim_Free(ht->oldtable);
+        ht->oldtable = NULL;
+        ht->oldsize = 0;
+        ht->rehashidx = 0;
+    }
+}
 
-    Jim_InitHashTable(&n, ht->type, ht->privdata);
-    n.size = realsize;
-    n.sizemask = realsize - 1;
-    n.table = Jim_Alloc(realsize * sizeof(Jim_HashEntry *));
+/* Completes any migration in progress. Must not be called with active iterators */
+static void JimFinishRehash(Jim_HashTable *ht)
+{
+    if (ht->oldtable) {
+        JimRehashStep(ht, ht->oldsize);
+    }
+}
 
-    /* Initialize all the pointers to NULL */
-    memset(n.table, 0, realsize * sizeof(Jim_HashEntry *));
+/* Moves the entries of the current table to a new one with room for 'size' entries,
+ * leaving the old table alone. Used instead of migrating while iterators are active. */
+static void JimRebuildCurrentTable(Jim_HashTable *ht, unsigned int size)
+{
+    Jim_HashEntry *table = ht->table;
+    unsigned int tablesize = ht->size;
+    unsigned int realsize = JimHashTableNextPower(size);
+    unsigned int i;
 
-    /* Copy all the elements from the old to the new table:
-     * note that if the old hash table is empty ht->used is zero,
-     * so Jim_ExpandHashTable just creates an empty hash table. */
-    n.used = ht->used;
-    for (i = 0; ht->used > 0; i++) {
-        Jim_HashEntry *he, *nextHe;
+    ht->table = Jim_Alloc(realsize * sizeof(Jim_HashEntry));
+    memset(ht->table, 0, realsize * sizeof(Jim_HashEntry));
+    ht->size = realsize;
+    ht->sizemask = realsize - 1;
+    ht->deleted = 0;
 
-        if (ht->table[i] == NULL)
-            continue;
+    for (i = 0; i < tablesize; i++) {
+        Jim_HashEntry *he = &table[i];
 
-        /* For each hash entry on this slot... */
-        he = ht->table[i];
-        while (he) {
-            unsigned int h;
+        if (he->key && he->key != JIM_HT_DELETED) {
+            unsigned int j;
 
-            nextHe = he->next;
-            /* Get the new element index */
-            h = Jim_HashKey(ht, he->key) & n.sizemask;
-            he->next = n.table[h];
-            n.table[h] = he;
-            ht->used--;
-            /* Pass to the next element */
-            he = nextHe;
+            for (j = he->hash & ht->sizemask; ht->table[j].key; j = (j + 1) & ht->sizemask) {
+            }
+            ht->table[j] = *he;
         }
     }
-    assert(ht->used == 0);
-    Jim_Free(ht->table);
-
-    /* Remap the new hashtable in the old */
-    *ht = n;
+    Jim_Free(table);
+    ht->rebuilds++;
 }
 
-/* Add an element to the target hash table */
-int Jim_AddHashEntry(Jim_HashTable *ht, const void *key, void *val)
+/* Starts migrating the entries to a new table with room for 'size' entries */
+static void JimStartRehash(Jim_HashTable *ht, unsigned int size)
 {
-    Jim_HashEntry *entry;
+    unsigned int realsize = JimHashTableNextPower(size);
 
-    /* Get the index of the new element, or -1 if
-     * the element already exists. */
+    if (ht->oldtable) {
+        if (ht->iterators) {
+            /* Can't start another migration without moving entries under the iterators */
+            JimRebuildCurrentTable(ht, size);
+            return;
+        }
+        JimFinishRehash(ht);
+    }
+
+    ht->oldtable = ht->table;
+    ht->oldsize = ht->size;
+    ht->oldused = ht->used;
+    ht->rehashidx = 0;
+
+    ht->table = Jim_Alloc(realsize * sizeof(Jim_HashEntry));
+    memset(ht->table, 0, realsize * sizeof(Jim_HashEntry));
+    ht->size = realsize;
+    ht->sizemask = realsize - 1;
+    ht->deleted = 0;
+
+    /* Small tables are cheap enough to migrate all at once */
+    if (ht->oldsize <= JIM_HT_REHASH_SLOTS * 4 && ht->iterators == 0) {
+        JimFinishRehash(ht);
+    }
+}
+
+/* Resize the table to the minimal size that contains all the elements,
+ * but with the invariant of a USER/BUCKETS ration near to <= 1 */
+void Jim_ResizeHashTable(Jim_HashTable *ht)
+{
+    int minimal = ht->used;
+
+    if (minimal < JIM_HT_INITIAL_SIZE)
+        minimal = JIM_HT_INITIAL_SIZE;
+    Jim_ExpandHashTable(ht, minimal);
+}
+
+/* Expand or create the hashtable */
+void Jim_ExpandHashTable(Jim_HashTable *ht, unsigned int size)
+{
+    unsigned int realsize = JimHashTableNextPower(size);
+
+    /* the size is invalid if it is smaller than the number of
+     * elements already inside the hashtable */
+     if (size <= ht->used)
+        return;
+
+    /* Probing needs some free slots, so keep the table no more than 3/4 full */
+    while (ht->used * 4 >= realsize * 3 && realsize < 2147483648U) {
+        realsize *= 2;
+    }
+
+    /* An explicit resize moves all the elements immediately, unless iterating.
+     * Note that if the old hash table is empty this just creates an empty table. */
+    JimStartRehash(ht, realsize);
+    if (ht->iterators == 0) {
+        JimFinishRehash(ht);
+    }
+}
+
+/* Add an element to the target hash table */
+int Jim_AddHashEntry(Jim_HashTable *ht, const void *key, void *val)
+{
+    Jim_HashEntry *entry;
+
+    /* Get the index of the new element, or -1 if
+     * the element already exists. */
     entry = JimInsertHashEntry(ht, key, 0);
     if (entry == NULL)
         return JIM_ERR;
@@ -755,79 +1471,157 @@ int Jim_ReplaceHashEntry(Jim_HashTable *ht, const void *key, void *val)
     return existed;
 }
 
+/* Returns the entry for 'key' with hash 'h' in the given table, or NULL */
+static Jim_HashEntry *JimProbeHashTable(Jim_HashTable *ht, Jim_HashEntry *table, unsigned int sizemask,
+    const void *key, unsigned int h)
+{
+    unsigned int i;
+
+    for (i = h & sizemask; table[i].key; i = (i + 1) & sizemask) {
+        Jim_HashEntry *he = &table[i];
+
+        if (he->hash == h && he->key != JIM_HT_DELETED && Jim_CompareHashKeys(ht, key, he->key))
+            return he;
+    }
+    return NULL;
+}
+
 /* Search and remove an element */
 int Jim_DeleteHashEntry(Jim_HashTable *ht, const void *key)
 {
+    Jim_HashEntry *he;
+    Jim_HashEntry entry;
     unsigned int h;
-    Jim_HashEntry *he, *prevHe;
 
     if (ht->used == 0)
-        return JIM_ERR;
-    h = Jim_HashKey(ht, key) & ht->sizemask;
-    he = ht->table[h];
+        return JIM_ERR;             /* not found */
 
-    prevHe = NULL;
-    while (he) {
-        if (Jim_CompareHashKeys(ht, key, he->key)) {
-            /* Unlink the element from the list */
-            if (prevHe)
-                prevHe->next = he->next;
-            else
-                ht->table[h] = he->next;
-            Jim_FreeEntryKey(ht, he);
-            Jim_FreeEntryVal(ht, he);
-            Jim_Free(he);
-            ht->used--;
-            return JIM_OK;
+    if (ht->oldtable && ht->iterators == 0) {
+        JimRehashStep(ht, JIM_HT_REHASH_SLOTS);
+    }
+
+    h = Jim_HashKey(ht, key);
+    he = JimProbeHashTable(ht, ht->table, ht->sizemask, key, h);
+    if (he == NULL) {
+        if (ht->oldtable) {
+            he = JimProbeHashTable(ht, ht->oldtable, ht->oldsize - 1, key, h);
+        }
+        if (he == NULL)
+            return JIM_ERR;         /* not found */
+
+        /* Entries still in the old table are simply marked as deleted.
+         * The old table is freed by the next migration step. */
+        entry = *he;
+        he->key = JIM_HT_DELETED;
+        ht->used--;
+        ht->oldused--;
+    }
+    else {
+        /* Remove the entry before running the destructors, which may
+         * use the table again */
+        entry = *he;
+        ht->used--;
+
+        if (ht->table[(he - ht->table + 1) & ht->sizemask].key == NULL) {
+            /* The next slot is empty, so no probe sequence continues past this
+             * one and it can be made empty too, along with any deleted
+             * entries before it. */
+            he->key = NULL;
+            while (1) {
+                he = &ht->table[(he - ht->table - 1) & ht->sizemask];
+                if (he->key != JIM_HT_DELETED) {
+                    break;
+                }
+                he->key = NULL;
+                ht->deleted--;
+            }
+        }
+        else {
+            he->key = JIM_HT_DELETED;
+            ht->deleted++;
+        }
+
+        /* Shrink the table once it is less than 1/8 full, but not while
+         * iterating since that would move the remaining entries */
+        if (ht->iterators == 0 && !ht->oldtable && ht->size > JIM_HT_INITIAL_SIZE && ht->used * 8 < ht->size) {
+            JimStartRehash(ht, ht->used * 2);
         }
-        prevHe = he;
-        he = he->next;
     }
-    return JIM_ERR;             /* not found */
+
+    Jim_FreeEntryKey(ht, &entry);
+    Jim_FreeEntryVal(ht, &entry);
+    return JIM_OK;
 }
 
-/* Destroy an entire hash table */
-int Jim_FreeHashTable(Jim_HashTable *ht)
+/* Frees the elements in the given table */
+static void JimFreeHashTableEntries(Jim_HashTable *ht, Jim_HashEntry *table, unsigned int size)
 {
     unsigned int i;
 
-    /* Free all the elements */
-    for (i = 0; ht->used > 0; i++) {
-        Jim_HashEntry *he, *nextHe;
+    for (i = 0; i < size; i++) {
+        Jim_HashEntry *he = &table[i];
 
-        if ((he = ht->table[i]) == NULL)
+        if (he->key == NULL || he->key == JIM_HT_DELETED)
             continue;
-        while (he) {
-            nextHe = he->next;
-            Jim_FreeEntryKey(ht, he);
-            Jim_FreeEntryVal(ht, he);
-            Jim_Free(he);
-            ht->used--;
-            he = nextHe;
+        Jim_FreeEntryKey(ht, he);
+        Jim_FreeEntryVal(ht, he);
+    }
+}
+
+/* Destroy an entire hash table */
+int Jim_FreeHashTable(Jim_HashTable *ht)
+{
+    /* Free all the elements */
+    if (ht->used) {
+        JimFreeHashTableEntries(ht, ht->table, ht->size);
+        if (ht->oldtable) {
+            JimFreeHashTableEntries(ht, ht->oldtable, ht->oldsize);
         }
     }
     /* Free the table and the allocated cache structure */
     Jim_Free(ht->table);
+    Jim_Free(ht->oldtable);
     /* Re-initialize the table */
     JimResetHashTable(ht);
     return JIM_OK;              /* never fails */
 }
 
+/* Removes all the elements, but keeps the table allocated for reuse */
+static void JimClearHashTable(Jim_HashTable *ht)
+{
+    if (ht->used) {
+        JimFreeHashTableEntries(ht, ht->table, ht->size);
+        if (ht->oldtable) {
+            JimFreeHashTableEntries(ht, ht->oldtable, ht->oldsize);
+        }
+        ht->used = 0;
+    }
+    if (ht->oldtable) {
+        Jim_Free(ht->oldtable);
+        ht->oldtable = NULL;
+        ht->oldsize = 0;
+        ht->oldused = 0;
+        ht->rehashidx = 0;
+    }
+    if (ht->table) {
+        memset(ht->table, 0, ht->size * sizeof(Jim_HashEntry));
+    }
+    ht->deleted = 0;
+}
+
 Jim_HashEntry *Jim_FindHashEntry(Jim_HashTable *ht, const void *key)
 {
-    Jim_HashEntry *he;
     unsigned int h;
+    Jim_HashEntry *he;
 
     if (ht->used == 0)
         return NULL;
-    h = Jim_HashKey(ht, key) & ht->sizemask;
-    he = ht->table[h];
-    while (he) {
-        if (Jim_CompareHashKeys(ht, key, he->key))
-            return he;
-        he = he->next;
+    h = Jim_HashKey(ht, key);
+    he = JimProbeHashTable(ht, ht->table, ht->sizemask, key, h);
+    if (he == NULL && ht->oldtable) {
+        he = JimProbeHashTable(ht, ht->oldtable, ht->oldsize - 1, key, h);
     }
-    return NULL;
+    return he;
 }
 
 Jim_HashTableIterator *Jim_GetHashTableIterator(Jim_HashTable *ht)
@@ -838,28 +1632,51 @@ Jim_HashTableIterator *Jim_GetHashTableIterator(Jim_HashTable *ht)
     iter->index = -1;
     iter->entry = NULL;
     iter->nextEntry = NULL;
+    if (ht->iterators++ == 0) {
+        /* Start with all the entries in one table */
+        JimFinishRehash(ht);
+    }
+    iter->rebuilds = ht->rebuilds;
     return iter;
 }
 
+void Jim_FreeHashTableIterator(Jim_HashTableIterator *iter)
+{
+    iter->ht->iterators--;
+    Jim_Free(iter);
+}
+
 Jim_HashEntry *Jim_NextHashEntry(Jim_HashTableIterator *iter)
 {
+    Jim_HashTable *ht = iter->ht;
+
+    /* While migrating, the old table is visited first, followed by the new table.
+     * If migration starts during iteration, the table being visited becomes the old table,
+     * so the index remains valid. */
     while (1) {
-        if (iter->entry == NULL) {
-            iter->index++;
-            if (iter->index >= (signed)iter->ht->size)
-                break;
-            iter->entry = iter->ht->table[iter->index];
+        Jim_HashEntry *he;
+        unsigned int index = ++iter->index;
+
+        if (index < ht->oldsize) {
+            he = &ht->oldtable[index];
+        }
+        else if (index - ht->oldsize < ht->size && iter->rebuilds == ht->rebuilds) {
+            /* (If the table was rebuilt, it only holds entries added since the
+             * iterator was created, and they may have moved) */
+            he = &ht->table[index - ht->oldsize];
         }
         else {
-            iter->entry = iter->nextEntry;
+            break;
         }
-        if (iter->entry) {
-            /* We need to save the 'next' here, the iterator user
-             * may delete the entry we are returning. */
-            iter->nextEntry = iter->entry->next;
-            return iter->entry;
+
+        /* Note that the iterator user may delete the entry we are returning.
+         * That's fine since deleting an entry never moves other entries. */
+        if (he->key && he->key != JIM_HT_DELETED) {
+            iter->entry = he;
+            return he;
         }
     }
+    iter->entry = NULL;
     return NULL;
 }
 
@@ -868,12 +1685,15 @@ Jim_HashEntry *Jim_NextHashEntry(Jim_HashTableIterator *iter)
 /* Expand the hash table if needed */
 static void JimExpandHashTableIfNeeded(Jim_HashTable *ht)
 {
-    /* If the hash table is empty expand it to the intial size,
-     * if the table is "full" dobule its size. */
+    /* If the hash table is empty expand it to the intial size.
+     * Otherwise keep at most 3/4 of the slots in use (including deleted entries,
+     * and entries not yet migrated from the old table)
+     * by doubling the size, or just by dropping the deleted entries if that
+     * leaves the table no more than half full. */
     if (ht->size == 0)
         Jim_ExpandHashTable(ht, JIM_HT_INITIAL_SIZE);
-    if (ht->size == ht->used)
-        Jim_ExpandHashTable(ht, ht->size * 2);
+    else if ((ht->used + ht->deleted + 1) * 4 > ht->size * 3)
+        JimStartRehash(ht, (ht->used + 1) * 2 > ht->size ? ht->size * 2 : ht->size);
 }
 
 /* Our hash table capability is a power of two */
@@ -890,33 +1710,53 @@ static unsigned int JimHashTableNextPower(unsigned int size)
     }
 }
 
-/* Returns the index of a free slot that can be populated with
- * an hash entry for the given 'key'.
- * If the key already exists, -1 is returned. */
+/* Returns the entry to be populated with the given 'key',
+ * with entry->key set to NULL.
+ * If the key already exists, returns the existing entry if 'replace' is set,
+ * or NULL otherwise. */
 static Jim_HashEntry *JimInsertHashEntry(Jim_HashTable *ht, const void *key, int replace)
 {
-    unsigned int h;
+    unsigned int h, i;
     Jim_HashEntry *he;
+    Jim_HashEntry *deleted = NULL;
 
     /* Expand the hashtable if needed */
     JimExpandHashTableIfNeeded(ht);
 
     /* Compute the key hash value */
-    h = Jim_HashKey(ht, key) & ht->sizemask;
-    /* Search if this slot does not already contain the given key */
-    he = ht->table[h];
-    while (he) {
-        if (Jim_CompareHashKeys(ht, key, he->key))
+    h = Jim_HashKey(ht, key);
+
+    if (ht->oldtable) {
+        if (ht->iterators == 0) {
+            JimRehashStep(ht, JIM_HT_REHASH_SLOTS);
+        }
+        /* The key may not have been migrated yet */
+        if (ht->oldtable) {
+            he = JimProbeHashTable(ht, ht->oldtable, ht->oldsize - 1, key, h);
+            if (he) {
+                return replace ? he : NULL;
+            }
+        }
+    }
+
+    /* Search if the table does not already contain the given key,
+     * remembering the first deleted entry which can be reused */
+    for (i = h & ht->sizemask; (he = &ht->table[i])->key; i = (i + 1) & ht->sizemask) {
+        if (he->key == JIM_HT_DELETED) {
+            if (deleted == NULL)
+                deleted = he;
+        }
+        else if (he->hash == h && Jim_CompareHashKeys(ht, key, he->key))
             return replace ? he : NULL;
-        he = he->next;
     }
 
-    /* Allocates the memory and stores key */
-    he = Jim_Alloc(sizeof(*he));
-    he->next = ht->table[h];
-    ht->table[h] = he;
+    if (deleted) {
+        he = deleted;
+        ht->deleted--;
+    }
     ht->used++;
     he->key = NULL;
+    he->hash = h;
 
     return he;
 }
@@ -928,6 +1768,11 @@ static unsigned int JimStringCopyHTHashFunction(const void *key)
     return Jim_GenHashFunction(key, strlen(key));
 }
 
+static unsigned int JimStringCopyHTSeededHashFunction(const void *key, unsigned int seed)
+{
+    return JimHashBytes(key, strlen(key), seed);
+}
+
 static void *JimStringCopyHTDup(void *privdata, const void *key)
 {
     return strdup(key);
@@ -949,7 +1794,8 @@ static const Jim_HashTableType JimPackageHashTableType = {
     NULL,                            /* val dup */
     JimStringCopyHTKeyCompare,       /* key compare */
     JimStringCopyHTKeyDestructor,    /* key destructor */
-    NULL                             /* val destructor */
+    NULL,                            /* val destructor */
+    JimStringCopyHTSeededHashFunction /* seeded hash function */
 };
 
 typedef struct AssocDataValue
@@ -973,7 +1819,8 @@ static const Jim_HashTableType JimAssocDataHashTableType = {
     NULL,                           /* val dup */
     JimStringCopyHTKeyCompare,      /* key compare */
     JimStringCopyHTKeyDestructor,   /* key destructor */
-    JimAssocDataHashTableValueDestructor        /* val destructor */
+    JimAssocDataHashTableValueDestructor,       /* val destructor */
+    JimStringCopyHTSeededHashFunction           /* seeded hash function */
 };
 
 /* -----------------------------------------------------------------------------
@@ -2046,80 +2893,322 @@ static int JimParseListStr(struct JimParserCtx *pc)
  * Jim_Obj related functions
  * ---------------------------------------------------------------------------*/
 
+/* Objects are allocated from slabs of JIM_OBJ_SLAB_SIZE objects.
+ * Every object, live or not, can be found by walking interp->objSlabs.
+ * Unused objects have refCount == -1 and are linked into interp->freeList
+ * through internalRep.ptr.
+ *
+ * Once there are more than interp->freeObjLimit unused objects,
+ * any slabs with no live objects are released.
+ */
+#define JIM_OBJ_SLAB_SIZE 256
+/* Unused objects are never released below this number */
+#define JIM_OBJ_FREE_HIGHWATER 65536
+
+typedef struct Jim_ObjSlab {
+    struct Jim_ObjSlab *next;
+    Jim_Obj objs[JIM_OBJ_SLAB_SIZE];
+} Jim_ObjSlab;
+
+#define JimNextFreeObj(objPtr) ((objPtr)->internalRep.ptr)
+
+#ifdef JIM_REFERENCES
+/* State of the incremental reference collector.
+ *
+ * Only the candidate objects, which may hold the text of a reference, are
+ * scanned for references:
+ *
+ * - Reference objects, from Jim_NewReference() or converted from a string.
+ * - Objects whose string rep is built from a candidate's, by duplicating it,
+ *   appending it, substituting it into a word or concatenating it.
+ * - The elements parsed from a candidate list or script, and a list or dict
+ *   which keeps its string rep after giving up candidate elements.
+ *
+ * So a reference whose text is assembled by other means, such as [string range]
+ * or reading it back from a file, doesn't keep the reference alive.
+ * In exchange, the cost of a collection depends only on the number of
+ * candidates, not on the number of live objects.
+ *
+ * Candidates are flagged with JIM_GC_CANDIDATE and listed in 'candidates'.
+ * A freed candidate loses the flag but keeps its entry (and JIM_GC_LISTED)
+ * until the list is compacted, which never happens while marking.
+ *
+ * An incremental collection marks the references held by the candidates
+ * which exist when it starts, scanning a few at a time across calls
+ * to Jim_CollectIfNeeded(). Only references which already existed at the
+ * start may be collected. While marking:
+ *
+ * - Candidates created since marking started are added to the end of the list,
+ *   and are scanned when it completes. Freed objects are not reused,
+ *   so that the entries in the list remain valid.
+ * - Candidates are scanned as they are freed, so that a reference held only by
+ *   an object which has not been reached yet is not lost.
+ *
+ * If the program allocates too many objects before marking completes, the
+ * collection is abandoned and the next one is performed in full.
+ */
+typedef struct Jim_GcState {
+    Jim_Obj **candidates;       /* Objects which may hold references. See above */
+    int numCandidates;          /* Entries in 'candidates' */
+    int maxCandidates;          /* Allocated entries */
+    Jim_HashTable marks;        /* Ids of the references found so far */
+    int marking;                /* Set while an incremental collection is marking */
+    int abandoned;              /* Set if the last incremental collection was abandoned */
+    unsigned long maxId;        /* Only references with a lower id may be collected */
+    int oldCandidates;          /* The number of candidates when marking started */
+    int nextCandidate;          /* The next of those candidates to scan */
+    int scanned;                /* Candidates scanned by the collection in progress */
+    int numOldSlabs;            /* The number of slabs when marking started */
+    int numNewSlabs;            /* The number of slabs allocated since then */
+    int freeObjLimit;           /* Saved interp->freeObjLimit */
+    Jim_Obj *freeList;          /* Unused objects set aside until marking completes */
+    /* Statistics, reported by [collect -stats] */
+    long cycles;                /* Completed collections, full or incremental */
+    long steps;                 /* Incremental steps */
+    long abandons;              /* Abandoned incremental collections */
+    long collected;             /* Total references collected */
+    long lastScanned;           /* Candidates scanned by the last completed collection */
+    jim_wide lastPause;         /* Duration of the last step or full collection (us) */
+    jim_wide maxPause;          /* Longest such duration (us) */
+    jim_wide totalPause;        /* Total duration of all of them (us) */
+} Jim_GcState;
+
+/* An incremental collection is abandoned if this many slabs, beyond half of the
+ * slabs which existed when it started, are allocated before marking completes */
+#define JIM_COLLECT_MAX_NEW_SLABS 64
+
+/* Values of Jim_Obj.gcFlags */
+#define JIM_GC_CANDIDATE 1      /* The object may hold the text of a reference */
+#define JIM_GC_LISTED 2         /* The object has an entry in gcState->candidates */
+
+static void JimMarkReferences(Jim_HashTable *marks, Jim_Obj *objPtr);
+static void JimAbandonMarking(Jim_Interp *interp);
+
+/* Removes the entries for freed objects from the list of candidates */
+static void JimCompactGcCandidates(Jim_GcState *gc)
+{
+    int i, n = 0;
+
+    for (i = 0; i < gc->numCandidates; i++) {
+        Jim_Obj *objPtr = gc->candidates[i];
+
+        if (objPtr->gcFlags & JIM_GC_CANDIDATE) {
+            gc->candidates[n++] = objPtr;
+        }
+        else {
+            objPtr->gcFlags &= ~JIM_GC_LISTED;
+        }
+    }
+    gc->numCandidates = n;
+}
+
+/* Adds the object to the set of objects scanned for references */
+static void JimAddGcCandidate(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    Jim_GcState *gc = interp->gcState;
+
+    objPtr->gcFlags |= JIM_GC_CANDIDATE;
+    if (objPtr->gcFlags & JIM_GC_LISTED) {
+        return;
+    }
+    if (gc->numCandidates == gc->maxCandidates) {
+        if (!gc->marking) {
+            JimCompactGcCandidates(gc);
+        }
+        /* Grow unless compaction freed more than half of the entries */
+        if (gc->numCandidates * 2 >= gc->maxCandidates) {
+            gc->maxCandidates = gc->maxCandidates * 2 + 64;
+            gc->candidates = Jim_Realloc(gc->candidates, sizeof(*gc->candidates) * gc->maxCandidates);
+        }
+    }
+    gc->candidates[gc->numCandidates++] = objPtr;
+    objPtr->gcFlags |= JIM_GC_LISTED;
+}
+
+/* Makes objPtr a candidate if any of the objects its string rep was built from is one */
+static void JimInheritGcCandidates(Jim_Interp *interp, Jim_Obj *objPtr, Jim_Obj *const *objv, int objc)
+{
+    int i;
+
+    for (i = 0; i < objc; i++) {
+        if (objv[i] && (objv[i]->gcFlags & JIM_GC_CANDIDATE)) {
+            JimAddGcCandidate(interp, objPtr);
+            return;
+        }
+    }
+}
+
+#define JimInheritGcCandidate(interp, objPtr, fromPtr) \
+    do { \
+        if ((fromPtr)->gcFlags & JIM_GC_CANDIDATE) \
+            JimAddGcCandidate((interp), (objPtr)); \
+    } while (0)
+#else
+#define JimInheritGcCandidate(interp, objPtr, fromPtr)
+#endif
+
+/* Allocates a new slab and adds its objects to the free list */
+static void JimNewObjSlab(Jim_Interp *interp)
+{
+    Jim_ObjSlab *slab;
+    int i;
+
+#ifdef JIM_REFERENCES
+    if (interp->gcState->marking) {
+        Jim_GcState *gc = interp->gcState;
+
+        if (++gc->numNewSlabs > gc->numOldSlabs / 2 + JIM_COLLECT_MAX_NEW_SLABS) {
+            /* The collector can't keep up with allocation */
+            JimAbandonMarking(interp);
+            gc->abandoned = 1;
+        }
+    }
+#endif
+
+    slab = Jim_Alloc(sizeof(*slab));
+    slab->next = interp->objSlabs;
+    interp->objSlabs = slab;
+
+    /* Objects are handed out in address order */
+    for (i = JIM_OBJ_SLAB_SIZE - 1; i >= 0; i--) {
+        slab->objs[i].refCount = -1;
+        slab->objs[i].gcFlags = 0;
+        JimNextFreeObj(&slab->objs[i]) = interp->freeList;
+        interp->freeList = &slab->objs[i];
+    }
+    interp->freeObjCount += JIM_OBJ_SLAB_SIZE;
+}
+
+/* Releases every slab with no live objects, and rebuilds the free list
+ * from the unused objects in the remaining slabs. */
+static void JimReleaseObjSlabs(Jim_Interp *interp)
+{
+    Jim_ObjSlab **slabPtr = &interp->objSlabs;
+    int slabs = 0;
+
+#ifdef JIM_REFERENCES
+    /* Released slabs must not be left in the list of candidates */
+    JimCompactGcCandidates(interp->gcState);
+#endif
+    interp->freeList = NULL;
+    interp->freeObjCount = 0;
+
+    while (*slabPtr) {
+        Jim_ObjSlab *slab = *slabPtr;
+        int i, unused = 0;
+
+        for (i = 0; i < JIM_OBJ_SLAB_SIZE; i++) {
+            if (slab->objs[i].refCount == -1) {
+                unused++;
+            }
+        }
+        if (unused == JIM_OBJ_SLAB_SIZE) {
+            *slabPtr = slab->next;
+            Jim_Free(slab);
+            continue;
+        }
+        for (i = JIM_OBJ_SLAB_SIZE - 1; i >= 0; i--) {
+            if (slab->objs[i].refCount == -1) {
+                JimNextFreeObj(&slab->objs[i]) = interp->freeList;
+                interp->freeList = &slab->objs[i];
+            }
+        }
+        interp->freeObjCount += unused;
+        slabs++;
+        slabPtr = &slab->next;
+    }
+
+    /* Don't try again until a significant number of objects have been freed,
+     * so that the cost of scanning the slabs is amortised */
+    interp->freeObjLimit = interp->freeObjCount +
+        (slabs * JIM_OBJ_SLAB_SIZE / 4 > JIM_OBJ_FREE_HIGHWATER ? slabs * JIM_OBJ_SLAB_SIZE / 4 : JIM_OBJ_FREE_HIGHWATER);
+}
+
 /* Return a new initialized object. */
 Jim_Obj *Jim_NewObj(Jim_Interp *interp)
 {
     Jim_Obj *objPtr;
 
     /* -- Check if there are objects in the free list -- */
-    if (interp->freeList != NULL) {
-        /* -- Unlink the object from the free list -- */
-        objPtr = interp->freeList;
-        interp->freeList = objPtr->nextObjPtr;
-    }
-    else {
-        /* -- No ready to use objects: allocate a new one -- */
-        objPtr = Jim_Alloc(sizeof(*objPtr));
+    if (interp->freeList == NULL) {
+        /* -- No ready to use objects: allocate a new slab -- */
+        JimNewObjSlab(interp);
     }
+    /* -- Unlink the object from the free list -- */
+    objPtr = interp->freeList;
+    interp->freeList = JimNextFreeObj(objPtr);
+    interp->freeObjCount--;
 
     /* Object is returned with refCount of 0. Every
      * kind of GC implemented should take care to don't try
      * to scan objects with refCount == 0. */
     objPtr->refCount = 0;
+    objPtr->hash = 0;
     /* All the other fields are left not initialized to save time.
      * The caller will probably want to set them to the right
      * value anyway. */
 
-    /* -- Put the object into the live list -- */
-    objPtr->prevObjPtr = NULL;
-    objPtr->nextObjPtr = interp->liveList;
-    if (interp->liveList)
-        interp->liveList->prevObjPtr = objPtr;
-    interp->liveList = objPtr;
-
     return objPtr;
 }
 
-/* Free an object. Actually objects are never freed, but
+/* Free an object. Actually objects are not freed immediately, but
  * just moved to the free objects list, where they will be
- * reused by Jim_NewObj(). */
+ * reused by Jim_NewObj(). Slabs holding only unused objects
+ * are released once the free list grows too large. */
 void Jim_FreeObj(Jim_Interp *interp, Jim_Obj *objPtr)
 {
     /* Check if the object was already freed, panic. */
     JimPanic((objPtr->refCount != 0, "!!!Object %p freed with bad refcount %d, type=%s", objPtr,
         objPtr->refCount, objPtr->typePtr ? objPtr->typePtr->name : "<none>"));
 
+#ifdef JIM_REFERENCES
+    if (interp->gcState->marking && (objPtr->gcFlags & JIM_GC_CANDIDATE)) {
+        /* Don't lose any references held only by this object */
+        JimMarkReferences(&interp->gcState->marks, objPtr);
+    }
+#endif
     /* Free the internal representation */
     Jim_FreeIntRep(interp, objPtr);
     /* Free the string representation */
-    if (objPtr->bytes != NULL) {
-        if (objPtr->bytes != JimEmptyStringRep)
-            Jim_Free(objPtr->bytes);
-    }
-    /* Unlink the object from the live objects list */
-    if (objPtr->prevObjPtr)
-        objPtr->prevObjPtr->nextObjPtr = objPtr->nextObjPtr;
-    if (objPtr->nextObjPtr)
-        objPtr->nextObjPtr->prevObjPtr = objPtr->prevObjPtr;
-    if (interp->liveList == objPtr)
-        interp->liveList = objPtr->nextObjPtr;
+    JimFreeStringRep(objPtr);
+    objPtr->refCount = -1;
+#ifdef JIM_REFERENCES
+    objPtr->gcFlags &= ~JIM_GC_CANDIDATE;
+#endif
+    interp->freeObjCount++;
+#ifdef JIM_REFERENCES
+    if (interp->gcState->marking) {
+        /* Set aside, so that it isn't reused until marking completes */
+        JimNextFreeObj(objPtr) = interp->gcState->freeList;
+        interp->gcState->freeList = objPtr;
+        return;
+    }
+#endif
     /* Link the object into the free objects list */
-    objPtr->prevObjPtr = NULL;
-    objPtr->nextObjPtr = interp->freeList;
-    if (interp->freeList)
-        interp->freeList->prevObjPtr = objPtr;
+    JimNextFreeObj(objPtr) = interp->freeList;
     interp->freeList = objPtr;
-    objPtr->refCount = -1;
+    if (interp->freeObjCount > interp->freeObjLimit) {
+        JimReleaseObjSlabs(interp);
+    }
 }
 
 /* Invalidate the string representation of an object. */
 void Jim_InvalidateStringRep(Jim_Obj *objPtr)
 {
-    if (objPtr->bytes != NULL) {
-        if (objPtr->bytes != JimEmptyStringRep)
-            Jim_Free(objPtr->bytes);
-    }
+    JimFreeStringRep(objPtr);
     objPtr->bytes = NULL;
+    /* No longer interned, since the string will change */
+    objPtr->hash = 0;
+}
+
+/* Returns a buffer for a string rep of 'len' bytes plus the null terminator,
+ * within the object itself if short enough */
+static char *JimAllocStringRep(Jim_Obj *objPtr, int len)
+{
+    if (len < JIM_OBJ_INLINE_BYTES) {
+        return objPtr->inlineBytes;
+    }
+    return Jim_Alloc(len + 1);
 }
 
 #define Jim_SetStringRep(o, b, l) \
@@ -2134,7 +3223,7 @@ void Jim_InitStringRep(Jim_Obj *objPtr, const char *bytes, int length)
         objPtr->length = 0;
     }
     else {
-        objPtr->bytes = Jim_Alloc(length + 1);
+        objPtr->bytes = JimAllocStringRep(objPtr, length);
         objPtr->length = length;
         memcpy(objPtr->bytes, bytes, length);
         objPtr->bytes[length] = '\0';
@@ -2166,6 +3255,7 @@ Jim_Obj *Jim_DuplicateObj(Jim_Interp *interp, Jim_Obj *objPtr)
             objPtr->typePtr->dupIntRepProc(interp, objPtr, dupPtr);
         }
     }
+    JimInheritGcCandidate(interp, dupPtr, objPtr);
     return dupPtr;
 }
 
@@ -2233,12 +3323,13 @@ static const Jim_ObjType interpolatedObjType = {
 /* -----------------------------------------------------------------------------
  * String Object
  * ---------------------------------------------------------------------------*/
+static void FreeStringInternalRep(Jim_Interp *interp, Jim_Obj *objPtr);
 static void DupStringInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr);
 static int SetStringFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr);
 
 static const Jim_ObjType stringObjType = {
     "string",
-    NULL,
+    FreeStringInternalRep,
     DupStringInternalRep,
     NULL,
     JIM_TYPE_REFERENCES,
@@ -2256,6 +3347,7 @@ static void DupStringInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *d
     dupPtr->internalRep.strValue.maxLength = srcPtr->length;
 
     dupPtr->internalRep.strValue.charLength = srcPtr->internalRep.strValue.charLength;
+    dupPtr->internalRep.strValue.utf8Index = NULL;
 }
 
 static int SetStringFromAny(Jim_Interp *interp, Jim_Obj *objPtr)
@@ -2274,6 +3366,7 @@ static int SetStringFromAny(Jim_Interp *interp, Jim_Obj *objPtr)
         objPtr->internalRep.strValue.maxLength = objPtr->length;
         /* Don't know the utf-8 length yet */
         objPtr->internalRep.strValue.charLength = -1;
+        objPtr->internalRep.strValue.utf8Index = NULL;
     }
     return JIM_OK;
 }
@@ -2297,52 +3390,220 @@ int Jim_Utf8Length(Jim_Interp *interp, Jim_Obj *objPtr)
 #endif
 }
 
-/* len is in bytes -- see also Jim_NewStringObjUtf8() */
-Jim_Obj *Jim_NewStringObj(Jim_Interp *interp, const char *s, int len)
-{
-    Jim_Obj *objPtr = Jim_NewObj(interp);
-
-    /* Need to find out how many bytes the string requires */
-    if (len == -1)
-        len = strlen(s);
-    /* Alloc/Set the string rep. */
-    if (len == 0) {
-        objPtr->bytes = JimEmptyStringRep;
-        objPtr->length = 0;
-    }
-    else {
-        objPtr->bytes = Jim_Alloc(len + 1);
-        objPtr->length = len;
-        memcpy(objPtr->bytes, s, len);
-        objPtr->bytes[len] = '\0';
-    }
+/* -----------------------------------------------------------------------------
+ * UTF-8 Character Index
+ *
+ * utf8_index() scans from the start of the string, so walking a long
+ * string by character index is quadratic. Long strings therefore get a
+ * sparse index holding the byte offset of every JIM_UTF8_INDEX_STRIDE'th
+ * character, so that any lookup scans at most one stride.
+ * The index is extended lazily as far as lookups require, and stays
+ * valid when the string is appended to since existing offsets don't move.
+ * A string whose char length equals its byte length is all ASCII and
+ * needs no index at all.
+ * ---------------------------------------------------------------------------*/
+#define JIM_UTF8_INDEX_STRIDE 256
+/* Shorter strings are scanned directly */
+#define JIM_UTF8_INDEX_MIN (JIM_UTF8_INDEX_STRIDE * 4)
 
-    /* No typePtr field for the vanilla string object. */
-    objPtr->typePtr = NULL;
-    return objPtr;
-}
+typedef struct Jim_Utf8Index {
+    int count;          /* Number of valid entries in offsets[] */
+    int size;           /* Allocated entries in offsets[] */
+    int *offsets;       /* offsets[i] is the byte offset of char i * JIM_UTF8_INDEX_STRIDE */
+} Jim_Utf8Index;
 
-/* charlen is in characters -- see also Jim_NewStringObj() */
-Jim_Obj *Jim_NewStringObjUtf8(Jim_Interp *interp, const char *s, int charlen)
+/**
+ * Returns 1 if every char in the string of byte length 'len' is a single byte.
+ */
+static int JimIsAscii(const char *str, int len)
 {
 #ifdef JIM_UTF8
-    /* Need to find out how many bytes the string requires */
-    int bytelen = utf8_index(s, charlen);
-
-    Jim_Obj *objPtr = Jim_NewStringObj(interp, s, bytelen);
-
-    /* Remember the utf8 length, so set the type */
-    objPtr->typePtr = &stringObjType;
-    objPtr->internalRep.strValue.maxLength = bytelen;
-    objPtr->internalRep.strValue.charLength = charlen;
-
-    return objPtr;
+    while (len--) {
+        if (*str++ & 0x80) {
+            return 0;
+        }
+    }
 #else
-    return Jim_NewStringObj(interp, s, charlen);
+    JIM_NOTUSED(str);
+    JIM_NOTUSED(len);
 #endif
+    return 1;
 }
 
-/* This version does not try to duplicate the 's' pointer, but
+static void FreeStringInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    Jim_Utf8Index *index = objPtr->internalRep.strValue.utf8Index;
+
+    JIM_NOTUSED(interp);
+
+    if (index) {
+        Jim_Free(index->offsets);
+        Jim_Free(index);
+    }
+}
+
+/**
+ * Returns the byte offset of char 'charIndex' in the string rep of 'objPtr',
+ * where 0 <= charIndex <= Jim_Utf8Length(interp, objPtr).
+ */
+static int JimStringUtf8Offset(Jim_Interp *interp, Jim_Obj *objPtr, int charIndex)
+{
+#ifdef JIM_UTF8
+    Jim_Utf8Index *index;
+    int n;
+
+    if (Jim_Utf8Length(interp, objPtr) == objPtr->length) {
+        /* All ASCII */
+        return charIndex;
+    }
+    if (objPtr->length < JIM_UTF8_INDEX_MIN) {
+        return utf8_index(objPtr->bytes, charIndex);
+    }
+
+    index = objPtr->internalRep.strValue.utf8Index;
+    if (index == NULL) {
+        index = Jim_Alloc(sizeof(*index));
+        index->size = 16;
+        index->offsets = Jim_Alloc(sizeof(*index->offsets) * index->size);
+        index->offsets[0] = 0;
+        index->count = 1;
+        objPtr->internalRep.strValue.utf8Index = index;
+    }
+
+    /* Extend the index as far as the entry at or before charIndex */
+    n = charIndex / JIM_UTF8_INDEX_STRIDE;
+    while (index->count <= n) {
+        int offset = index->offsets[index->count - 1];
+
+        if (index->count == index->size) {
+            index->size *= 2;
+            index->offsets = Jim_Realloc(index->offsets, sizeof(*index->offsets) * index->size);
+        }
+        index->offsets[index->count++] = offset + utf8_index(objPtr->bytes + offset, JIM_UTF8_INDEX_STRIDE);
+    }
+    return index->offsets[n] + utf8_index(objPtr->bytes + index->offsets[n], charIndex - n * JIM_UTF8_INDEX_STRIDE);
+#else
+    JIM_NOTUSED(interp);
+    JIM_NOTUSED(objPtr);
+    return charIndex;
+#endif
+}
+
+/**
+ * The reverse of JimStringUtf8Offset(). Returns the char index of the char
+ * starting at 'byteOffset' in the string rep of 'objPtr'.
+ */
+#ifdef JIM_UTF8
+static int JimStringUtf8CharIndex(Jim_Interp *interp, Jim_Obj *objPtr, int byteOffset)
+{
+    Jim_Utf8Index *index;
+    int lo, hi;
+
+    if (Jim_Utf8Length(interp, objPtr) == objPtr->length) {
+        /* All ASCII */
+        return byteOffset;
+    }
+    index = objPtr->internalRep.strValue.utf8Index;
+    if (index == NULL) {
+        return utf8_strlen(objPtr->bytes, byteOffset);
+    }
+
+    /* Find the last entry at or before byteOffset */
+    lo = 0;
+    hi = index->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (index->offsets[mid] <= byteOffset) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return lo * JIM_UTF8_INDEX_STRIDE + utf8_strlen(objPtr->bytes + index->offsets[lo], byteOffset - index->offsets[lo]);
+}
+#endif
+
+/**
+ * Search for 'needleObj' in 'strObjPtr' starting from char 'idx',
+ * where 0 <= idx <= Jim_Utf8Length(interp, strObjPtr).
+ *
+ * Returns the char index of the first occurrence, or -1 if not found.
+ */
+static int JimStringFirstObj(Jim_Interp *interp, Jim_Obj *needleObj, Jim_Obj *strObjPtr, int idx)
+{
+    int l1, l2;
+    const char *s1 = Jim_GetString(needleObj, &l1);
+    const char *s2 = Jim_GetString(strObjPtr, &l2);
+    int offset = JimStringUtf8Offset(interp, strObjPtr, idx);
+
+    while (1) {
+        int n = JimStringFirst(s1, l1, s2 + offset, l2 - offset);
+        if (n < 0) {
+            return -1;
+        }
+        n += offset;
+#ifdef JIM_UTF8
+        idx = JimStringUtf8CharIndex(interp, strObjPtr, n);
+        if ((*s1 & 0xc0) == 0x80 && JimStringUtf8Offset(interp, strObjPtr, idx) != n) {
+            /* A needle starting with a stray continuation byte was found part way through a char */
+            offset = n + 1;
+            continue;
+        }
+        return idx;
+#else
+        return n;
+#endif
+    }
+}
+
+/* len is in bytes -- see also Jim_NewStringObjUtf8() */
+Jim_Obj *Jim_NewStringObj(Jim_Interp *interp, const char *s, int len)
+{
+    Jim_Obj *objPtr = Jim_NewObj(interp);
+
+    /* Need to find out how many bytes the string requires */
+    if (len == -1)
+        len = strlen(s);
+    /* Alloc/Set the string rep. */
+    if (len == 0) {
+        objPtr->bytes = JimEmptyStringRep;
+        objPtr->length = 0;
+    }
+    else {
+        objPtr->bytes = JimAllocStringRep(objPtr, len);
+        objPtr->length = len;
+        memcpy(objPtr->bytes, s, len);
+        objPtr->bytes[len] = '\0';
+    }
+
+    /* No typePtr field for the vanilla string object. */
+    objPtr->typePtr = NULL;
+    return objPtr;
+}
+
+/* charlen is in characters -- see also Jim_NewStringObj() */
+Jim_Obj *Jim_NewStringObjUtf8(Jim_Interp *interp, const char *s, int charlen)
+{
+#ifdef JIM_UTF8
+    /* Need to find out how many bytes the string requires */
+    int bytelen = utf8_index(s, charlen);
+
+    Jim_Obj *objPtr = Jim_NewStringObj(interp, s, bytelen);
+
+    /* Remember the utf8 length, so set the type */
+    objPtr->typePtr = &stringObjType;
+    objPtr->internalRep.strValue.maxLength = bytelen;
+    objPtr->internalRep.strValue.charLength = charlen;
+    objPtr->internalRep.strValue.utf8Index = NULL;
+
+    return objPtr;
+#else
+    return Jim_NewStringObj(interp, s, charlen);
+#endif
+}
+
+/* This version does not try to duplicate the 's' pointer, but
  * use it directly. */
 Jim_Obj *Jim_NewStringObjNoAlloc(Jim_Interp *interp, char *s, int len)
 {
@@ -2366,18 +3627,26 @@ static void StringAppendString(Jim_Obj *objPtr, const char *str, int len)
     needlen = objPtr->length + len;
     if (objPtr->internalRep.strValue.maxLength < needlen ||
         objPtr->internalRep.strValue.maxLength == 0) {
-        needlen *= 2;
-        /* Inefficient to malloc() for less than 8 bytes */
-        if (needlen < 7) {
-            needlen = 7;
-        }
-        if (objPtr->bytes == JimEmptyStringRep) {
-            objPtr->bytes = Jim_Alloc(needlen + 1);
+        if (needlen < JIM_OBJ_INLINE_BYTES && JimStringRepIsShort(objPtr)) {
+            /* Still fits within the object */
+            if (objPtr->bytes == JimEmptyStringRep) {
+                objPtr->bytes = objPtr->inlineBytes;
+            }
+            objPtr->internalRep.strValue.maxLength = JIM_OBJ_INLINE_BYTES - 1;
         }
         else {
-            objPtr->bytes = Jim_Realloc(objPtr->bytes, needlen + 1);
+            needlen *= 2;
+            if (JimStringRepIsShort(objPtr)) {
+                char *bytes = Jim_Alloc(needlen + 1);
+
+                memcpy(bytes, objPtr->bytes, objPtr->length);
+                objPtr->bytes = bytes;
+            }
+            else {
+                objPtr->bytes = Jim_Realloc(objPtr->bytes, needlen + 1);
+            }
+            objPtr->internalRep.strValue.maxLength = needlen;
         }
-        objPtr->internalRep.strValue.maxLength = needlen;
     }
     memcpy(objPtr->bytes + objPtr->length, str, len);
     objPtr->bytes[objPtr->length + len] = '\0';
@@ -2403,6 +3672,7 @@ void Jim_AppendObj(Jim_Interp *interp, Jim_Obj *objPtr, Jim_Obj *appendObjPtr)
 
     str = Jim_GetString(appendObjPtr, &len);
     Jim_AppendString(interp, objPtr, str, len);
+    JimInheritGcCandidate(interp, objPtr, appendObjPtr);
 }
 
 void Jim_AppendStrings(Jim_Interp *interp, Jim_Obj *objPtr, ...)
@@ -2428,6 +3698,10 @@ int Jim_StringEqObj(Jim_Obj *aObjPtr, Jim_Obj *bObjPtr)
 
     if (aObjPtr == bObjPtr)
         return 1;
+    if (aObjPtr->hash && bObjPtr->hash && aObjPtr->hash != bObjPtr->hash) {
+        /* Both interned, with different hashes */
+        return 0;
+    }
     aStr = Jim_GetString(aObjPtr, &aLen);
     bStr = Jim_GetString(bObjPtr, &bLen);
     if (aLen != bLen)
@@ -2435,9 +3709,191 @@ int Jim_StringEqObj(Jim_Obj *aObjPtr, Jim_Obj *bObjPtr)
     return JimStringCompare(aStr, aLen, bStr, bLen) == 0;
 }
 
+/* -----------------------------------------------------------------------------
+ * Glob Pattern Object
+ *
+ * A glob pattern is classified once and the result kept as the internal
+ * rep of the pattern object. The common shapes, a literal ("foo"),
+ * a literal prefix and/or suffix around '*' ("foo*", "*.log", "a*z")
+ * and a literal within '*' ("*foo*"), are matched with memcmp() and a
+ * substring search rather than being interpreted char by char.
+ * Any other pattern, and any case insensitive match, uses JimGlobMatch().
+ * ---------------------------------------------------------------------------*/
+enum {
+    JIM_GLOB_GENERAL,   /* Needs JimGlobMatch() */
+    JIM_GLOB_EXACT,     /* literal */
+    JIM_GLOB_AFFIX,     /* prefix*suffix, where either may be empty */
+    JIM_GLOB_CONTAINS   /* *literal* */
+};
+
+typedef struct Jim_GlobPattern {
+    int type;           /* JIM_GLOB_xxx */
+    int prefixLen;      /* Byte length of the literal or prefix */
+    int suffixLen;      /* Byte length of the suffix */
+    char literal[1];    /* The unescaped prefix followed by the suffix */
+} Jim_GlobPattern;
+
+static void FreeGlobInternalRep(Jim_Interp *interp, Jim_Obj *objPtr);
+static void DupGlobInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr);
+
+static const Jim_ObjType globObjType = {
+    "glob",
+    FreeGlobInternalRep,
+    DupGlobInternalRep,
+    NULL,
+    JIM_TYPE_NONE,
+};
+
+static void FreeGlobInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    JIM_NOTUSED(interp);
+
+    Jim_Free(objPtr->internalRep.ptr);
+}
+
+static void DupGlobInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
+{
+    JIM_NOTUSED(interp);
+    JIM_NOTUSED(srcPtr);
+
+    /* Just returns an simple string. */
+    dupPtr->typePtr = NULL;
+}
+
+static Jim_GlobPattern *JimGetGlobPattern(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    Jim_GlobPattern *gp;
+    const char *pattern;
+    int len, i;
+    int n = 0;          /* Literal bytes so far */
+    int stars = 0;      /* Number of runs of '*' */
+
+    if (objPtr->typePtr == &globObjType) {
+        return objPtr->internalRep.ptr;
+    }
+
+    pattern = Jim_GetString(objPtr, &len);
+    gp = Jim_Alloc(sizeof(*gp) + len);
+    gp->type = JIM_GLOB_EXACT;
+    gp->prefixLen = 0;
+
+    for (i = 0; i < len && gp->type != JIM_GLOB_GENERAL; i++) {
+        int c = (unsigned char)pattern[i];
+
+        switch (c) {
+            case '*':
+                while (i + 1 < len && pattern[i + 1] == '*') {
+                    i++;
+                }
+                if (stars++ == 0) {
+                    gp->prefixLen = n;
+                }
+                else if (stars > 2 || gp->prefixLen || n == 0 || i != len - 1) {
+                    /* Not *literal* */
+                    gp->type = JIM_GLOB_GENERAL;
+                }
+                continue;
+
+            case '?':
+            case '[':
+            case '\0':
+                /* Note that JimGlobMatch() stops at a null */
+                gp->type = JIM_GLOB_GENERAL;
+                continue;
+
+            case '\\':
+                if (i + 1 < len) {
+                    c = (unsigned char)pattern[++i];
+                    if (c == 0) {
+                        gp->type = JIM_GLOB_GENERAL;
+                        continue;
+                    }
+                }
+                break;
+        }
+#ifdef JIM_UTF8
+        if (c & 0x80) {
+            /* Only a complete, canonically encoded char is sure to match bytewise */
+            int uc;
+            char buf[MAX_UTF8_LEN];
+            int l = utf8_tounicode(pattern + i, &uc);
+
+            if (l == 1 || i + l > len || utf8_fromunicode(buf, uc) != l) {
+                gp->type = JIM_GLOB_GENERAL;
+                continue;
+            }
+            memcpy(gp->literal + n, pattern + i, l);
+            n += l;
+            i += l - 1;
+            continue;
+        }
+#endif
+        gp->literal[n++] = c;
+    }
+
+    if (gp->type == JIM_GLOB_EXACT) {
+        if (stars == 0) {
+            gp->prefixLen = n;
+        }
+        else if (stars == 1) {
+            gp->type = JIM_GLOB_AFFIX;
+        }
+        else {
+            gp->type = JIM_GLOB_CONTAINS;
+            gp->prefixLen = n;
+        }
+        gp->suffixLen = n - gp->prefixLen;
+    }
+
+    Jim_FreeIntRep(interp, objPtr);
+    objPtr->typePtr = &globObjType;
+    objPtr->internalRep.ptr = gp;
+    return gp;
+}
+
+/**
+ * Matches the string 'str' of byte length 'len' (or -1 if not known)
+ * against the glob pattern object 'patternObjPtr'.
+ *
+ * As with JimGlobMatch(), 'str' must be null terminated and
+ * is only considered up to the first null.
+ */
+static int JimGlobMatchObj(Jim_Interp *interp, Jim_Obj *patternObjPtr, const char *str, int len, int nocase)
+{
+    Jim_GlobPattern *gp = JimGetGlobPattern(interp, patternObjPtr);
+
+    if (nocase || gp->type == JIM_GLOB_GENERAL) {
+        return JimGlobMatch(Jim_String(patternObjPtr), str, nocase);
+    }
+    if (len < 0) {
+        len = strlen(str);
+    }
+    switch (gp->type) {
+        case JIM_GLOB_EXACT:
+            return len >= gp->prefixLen && memcmp(str, gp->literal, gp->prefixLen) == 0 && str[gp->prefixLen] == 0;
+
+        case JIM_GLOB_AFFIX:
+            if (len < gp->prefixLen + gp->suffixLen || memcmp(str, gp->literal, gp->prefixLen) != 0) {
+                return 0;
+            }
+            if (gp->suffixLen) {
+                len = strlen(str);
+                return len >= gp->prefixLen + gp->suffixLen &&
+                    memcmp(str + len - gp->suffixLen, gp->literal + gp->prefixLen, gp->suffixLen) == 0;
+            }
+            return 1;
+
+        default:
+            return JimStringFirst(gp->literal, gp->prefixLen, str, strlen(str)) >= 0;
+    }
+}
+
 int Jim_StringMatchObj(Jim_Interp *interp, Jim_Obj *patternObjPtr, Jim_Obj *objPtr, int nocase)
 {
-    return JimGlobMatch(Jim_String(patternObjPtr), Jim_String(objPtr), nocase);
+    int len;
+    const char *str = Jim_GetString(objPtr, &len);
+
+    return JimGlobMatchObj(interp, patternObjPtr, str, len, nocase);
 }
 
 int Jim_StringCompareObj(Jim_Interp *interp, Jim_Obj *firstObjPtr, Jim_Obj *secondObjPtr, int nocase)
@@ -2567,7 +4023,7 @@ Jim_Obj *Jim_StringRangeObj(Jim_Interp *interp,
         /* ASCII optimisation */
         return Jim_NewStringObj(interp, str + first, rangeLen);
     }
-    return Jim_NewStringObjUtf8(interp, str + utf8_index(str, first), rangeLen);
+    return Jim_NewStringObjUtf8(interp, str + JimStringUtf8Offset(interp, strObjPtr, first), rangeLen);
 #else
     return Jim_StringByteRangeObj(interp, strObjPtr, firstObjPtr, lastObjPtr);
 #endif
@@ -2576,7 +4032,7 @@ Jim_Obj *Jim_StringRangeObj(Jim_Interp *interp,
 Jim_Obj *JimStringReplaceObj(Jim_Interp *interp,
     Jim_Obj *strObjPtr, Jim_Obj *firstObjPtr, Jim_Obj *lastObjPtr, Jim_Obj *newStrObj)
 {
-    int first, last;
+    int first, last, after;
     const char *str;
     int len, rangeLen;
     Jim_Obj *objPtr;
@@ -2602,7 +4058,8 @@ Jim_Obj *JimStringReplaceObj(Jim_Interp *interp,
     }
 
     /* After part */
-    Jim_AppendString(interp, objPtr, str + utf8_index(str, last + 1), len - last - 1);
+    after = JimStringUtf8Offset(interp, strObjPtr, last + 1);
+    Jim_AppendString(interp, objPtr, str + after, Jim_Length(strObjPtr) - after);
 
     return objPtr;
 }
@@ -2909,6 +4366,120 @@ static int JimStringIs(Jim_Interp *interp, Jim_Obj *strObjPtr, Jim_Obj *strClass
     return JIM_OK;
 }
 
+/* -----------------------------------------------------------------------------
+ * Interned strings
+ * ---------------------------------------------------------------------------*/
+
+/* Each interpreter keeps a table of interned string objects, holding one
+ * reference to each. Equal strings that are interned share a single object,
+ * which saves memory when the same short strings (command names, dict keys,
+ * field names) occur over and over, and allows interned objects to be compared
+ * by pointer.
+ *
+ * An interned object caches the hash of its string rep in 'hash'.
+ * A non-zero hash marks the object as interned. It is reset if the
+ * string rep is invalidated.
+ */
+
+/* Interned objects are only removed from the table once it grows to this size */
+#define JIM_INTERN_PURGE_SIZE 1024
+
+static int JimInternHTKeyCompare(void *privdata, const void *key1, const void *key2)
+{
+    JIM_NOTUSED(privdata);
+    return Jim_StringEqObj((Jim_Obj *)key1, (Jim_Obj *)key2);
+}
+
+static void JimInternHTKeyDestructor(void *interp, void *key)
+{
+    Jim_DecrRefCount(interp, (Jim_Obj *)key);
+}
+
+static const Jim_HashTableType JimInternHashTableType = {
+    NULL,                       /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    JimInternHTKeyCompare,      /* key compare */
+    JimInternHTKeyDestructor,   /* key destructor */
+    NULL,                       /* val destructor */
+    JimObjectHTSeededHashFunction /* seeded hash function */
+};
+
+/* Removes interned objects which are no longer referenced anywhere
+ * other than by the table itself. */
+static void JimPurgeInterned(Jim_Interp *interp)
+{
+    Jim_HashTableIterator *htiter;
+    Jim_HashEntry *he;
+
+    htiter = Jim_GetHashTableIterator(&interp->interned);
+    while ((he = Jim_NextHashEntry(htiter)) != NULL) {
+        Jim_Obj *objPtr = Jim_GetHashEntryKey(he);
+        if (objPtr->refCount == 1) {
+            Jim_DeleteHashEntry(&interp->interned, objPtr);
+        }
+    }
+    Jim_FreeHashTableIterator(htiter);
+
+    interp->internPurgeSize = interp->interned.used * 2;
+    if (interp->internPurgeSize < JIM_INTERN_PURGE_SIZE) {
+        interp->internPurgeSize = JIM_INTERN_PURGE_SIZE;
+    }
+}
+
+/**
+ * Returns the interned object with the same string rep as objPtr.
+ * If there is none, objPtr is interned and returned.
+ * If objPtr has a zero ref count and is not returned, the caller must free it.
+ *
+ * The returned object is shared with the intern table and must not be modified.
+ * Note that it may have a ref count of 1 (the table), and so the caller should
+ * take a reference before interning anything else.
+ */
+Jim_Obj *Jim_InternObj(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    Jim_HashEntry *he;
+
+    if (objPtr->hash) {
+        return objPtr;
+    }
+    he = Jim_FindHashEntry(&interp->interned, objPtr);
+    if (he) {
+        return Jim_GetHashEntryKey(he);
+    }
+    if (interp->interned.used >= interp->internPurgeSize) {
+        JimPurgeInterned(interp);
+    }
+    objPtr->hash = JimObjectHTSeededHashFunction(objPtr, interp->hashSeed);
+    Jim_IncrRefCount(objPtr);
+    Jim_AddHashEntry(&interp->interned, objPtr, NULL);
+    return objPtr;
+}
+
+/**
+ * Returns the interned string object for the given string, creating one if needed.
+ * See Jim_InternObj().
+ */
+Jim_Obj *Jim_InternString(Jim_Interp *interp, const char *str, int len)
+{
+    Jim_HashEntry *he;
+    Jim_Obj keyObj;
+
+    if (len == -1) {
+        len = strlen(str);
+    }
+    /* Look up with a temporary object to avoid creating one if not needed */
+    keyObj.bytes = (char *)str;
+    keyObj.length = len;
+    keyObj.typePtr = NULL;
+    keyObj.hash = 0;
+    he = Jim_FindHashEntry(&interp->interned, &keyObj);
+    if (he) {
+        return Jim_GetHashEntryKey(he);
+    }
+    return Jim_InternObj(interp, Jim_NewStringObj(interp, str, len));
+}
+
 /* -----------------------------------------------------------------------------
  * Compared String Object
  * ---------------------------------------------------------------------------*/
@@ -3031,8 +4602,31 @@ static const Jim_ObjType scriptLineObjType = {
     0,
 };
 
-static Jim_Obj *JimNewScriptLineObj(Jim_Interp *interp, int argc, int line)
-{
+/* Specialised opcodes for hot core commands.
+ *
+ * When a script is compiled, each command line whose command name is a literal
+ * naming one of these commands, and whose words are all single tokens in one
+ * of the shapes handled by JimEvalScriptOp(), records the opcode in its
+ * JIM_TT_LINE token. At runtime, if the name still resolves to the core
+ * implementation, the command is executed inline without building an argument
+ * vector or going through JimInvokeCommand(). Otherwise it falls back to a
+ * normal invocation.
+ */
+enum {
+    JIM_SCRIPTOP_NONE,
+    JIM_SCRIPTOP_SET,
+    JIM_SCRIPTOP_INCR,
+    JIM_SCRIPTOP_IF,
+    JIM_SCRIPTOP_LAPPEND,
+    JIM_SCRIPTOP_RETURN,
+    JIM_SCRIPTOP_EXPR
+};
+
+/* Max number of words in a command handled by JimEvalScriptOp() */
+#define JIM_SCRIPTOP_MAXARGS 8
+
+static Jim_Obj *JimNewScriptLineObj(Jim_Interp *interp, int argc, int line)
+{
     Jim_Obj *objPtr;
 
 #ifdef DEBUG_SHOW_SCRIPT
@@ -3045,6 +4639,7 @@ static Jim_Obj *JimNewScriptLineObj(Jim_Interp *interp, int argc, int line)
     objPtr->typePtr = &scriptLineObjType;
     objPtr->internalRep.scriptLineValue.argc = argc;
     objPtr->internalRep.scriptLineValue.line = line;
+    objPtr->internalRep.scriptLineValue.op = JIM_SCRIPTOP_NONE;
 
     return objPtr;
 }
@@ -3300,6 +4895,89 @@ static Jim_Obj *JimMakeScriptObj(Jim_Interp *interp, const ParseToken *t)
     return objPtr;
 }
 
+/**
+ * Returns the specialised opcode (JIM_SCRIPTOP_...) for the command
+ * starting at token 't' with 'ntokens' tokens and 'argc' words,
+ * or JIM_SCRIPTOP_NONE if the command must be invoked normally.
+ */
+static int JimScriptLineOp(const ScriptToken *t, int ntokens, int argc)
+{
+    const char *name;
+
+    /* Every word must be a single token, and the command name a literal */
+    if (ntokens != argc || argc > JIM_SCRIPTOP_MAXARGS) {
+        return JIM_SCRIPTOP_NONE;
+    }
+    if (t[0].type != JIM_TT_STR && t[0].type != JIM_TT_ESC) {
+        return JIM_SCRIPTOP_NONE;
+    }
+    name = Jim_String(t[0].objPtr);
+
+    if (strcmp(name, "set") == 0 && (argc == 2 || argc == 3)) {
+        return JIM_SCRIPTOP_SET;
+    }
+    if (strcmp(name, "incr") == 0 && (argc == 2 || argc == 3)) {
+        return JIM_SCRIPTOP_INCR;
+    }
+    if (strcmp(name, "if") == 0) {
+        /* Only: if cond body ?else body? */
+        if (argc == 3) {
+            return JIM_SCRIPTOP_IF;
+        }
+        if (argc == 5 && (t[3].type == JIM_TT_STR || t[3].type == JIM_TT_ESC)
+            && strcmp(Jim_String(t[3].objPtr), "else") == 0) {
+            return JIM_SCRIPTOP_IF;
+        }
+        return JIM_SCRIPTOP_NONE;
+    }
+    if (strcmp(name, "lappend") == 0 && argc >= 2) {
+        return JIM_SCRIPTOP_LAPPEND;
+    }
+    if (strcmp(name, "return") == 0 && argc <= 2) {
+        return JIM_SCRIPTOP_RETURN;
+    }
+    if (strcmp(name, "expr") == 0 && argc == 2) {
+        return JIM_SCRIPTOP_EXPR;
+    }
+    return JIM_SCRIPTOP_NONE;
+}
+
+/**
+ * Returns 1 if the literal token should be interned.
+ *
+ * Only short bare words and variable names are interned.
+ * Braced words are often evaluated as scripts, so keep their own source location.
+ */
+static int JimIsInternableToken(const ParseToken *t)
+{
+    int i;
+
+    if (t->len >= JIM_OBJ_INLINE_BYTES) {
+        return 0;
+    }
+    if (t->type != JIM_TT_ESC && t->type != JIM_TT_VAR) {
+        return 0;
+    }
+    for (i = 0; i < t->len; i++) {
+        switch (t->token[i]) {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+            case ';':
+            case '$':
+            case '[':
+            case ']':
+            case '{':
+            case '}':
+            case '"':
+            case '\\':
+                return 0;
+        }
+    }
+    return 1;
+}
+
 /**
  * Takes a tokenlist and creates the allocated list of script tokens
  * in script->token, of length script->len.
@@ -3308,9 +4986,11 @@ static Jim_Obj *JimMakeScriptObj(Jim_Interp *interp, const ParseToken *t)
  * as required.
  *
  * Also sets script->line to the line number of the first token
+ *
+ * Literal words are interned if 'intern' is set.
  */
 static void ScriptObjAddTokens(Jim_Interp *interp, struct ScriptObj *script,
-    ParseTokenList *tokenlist)
+    ParseTokenList *tokenlist, int intern)
 {
     int i;
     struct ScriptToken *token;
@@ -3360,6 +5040,10 @@ static void ScriptObjAddTokens(Jim_Interp *interp, struct ScriptObj *script,
                 linefirst->type = JIM_TT_LINE;
                 linefirst->objPtr = JimNewScriptLineObj(interp, lineargs, linenr);
                 Jim_IncrRefCount(linefirst->objPtr);
+#ifdef JIM_OPTIMIZATION
+                linefirst->objPtr->internalRep.scriptLineValue.op =
+                    JimScriptLineOp(linefirst + 1, token - linefirst - 1, lineargs);
+#endif
 
                 /* Reset for new line */
                 lineargs = 0;
@@ -3371,7 +5055,8 @@ static void ScriptObjAddTokens(Jim_Interp *interp, struct ScriptObj *script,
         else if (wordtokens != 1) {
             /* More than 1, or {expand}, so insert a WORD token */
             token->type = JIM_TT_WORD;
-            token->objPtr = Jim_NewIntObj(interp, wordtokens);
+            /* Unshared, since the count is read directly from the int rep */
+            token->objPtr = JimNewUnsharedIntObj(interp, wordtokens);
             Jim_IncrRefCount(token->objPtr);
             token++;
             if (wordtokens < 0) {
@@ -3393,13 +5078,21 @@ static void ScriptObjAddTokens(Jim_Interp *interp, struct ScriptObj *script,
             const ParseToken *t = &tokenlist->list[i++];
 
             token->type = t->type;
-            token->objPtr = JimMakeScriptObj(interp, t);
-            Jim_IncrRefCount(token->objPtr);
+            if (intern && JimIsInternableToken(t)) {
+                /* Literal words such as command names and keys
+                 * are shared between all scripts */
+                token->objPtr = Jim_InternString(interp, t->token, t->len);
+                Jim_IncrRefCount(token->objPtr);
+            }
+            else {
+                token->objPtr = JimMakeScriptObj(interp, t);
+                Jim_IncrRefCount(token->objPtr);
 
-            /* Every object is initially a string, but the
-             * internal type may be specialized during execution of the
-             * script. */
-            JimSetSourceInfo(interp, token->objPtr, script->fileNameObj, t->line);
+                /* Every object is initially a string, but the
+                 * internal type may be specialized during execution of the
+                 * script. */
+                JimSetSourceInfo(interp, token->objPtr, script->fileNameObj, t->line);
+            }
             token++;
         }
     }
@@ -3494,11 +5187,24 @@ static int SetScriptFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr, struct J
     }
     Jim_IncrRefCount(script->fileNameObj);
 
-    ScriptObjAddTokens(interp, script, &tokenlist);
+    /* Don't intern the words of an interned script such as {break},
+     * since it would then hold a reference to itself */
+    ScriptObjAddTokens(interp, script, &tokenlist, objPtr->hash == 0);
 
     /* No longer need the token list */
     ScriptTokenListFree(&tokenlist);
 
+#ifdef JIM_REFERENCES
+    if (objPtr->gcFlags & JIM_GC_CANDIDATE) {
+        int i;
+
+        /* The words may outlive the script */
+        for (i = 0; i < script->len; i++) {
+            JimAddGcCandidate(interp, script->token[i].objPtr);
+        }
+    }
+#endif
+
     /* Free the old internal rep and set the new one. */
     Jim_FreeIntRep(interp, objPtr);
     Jim_SetIntRepPtr(objPtr, script);
@@ -3525,16 +5231,51 @@ static void JimIncrCmdRefCount(Jim_Cmd *cmdPtr)
     cmdPtr->inUse++;
 }
 
+/* Command objects hold a cache reference to the command they resolved to.
+ * This keeps the Jim_Cmd structure (but not the command) alive so that
+ * the cached cmdEpoch can always be checked.
+ */
+static void JimReleaseCmdCacheRef(Jim_Cmd *cmdPtr)
+{
+    if (--cmdPtr->cacheRefs == 0 && cmdPtr->inUse == 0) {
+        Jim_Free(cmdPtr);
+    }
+}
+
+/* Invalidates every cached lookup which resolved to this command */
+static void JimInvalidateCmdCache(Jim_Cmd *cmdPtr)
+{
+    cmdPtr->cmdEpoch++;
+}
+
 static void JimDecrCmdRefCount(Jim_Interp *interp, Jim_Cmd *cmdPtr)
 {
     if (--cmdPtr->inUse == 0) {
+        /* Releasing the body may release cached references to this command,
+         * so hold the structure until done */
+        cmdPtr->cacheRefs++;
+        JimInvalidateCmdCache(cmdPtr);
         if (cmdPtr->isproc) {
+            int i;
+
+            for (i = 0; i < cmdPtr->u.proc.argListLen; i++) {
+                if (cmdPtr->u.proc.arglist[i].nameObjPtr) {
+                    Jim_DecrRefCount(interp, cmdPtr->u.proc.arglist[i].nameObjPtr);
+                }
+                if (cmdPtr->u.proc.arglist[i].defaultObjPtr) {
+                    Jim_DecrRefCount(interp, cmdPtr->u.proc.arglist[i].defaultObjPtr);
+                }
+            }
             Jim_DecrRefCount(interp, cmdPtr->u.proc.argListObjPtr);
             Jim_DecrRefCount(interp, cmdPtr->u.proc.bodyObjPtr);
             Jim_DecrRefCount(interp, cmdPtr->u.proc.nsObj);
             if (cmdPtr->u.proc.staticVars) {
                 Jim_FreeHashTable(cmdPtr->u.proc.staticVars);
                 Jim_Free(cmdPtr->u.proc.staticVars);
+                Jim_DecrRefCount(interp, cmdPtr->u.proc.staticNamesObjPtr);
+            }
+            if (cmdPtr->u.proc.localSlots) {
+                JimFreeLocalSlots(interp, cmdPtr->u.proc.localSlots);
             }
         }
         else {
@@ -3547,7 +5288,7 @@ static void JimDecrCmdRefCount(Jim_Interp *interp, Jim_Cmd *cmdPtr)
             /* Delete any pushed command too */
             JimDecrCmdRefCount(interp, cmdPtr->prevCmd);
         }
-        Jim_Free(cmdPtr);
+        JimReleaseCmdCacheRef(cmdPtr);
     }
 }
 
@@ -3571,7 +5312,8 @@ static const Jim_HashTableType JimVariablesHashTableType = {
     NULL,                               /* val dup */
     JimStringCopyHTKeyCompare,  /* key compare */
     JimStringCopyHTKeyDestructor,       /* key destructor */
-    JimVariablesHTValDestructor /* val destructor */
+    JimVariablesHTValDestructor, /* val destructor */
+    JimStringCopyHTSeededHashFunction /* seeded hash function */
 };
 
 /* Commands HashTable Type.
@@ -3588,7 +5330,8 @@ static const Jim_HashTableType JimCommandsHashTableType = {
     NULL,                           /* val dup */
     JimStringCopyHTKeyCompare,      /* key compare */
     JimStringCopyHTKeyDestructor,   /* key destructor */
-    JimCommandsHT_ValDestructor     /* val destructor */
+    JimCommandsHT_ValDestructor,    /* val destructor */
+    JimStringCopyHTSeededHashFunction /* seeded hash function */
 };
 
 /* ------------------------- Commands related functions --------------------- */
@@ -3650,6 +5393,28 @@ static const char *JimQualifyName(Jim_Interp *interp, const char *name, Jim_Obj
     #define JimFreeQualifiedName(INTERP, DUMMY) (void)(DUMMY)
 #endif
 
+/**
+ * A new command named a::b::c shadows the global commands b::c and c
+ * for lookups made from within namespaces a and a::b respectively,
+ * so any cached lookups of these commands must be redone.
+ */
+static void JimInvalidateShadowedCmds(Jim_Interp *interp, const char *name)
+{
+#ifdef jim_ext_namespace
+    while ((name = strstr(name, "::")) != NULL) {
+        Jim_HashEntry *he;
+
+        while (*name == ':') {
+            name++;
+        }
+        he = Jim_FindHashEntry(&interp->commands, name);
+        if (he) {
+            JimInvalidateCmdCache(he->u.val);
+        }
+    }
+#endif
+}
+
 static int JimCreateCommand(Jim_Interp *interp, const char *name, Jim_Cmd *cmd)
 {
     /* It may already exist, so we try to delete the old one.
@@ -3662,13 +5427,16 @@ static int JimCreateCommand(Jim_Interp *interp, const char *name, Jim_Cmd *cmd)
     Jim_HashEntry *he = Jim_FindHashEntry(&interp->commands, name);
     if (he) {
         /* There was an old cmd with the same name,
-         * so this requires a 'proc epoch' update. */
+         * so cached lookups of the old cmd are no longer valid. */
 
-        /* If a procedure with the same name didn't exist there is no need
-         * to increment the 'proc epoch' because creation of a new procedure
+        /* If a procedure with the same name didn't exist there is nothing
+         * to invalidate because creation of a new procedure
          * can never affect existing cached commands. We don't do
          * negative caching. */
-        Jim_InterpIncrProcEpoch(interp);
+        JimInvalidateCmdCache(he->u.val);
+    }
+    else {
+        JimInvalidateShadowedCmds(interp, name);
     }
 
     if (he && interp->local) {
@@ -3714,8 +5482,12 @@ static int JimCreateProcedureStatics(Jim_Interp *interp, Jim_Cmd *cmdPtr, Jim_Ob
         return JIM_OK;
     }
 
+    /* Statics are never removed, so the table is paired with a list of names
+     * that lets [info statics] report them in declaration order */
     cmdPtr->u.proc.staticVars = Jim_Alloc(sizeof(Jim_HashTable));
     Jim_InitHashTable(cmdPtr->u.proc.staticVars, &JimVariablesHashTableType, interp);
+    cmdPtr->u.proc.staticNamesObjPtr = Jim_NewListObj(interp, NULL, 0);
+    Jim_IncrRefCount(cmdPtr->u.proc.staticNamesObjPtr);
     for (i = 0; i < len; i++) {
         Jim_Obj *objPtr = NULL, *initObjPtr = NULL, *nameObjPtr = NULL;
         Jim_Var *varPtr;
@@ -3756,6 +5528,7 @@ static int JimCreateProcedureStatics(Jim_Interp *interp, Jim_Cmd *cmdPtr, Jim_Ob
                 Jim_Free(varPtr);
                 return JIM_ERR;
             }
+            Jim_ListAppendElement(interp, cmdPtr->u.proc.staticNamesObjPtr, nameObjPtr);
         }
         else {
             Jim_SetResultFormatted(interp, "too many fields in static specifier \"%#s\"",
@@ -3776,11 +5549,6 @@ static void JimUpdateProcNamespace(Jim_Interp *interp, Jim_Cmd *cmdPtr, const ch
             Jim_DecrRefCount(interp, cmdPtr->u.proc.nsObj);
             cmdPtr->u.proc.nsObj = Jim_NewStringObj(interp, cmdname, pt - cmdname - 1);
             Jim_IncrRefCount(cmdPtr->u.proc.nsObj);
-
-            if (Jim_FindHashEntry(&interp->commands, pt + 1)) {
-                /* This commands shadows a global command, so a proc epoch update is required */
-                Jim_InterpIncrProcEpoch(interp);
-            }
         }
     }
 #endif
@@ -3797,7 +5565,7 @@ static Jim_Cmd *JimCreateProcedureCmd(Jim_Interp *interp, Jim_Obj *argListObjPtr
 
     /* Allocate space for both the command pointer and the arg list */
     cmdPtr = Jim_Alloc(sizeof(*cmdPtr) + sizeof(struct Jim_ProcArg) * argListLen);
-    memset(cmdPtr, 0, sizeof(*cmdPtr));
+    memset(cmdPtr, 0, sizeof(*cmdPtr) + sizeof(struct Jim_ProcArg) * argListLen);
     cmdPtr->inUse = 1;
     cmdPtr->isproc = 1;
     cmdPtr->u.proc.argListObjPtr = argListObjPtr;
@@ -3866,8 +5634,14 @@ err:
             }
         }
 
+        /* Hold references since the arg list may be shimmered to another
+         * type, e.g. if the same (shared) literal is also used as a variable name */
         cmdPtr->u.proc.arglist[i].nameObjPtr = nameObjPtr;
+        Jim_IncrRefCount(nameObjPtr);
         cmdPtr->u.proc.arglist[i].defaultObjPtr = defaultObjPtr;
+        if (defaultObjPtr) {
+            Jim_IncrRefCount(defaultObjPtr);
+        }
     }
 
     return cmdPtr;
@@ -3878,13 +5652,15 @@ int Jim_DeleteCommand(Jim_Interp *interp, const char *name)
     int ret = JIM_OK;
     Jim_Obj *qualifiedNameObj;
     const char *qualname = JimQualifyName(interp, name, &qualifiedNameObj);
+    Jim_HashEntry *he = Jim_FindHashEntry(&interp->commands, qualname);
 
-    if (Jim_DeleteHashEntry(&interp->commands, qualname) == JIM_ERR) {
+    if (he == NULL) {
         Jim_SetResultFormatted(interp, "can't delete \"%s\": command doesn't exist", name);
         ret = JIM_ERR;
     }
     else {
-        Jim_InterpIncrProcEpoch(interp);
+        JimInvalidateCmdCache(he->u.val);
+        Jim_DeleteHashEntry(&interp->commands, qualname);
     }
 
     JimFreeQualifiedName(interp, qualifiedNameObj);
@@ -3922,13 +5698,14 @@ int Jim_RenameCommand(Jim_Interp *interp, const char *oldName, const char *newNa
         cmdPtr = he->u.val;
         JimIncrCmdRefCount(cmdPtr);
         JimUpdateProcNamespace(interp, cmdPtr, fqnew);
+        JimInvalidateShadowedCmds(interp, fqnew);
         Jim_AddHashEntry(&interp->commands, fqnew, cmdPtr);
 
         /* Now remove the old name */
         Jim_DeleteHashEntry(&interp->commands, fqold);
 
-        /* Increment the epoch */
-        Jim_InterpIncrProcEpoch(interp);
+        /* Lookups by the old name are no longer valid */
+        JimInvalidateCmdCache(cmdPtr);
 
         ret = JIM_OK;
     }
@@ -3946,6 +5723,7 @@ int Jim_RenameCommand(Jim_Interp *interp, const char *oldName, const char *newNa
 static void FreeCommandInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
 {
     Jim_DecrRefCount(interp, objPtr->internalRep.cmdValue.nsObj);
+    JimReleaseCmdCacheRef(objPtr->internalRep.cmdValue.cmdPtr);
 }
 
 static void DupCommandInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
@@ -3953,6 +5731,7 @@ static void DupCommandInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *
     dupPtr->internalRep.cmdValue = srcPtr->internalRep.cmdValue;
     dupPtr->typePtr = srcPtr->typePtr;
     Jim_IncrRefCount(dupPtr->internalRep.cmdValue.nsObj);
+    dupPtr->internalRep.cmdValue.cmdPtr->cacheRefs++;
 }
 
 static const Jim_ObjType commandObjType = {
@@ -3975,11 +5754,12 @@ Jim_Cmd *Jim_GetCommand(Jim_Interp *interp, Jim_Obj *objPtr, int flags)
 {
     Jim_Cmd *cmd;
 
-    /* In order to be valid, the proc epoch must match and
-     * the lookup must have occurred in the same namespace
+    /* In order to be valid, neither the command nor the interp must have been
+     * invalidated since, and the lookup must have occurred in the same namespace
      */
     if (objPtr->typePtr != &commandObjType ||
-            objPtr->internalRep.cmdValue.procEpoch != interp->procEpoch
+            objPtr->internalRep.cmdValue.procEpoch !=
+                objPtr->internalRep.cmdValue.cmdPtr->cmdEpoch + interp->procEpoch
 #ifdef jim_ext_namespace
             || !Jim_StringEqObj(objPtr->internalRep.cmdValue.nsObj, interp->framePtr->nsObj)
 #endif
@@ -3990,6 +5770,8 @@ Jim_Cmd *Jim_GetCommand(Jim_Interp *interp, Jim_Obj *objPtr, int flags)
         const char *name = Jim_String(objPtr);
         Jim_HashEntry *he;
 
+        interp->cmdCacheMisses++;
+
         if (name[0] == ':' && name[1] == ':') {
             while (*++name == ':') {
             }
@@ -4023,12 +5805,14 @@ found:
         /* Free the old internal repr and set the new one. */
         Jim_FreeIntRep(interp, objPtr);
         objPtr->typePtr = &commandObjType;
-        objPtr->internalRep.cmdValue.procEpoch = interp->procEpoch;
+        objPtr->internalRep.cmdValue.procEpoch = cmd->cmdEpoch + interp->procEpoch;
         objPtr->internalRep.cmdValue.cmdPtr = cmd;
         objPtr->internalRep.cmdValue.nsObj = interp->framePtr->nsObj;
         Jim_IncrRefCount(interp->framePtr->nsObj);
+        cmd->cacheRefs++;
     }
     else {
+        interp->cmdCacheHits++;
         cmd = objPtr->internalRep.cmdValue.cmdPtr;
     }
     while (cmd->u.proc.upcall) {
@@ -4047,6 +5831,36 @@ found:
 
 #define JIM_DICT_SUGAR 100      /* Only returned by SetVariableFromAny() */
 
+/* The local variables of a procedure which can be determined by
+ * examining its argument list and body are given a fixed slot.
+ * Each call frame stores these variables in an array indexed by slot
+ * rather than in the vars hash table, and a variable object caches
+ * the slot number, so lookups in a recursive call or a later call of
+ * the same procedure need not search at all.
+ *
+ * A name with a slot is never stored in the vars hash table.
+ */
+typedef struct Jim_LocalSlots {
+    unsigned long id;           /* Unique id, cached in varValue.callFrameId */
+    int count;                  /* Number of slots */
+    int maxNames;               /* Allocated length of 'names' */
+    Jim_Obj **names;            /* Name of each slot */
+} Jim_LocalSlots;
+
+/* Returns the slot for the given (non-global) variable name, or -1 */
+static int JimFindLocalSlot(Jim_LocalSlots *localSlots, const char *name)
+{
+    int i;
+
+    for (i = 0; i < localSlots->count; i++) {
+        const char *slotname = Jim_String(localSlots->names[i]);
+        if (slotname[0] == name[0] && strcmp(slotname, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 static int SetVariableFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr);
 
 static const Jim_ObjType variableObjType = {
@@ -4092,10 +5906,22 @@ static int SetVariableFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
 
     /* Check if the object is already an uptodate variable */
     if (objPtr->typePtr == &variableObjType) {
-        framePtr = objPtr->internalRep.varValue.global ? interp->topFramePtr : interp->framePtr;
-        if (objPtr->internalRep.varValue.callFrameId == framePtr->id) {
-            /* nothing to do */
-            return JIM_OK;
+        int slot = objPtr->internalRep.varValue.slot;
+
+        if (slot >= 0) {
+            /* A local slot is valid in any frame of the same procedure */
+            framePtr = interp->framePtr;
+            if (framePtr->localSlots && objPtr->internalRep.varValue.callFrameId == framePtr->localSlots->id) {
+                objPtr->internalRep.varValue.varPtr = &framePtr->slots[slot];
+                return framePtr->slots[slot].objPtr ? JIM_OK : JIM_ERR;
+            }
+        }
+        else {
+            framePtr = objPtr->internalRep.varValue.global ? interp->topFramePtr : interp->framePtr;
+            if (objPtr->internalRep.varValue.callFrameId == framePtr->id) {
+                /* nothing to do */
+                return JIM_OK;
+            }
         }
         /* Need to re-resolve the variable in the updated callframe */
     }
@@ -4123,6 +5949,21 @@ static int SetVariableFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
     else {
         global = 0;
         framePtr = interp->framePtr;
+
+        if (framePtr->localSlots) {
+            int slot = JimFindLocalSlot(framePtr->localSlots, varName);
+            if (slot >= 0) {
+                /* Cache the slot even if the variable does not exist yet,
+                 * so that JimCreateVariable() can use it */
+                Jim_FreeIntRep(interp, objPtr);
+                objPtr->typePtr = &variableObjType;
+                objPtr->internalRep.varValue.callFrameId = framePtr->localSlots->id;
+                objPtr->internalRep.varValue.varPtr = &framePtr->slots[slot];
+                objPtr->internalRep.varValue.global = 0;
+                objPtr->internalRep.varValue.slot = slot;
+                return framePtr->slots[slot].objPtr ? JIM_OK : JIM_ERR;
+            }
+        }
     }
 
     /* Resolve this name in the variables hash table */
@@ -4143,6 +5984,7 @@ static int SetVariableFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
     objPtr->internalRep.varValue.callFrameId = framePtr->id;
     objPtr->internalRep.varValue.varPtr = he->u.val;
     objPtr->internalRep.varValue.global = global;
+    objPtr->internalRep.varValue.slot = -1;
     return JIM_OK;
 }
 
@@ -4155,9 +5997,23 @@ static Jim_Var *JimCreateVariable(Jim_Interp *interp, Jim_Obj *nameObjPtr, Jim_O
     const char *name;
     Jim_CallFrame *framePtr;
     int global;
+    Jim_Var *var;
+
+    /* If SetVariableFromAny() found a slot for this name, store it there */
+    if (nameObjPtr->typePtr == &variableObjType && nameObjPtr->internalRep.varValue.slot >= 0) {
+        framePtr = interp->framePtr;
+        if (framePtr->localSlots && nameObjPtr->internalRep.varValue.callFrameId == framePtr->localSlots->id) {
+            var = &framePtr->slots[nameObjPtr->internalRep.varValue.slot];
+            var->objPtr = valObjPtr;
+            Jim_IncrRefCount(valObjPtr);
+            var->linkFramePtr = NULL;
+            nameObjPtr->internalRep.varValue.varPtr = var;
+            return var;
+        }
+    }
 
     /* New variable to create */
-    Jim_Var *var = Jim_Alloc(sizeof(*var));
+    var = Jim_Alloc(sizeof(*var));
 
     var->objPtr = valObjPtr;
     Jim_IncrRefCount(valObjPtr);
@@ -4184,6 +6040,7 @@ static Jim_Var *JimCreateVariable(Jim_Interp *interp, Jim_Obj *nameObjPtr, Jim_O
     nameObjPtr->internalRep.varValue.callFrameId = framePtr->id;
     nameObjPtr->internalRep.varValue.varPtr = var;
     nameObjPtr->internalRep.varValue.global = global;
+    nameObjPtr->internalRep.varValue.slot = -1;
 
     return var;
 }
@@ -4464,6 +6321,12 @@ int Jim_UnsetVariable(Jim_Interp *interp, Jim_Obj *nameObjPtr, int flags)
             retval = Jim_UnsetVariable(interp, varPtr->objPtr, JIM_NONE);
             interp->framePtr = framePtr;
         }
+        else if (nameObjPtr->internalRep.varValue.slot >= 0) {
+            /* Slot variables need no id change. Cached lookups see the empty slot */
+            Jim_Obj *objPtr = varPtr->objPtr;
+            varPtr->objPtr = NULL;
+            Jim_DecrRefCount(interp, objPtr);
+        }
         else {
             const char *name = Jim_String(nameObjPtr);
             if (nameObjPtr->internalRep.varValue.global) {
@@ -4707,6 +6570,8 @@ static Jim_CallFrame *JimCreateCallFrame(Jim_Interp *interp, Jim_CallFrame *pare
     else {
         cf = Jim_Alloc(sizeof(*cf));
         cf->vars.table = NULL;
+        cf->slots = NULL;
+        cf->maxSlots = 0;
     }
 
     cf->id = interp->callFrameEpoch++;
@@ -4719,11 +6584,12 @@ static Jim_CallFrame *JimCreateCallFrame(Jim_Interp *interp, Jim_CallFrame *pare
     cf->next = NULL;
     cf->staticVars = NULL;
     cf->localCommands = NULL;
+    cf->localSlots = NULL;
 
     cf->nsObj = nsObj;
     Jim_IncrRefCount(nsObj);
     if (cf->vars.table == NULL)
-        Jim_InitHashTable(&cf->vars, &JimVariablesHashTableType, interp);
+        JimInitSeededHashTable(interp, &cf->vars, &JimVariablesHashTableType);
     return cf;
 }
 
@@ -4749,6 +6615,8 @@ static int JimDeleteLocalProcs(Jim_Interp *interp, Jim_Stack *localCommands)
 
             if (he) {
                 Jim_Cmd *cmd = he->u.val;
+
+                JimInvalidateCmdCache(cmd);
                 if (cmd->prevCmd) {
                     Jim_Cmd *prevCmd = cmd->prevCmd;
                     cmd->prevCmd = NULL;
@@ -4761,7 +6629,6 @@ static int JimDeleteLocalProcs(Jim_Interp *interp, Jim_Stack *localCommands)
                 }
                 else {
                     Jim_DeleteHashEntry(&interp->commands, fqname);
-                    Jim_InterpIncrProcEpoch(interp);
                 }
             }
             Jim_DecrRefCount(interp, cmdNameObj);
@@ -4785,25 +6652,18 @@ static void JimFreeCallFrame(Jim_Interp *interp, Jim_CallFrame *cf, int flags)
     Jim_DecrRefCount(interp, cf->nsObj);
     if (!(flags & JIM_FCF_NOHT))
         Jim_FreeHashTable(&cf->vars);
-    else {
+    else
+        JimClearHashTable(&cf->vars);
+    if (cf->localSlots) {
         int i;
-        Jim_HashEntry **table = cf->vars.table, *he;
-
-        for (i = 0; i < JIM_HT_INITIAL_SIZE; i++) {
-            he = table[i];
-            while (he != NULL) {
-                Jim_HashEntry *nextEntry = he->next;
-                Jim_Var *varPtr = (void *)he->u.val;
 
-                Jim_DecrRefCount(interp, varPtr->objPtr);
-                Jim_Free(he->u.val);
-                Jim_Free((void *)he->key);      /* ATTENTION: const cast */
-                Jim_Free(he);
-                table[i] = NULL;
-                he = nextEntry;
+        for (i = 0; i < cf->localSlots->count; i++) {
+            if (cf->slots[i].objPtr) {
+                Jim_DecrRefCount(interp, cf->slots[i].objPtr);
             }
         }
-        cf->vars.used = 0;
+        /* The slots array is kept for reuse by the next call */
+        cf->localSlots = NULL;
     }
 
     JimDeleteLocalProcs(interp, cf->localCommands);
@@ -4874,7 +6734,8 @@ static const Jim_HashTableType JimReferencesHashTableType = {
     NULL,                       /* val dup */
     JimReferencesHTKeyCompare,  /* key compare */
     JimReferencesHTKeyDestructor,       /* key destructor */
-    JimReferencesHTValDestructor        /* val destructor */
+    JimReferencesHTValDestructor,       /* val destructor */
+    NULL                                /* seeded hash function */
 };
 
 /* -----------------------------------------------------------------------------
@@ -4916,7 +6777,7 @@ void UpdateStringOfReference(struct Jim_Obj *objPtr)
 
     refPtr = objPtr->internalRep.refValue.refPtr;
     len = JimFormatReference(buf, refPtr, objPtr->internalRep.refValue.id);
-    objPtr->bytes = Jim_Alloc(len + 1);
+    objPtr->bytes = JimAllocStringRep(objPtr, len);
     memcpy(objPtr->bytes, buf, len + 1);
     objPtr->length = len;
 }
@@ -4981,6 +6842,7 @@ static int SetReferenceFromAny(Jim_Interp *interp, Jim_Obj *objPtr)
     objPtr->typePtr = &referenceObjType;
     objPtr->internalRep.refValue.id = value;
     objPtr->internalRep.refValue.refPtr = refPtr;
+    JimAddGcCandidate(interp, objPtr);
     return JIM_OK;
 
   badformat:
@@ -5015,6 +6877,7 @@ Jim_Obj *Jim_NewReference(Jim_Interp *interp, Jim_Obj *objPtr, Jim_Obj *tagPtr,
     refObjPtr->bytes = NULL;
     refObjPtr->internalRep.refValue.id = id;
     refObjPtr->internalRep.refValue.refPtr = refPtr;
+    JimAddGcCandidate(interp, refObjPtr);
     interp->referenceNextId++;
     /* Set the tag. Trimmed at JIM_REFERENCE_TAGLEN. Everything
      * that does not pass the 'isrefchar' test is replaced with '_' */
@@ -5072,84 +6935,87 @@ static const Jim_HashTableType JimRefMarkHashTableType = {
     NULL,                       /* val dup */
     JimReferencesHTKeyCompare,  /* key compare */
     JimReferencesHTKeyDestructor,       /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL                        /* seeded hash function */
 };
 
-/* Performs the garbage collection. */
-int Jim_Collect(Jim_Interp *interp)
+/* Marks any references found in the given object */
+static void JimMarkReferences(Jim_HashTable *marks, Jim_Obj *objPtr)
 {
-    int collected = 0;
-#ifndef JIM_BOOTSTRAP
-    Jim_HashTable marks;
-    Jim_HashTableIterator *htiter;
-    Jim_HashEntry *he;
-    Jim_Obj *objPtr;
-
-    /* Avoid recursive calls */
-    if (interp->lastCollectId == -1) {
-        /* Jim_Collect() already running. Return just now. */
-        return 0;
-    }
-    interp->lastCollectId = -1;
+    if (objPtr->typePtr == NULL || objPtr->typePtr->flags & JIM_TYPE_REFERENCES) {
+        const char *str, *p;
+        int len;
 
-    /* Mark all the references found into the 'mark' hash table.
-     * The references are searched in every live object that
-     * is of a type that can contain references. */
-    Jim_InitHashTable(&marks, &JimRefMarkHashTableType, NULL);
-    objPtr = interp->liveList;
-    while (objPtr) {
-        if (objPtr->typePtr == NULL || objPtr->typePtr->flags & JIM_TYPE_REFERENCES) {
-            const char *str, *p;
-            int len;
-
-            /* If the object is of type reference, to get the
-             * Id is simple... */
-            if (objPtr->typePtr == &referenceObjType) {
-                Jim_AddHashEntry(&marks, &objPtr->internalRep.refValue.id, NULL);
+        /* If the object is of type reference, to get the
+         * Id is simple... */
+        if (objPtr->typePtr == &referenceObjType) {
+            Jim_AddHashEntry(marks, &objPtr->internalRep.refValue.id, NULL);
 #ifdef JIM_DEBUG_GC
-                printf("MARK (reference): %d refcount: %d" JIM_NL,
-                    (int)objPtr->internalRep.refValue.id, objPtr->refCount);
+            printf("MARK (reference): %d refcount: %d" JIM_NL,
+                (int)objPtr->internalRep.refValue.id, objPtr->refCount);
 #endif
-                objPtr = objPtr->nextObjPtr;
-                continue;
-            }
-            /* Get the string repr of the object we want
-             * to scan for references. */
-            p = str = Jim_GetString(objPtr, &len);
-            /* Skip objects too little to contain references. */
-            if (len < JIM_REFERENCE_SPACE) {
-                objPtr = objPtr->nextObjPtr;
-                continue;
-            }
-            /* Extract references from the object string repr. */
-            while (1) {
-                int i;
-                unsigned long id;
+            return;
+        }
+        /* Get the string repr of the object we want
+         * to scan for references. */
+        p = str = Jim_GetString(objPtr, &len);
+        /* Skip objects too little to contain references. */
+        if (len < JIM_REFERENCE_SPACE) {
+            return;
+        }
+        /* Extract references from the object string repr. */
+        while (1) {
+            int i;
+            unsigned long id;
 
-                if ((p = strstr(p, "<reference.<")) == NULL)
-                    break;
-                /* Check if it's a valid reference. */
-                if (len - (p - str) < JIM_REFERENCE_SPACE)
-                    break;
-                if (p[41] != '>' || p[19] != '>' || p[20] != '.')
+            if ((p = strstr(p, "<reference.<")) == NULL)
+                break;
+            /* Check if it's a valid reference. */
+            if (len - (p - str) < JIM_REFERENCE_SPACE)
+                break;
+            if (p[41] != '>' || p[19] != '>' || p[20] != '.')
+                break;
+            for (i = 21; i <= 40; i++)
+                if (!isdigit(UCHAR(p[i])))
                     break;
-                for (i = 21; i <= 40; i++)
-                    if (!isdigit(UCHAR(p[i])))
-                        break;
-                /* Get the ID */
-                id = strtoul(p + 21, NULL, 10);
+            /* Get the ID */
+            id = strtoul(p + 21, NULL, 10);
 
-                /* Ok, a reference for the given ID
-                 * was found. Mark it. */
-                Jim_AddHashEntry(&marks, &id, NULL);
+            /* Ok, a reference for the given ID
+             * was found. Mark it. */
+            Jim_AddHashEntry(marks, &id, NULL);
 #ifdef JIM_DEBUG_GC
-                printf("MARK: %d" JIM_NL, (int)id);
+            printf("MARK: %d" JIM_NL, (int)id);
 #endif
-                p += JIM_REFERENCE_SPACE;
-            }
+            p += JIM_REFERENCE_SPACE;
+        }
+    }
+}
+
+/* Marks the references found in the live candidates from index 'first'
+ * up to (but not including) 'end'. */
+static void JimMarkCandidates(Jim_GcState *gc, Jim_HashTable *marks, int first, int end)
+{
+    int i;
+
+    for (i = first; i < end; i++) {
+        if (gc->candidates[i]->gcFlags & JIM_GC_CANDIDATE) {
+            JimMarkReferences(marks, gc->candidates[i]);
+            gc->scanned++;
         }
-        objPtr = objPtr->nextObjPtr;
     }
+}
+
+/* Destroys every reference with an id below maxId which was not marked,
+ * calling its finalizer (if any). Returns the number of references collected. */
+static int JimSweepReferences(Jim_Interp *interp, Jim_HashTable *marks, unsigned long maxId)
+{
+    Jim_HashTableIterator *htiter;
+    Jim_HashEntry *he;
+    int collected = 0;
+
+    /* Avoid recursive collections from within finalizers */
+    interp->lastCollectId = -1;
 
     /* Run the references hash table to destroy every reference that
      * is not referenced outside (not present in the mark HT). */
@@ -5161,7 +7027,7 @@ int Jim_Collect(Jim_Interp *interp)
         refId = he->key;
         /* Check if in the mark phase we encountered
          * this reference. */
-        if (Jim_FindHashEntry(&marks, refId) == NULL) {
+        if (*refId < maxId && Jim_FindHashEntry(marks, refId) == NULL) {
 #ifdef JIM_DEBUG_GC
             printf("COLLECTING %d" JIM_NL, (int)*refId);
 #endif
@@ -5180,8 +7046,9 @@ int Jim_Collect(Jim_Interp *interp)
                 objv[2] = refPtr->objPtr;
 
                 /* Drop the reference itself */
-                /* Avoid the finaliser being freed here */
+                /* Avoid the finaliser and the value being freed here */
                 Jim_IncrRefCount(objv[0]);
+                Jim_IncrRefCount(objv[2]);
                 Jim_DeleteHashEntry(&interp->references, refId);
 
                 /* Call the finalizer. Errors ignored. */
@@ -5191,6 +7058,7 @@ int Jim_Collect(Jim_Interp *interp)
                 Jim_SetResult(interp, oldResult);
                 Jim_DecrRefCount(interp, oldResult);
 
+                Jim_DecrRefCount(interp, objv[2]);
                 Jim_DecrRefCount(interp, objv[0]);
             }
             else {
@@ -5199,9 +7067,166 @@ int Jim_Collect(Jim_Interp *interp)
         }
     }
     Jim_FreeHashTableIterator(htiter);
-    Jim_FreeHashTable(&marks);
     interp->lastCollectId = interp->referenceNextId;
     interp->lastCollectTime = time(NULL);
+    return collected;
+}
+
+/* Records the statistics of a collection step which began at 'start' */
+static void JimCollectDone(Jim_GcState *gc, jim_wide start, int collected)
+{
+    gc->collected += collected;
+    if (!gc->marking) {
+        gc->lastScanned = gc->scanned;
+    }
+    gc->lastPause = JimClock() - start;
+    gc->totalPause += gc->lastPause;
+    if (gc->lastPause > gc->maxPause) {
+        gc->maxPause = gc->lastPause;
+    }
+}
+
+static void JimStartMarking(Jim_Interp *interp)
+{
+    Jim_GcState *gc = interp->gcState;
+    Jim_ObjSlab *slab;
+
+    Jim_InitHashTable(&gc->marks, &JimRefMarkHashTableType, NULL);
+    JimCompactGcCandidates(gc);
+    gc->marking = 1;
+    gc->maxId = interp->referenceNextId;
+    gc->oldCandidates = gc->numCandidates;
+    gc->nextCandidate = 0;
+    gc->scanned = 0;
+    gc->numOldSlabs = gc->numNewSlabs = 0;
+    for (slab = interp->objSlabs; slab; slab = slab->next) {
+        gc->numOldSlabs++;
+    }
+    /* New objects must come from new slabs, and no slabs may be released */
+    gc->freeList = interp->freeList;
+    interp->freeList = NULL;
+    gc->freeObjLimit = interp->freeObjLimit;
+    interp->freeObjLimit = INT_MAX;
+}
+
+/* Ends marking, making the unused objects available again.
+ * The marks are left for the caller to free. */
+static void JimStopMarking(Jim_Interp *interp)
+{
+    Jim_GcState *gc = interp->gcState;
+
+    /* The free list holds no more than the rest of the newest slab */
+    if (interp->freeList) {
+        Jim_Obj *objPtr = interp->freeList;
+
+        while (JimNextFreeObj(objPtr)) {
+            objPtr = JimNextFreeObj(objPtr);
+        }
+        JimNextFreeObj(objPtr) = gc->freeList;
+    }
+    else {
+        interp->freeList = gc->freeList;
+    }
+    gc->freeList = NULL;
+    interp->freeObjLimit = gc->freeObjLimit;
+    gc->marking = 0;
+}
+
+static void JimAbandonMarking(Jim_Interp *interp)
+{
+    JimStopMarking(interp);
+    Jim_FreeHashTable(&interp->gcState->marks);
+    interp->gcState->abandons++;
+}
+
+#define JIM_COLLECT_STEP_OBJS 4096
+
+/* Performs one step of an incremental collection, starting a new one if none
+ * is in progress. Returns the number of references collected, which is
+ * nonzero only if this step completed the collection. */
+static int JimCollectStep(Jim_Interp *interp)
+{
+    Jim_GcState *gc = interp->gcState;
+    jim_wide start;
+    int collected = 0;
+
+    if (interp->lastCollectId == -1) {
+        /* Finalizers are running */
+        return 0;
+    }
+    start = JimClock();
+    if (!gc->marking) {
+        if (interp->references.used == 0) {
+            /* Nothing to collect */
+            interp->lastCollectId = interp->referenceNextId;
+            interp->lastCollectTime = time(NULL);
+            return 0;
+        }
+        JimStartMarking(interp);
+    }
+    gc->steps++;
+    if (gc->oldCandidates - gc->nextCandidate > JIM_COLLECT_STEP_OBJS) {
+        JimMarkCandidates(gc, &gc->marks, gc->nextCandidate, gc->nextCandidate + JIM_COLLECT_STEP_OBJS);
+        gc->nextCandidate += JIM_COLLECT_STEP_OBJS;
+    }
+    else {
+        /* Finally scan the rest, including the candidates created since marking started */
+        JimMarkCandidates(gc, &gc->marks, gc->nextCandidate, gc->numCandidates);
+        JimStopMarking(interp);
+        collected = JimSweepReferences(interp, &gc->marks, gc->maxId);
+        Jim_FreeHashTable(&gc->marks);
+        gc->abandoned = 0;
+        gc->cycles++;
+    }
+    JimCollectDone(gc, start, collected);
+    return collected;
+}
+
+/* Performs a full garbage collection. */
+int Jim_Collect(Jim_Interp *interp)
+{
+    int collected = 0;
+#ifndef JIM_BOOTSTRAP
+    Jim_GcState *gc = interp->gcState;
+    Jim_HashTable marks;
+    jim_wide start;
+    int freeObjLimit;
+
+    /* Avoid recursive calls */
+    if (interp->lastCollectId == -1) {
+        /* Jim_Collect() already running. Return just now. */
+        return 0;
+    }
+    start = JimClock();
+    if (gc->marking) {
+        /* Replace the incremental collection in progress */
+        JimAbandonMarking(interp);
+    }
+
+    gc->scanned = 0;
+    if (interp->references.used) {
+        /* Mark all the references found into the 'mark' hash table.
+         * The references are searched in every live candidate that
+         * is of a type that can contain references. */
+        Jim_InitHashTable(&marks, &JimRefMarkHashTableType, NULL);
+        JimCompactGcCandidates(gc);
+        /* The candidates must not be compacted while they are being walked */
+        freeObjLimit = interp->freeObjLimit;
+        interp->freeObjLimit = INT_MAX;
+        JimMarkCandidates(gc, &marks, 0, gc->numCandidates);
+        interp->freeObjLimit = freeObjLimit;
+
+        collected = JimSweepReferences(interp, &marks, interp->referenceNextId);
+        Jim_FreeHashTable(&marks);
+    }
+    else {
+        /* No need to scan anything */
+        interp->lastCollectId = interp->referenceNextId;
+        interp->lastCollectTime = time(NULL);
+    }
+    gc->abandoned = 0;
+    gc->cycles++;
+    JimCollectDone(gc, start, collected);
 #endif /* JIM_BOOTSTRAP */
     return collected;
 }
@@ -5209,25 +7234,65 @@ int Jim_Collect(Jim_Interp *interp)
 #define JIM_COLLECT_ID_PERIOD 5000
 #define JIM_COLLECT_TIME_PERIOD 300
 
+/* Called periodically, from Jim_NewReference() and the event loop.
+ * Advances the incremental collection in progress, or starts a new one if
+ * enough time has passed or enough references have been created since the
+ * last one. If the last incremental collection had to be abandoned,
+ * a full collection is performed instead. */
 void Jim_CollectIfNeeded(Jim_Interp *interp)
 {
     unsigned long elapsedId;
     int elapsedTime;
 
+    if (interp->gcState->marking) {
+        JimCollectStep(interp);
+        return;
+    }
+
     elapsedId = interp->referenceNextId - interp->lastCollectId;
     elapsedTime = time(NULL) - interp->lastCollectTime;
 
 
     if (elapsedId > JIM_COLLECT_ID_PERIOD || elapsedTime > JIM_COLLECT_TIME_PERIOD) {
-        Jim_Collect(interp);
+        if (interp->gcState->abandoned) {
+            Jim_Collect(interp);
+        }
+        else {
+            JimCollectStep(interp);
+        }
     }
 }
-#endif
 
-static int JimIsBigEndian(void)
+/* Returns a dictionary of statistics about reference collection */
+static Jim_Obj *JimCollectStats(Jim_Interp *interp)
 {
-    union {
-        unsigned short s;
+    Jim_GcState *gc = interp->gcState;
+    Jim_Obj *statsObj = Jim_NewListObj(interp, NULL, 0);
+
+#define JimAddCollectStat(name, value) \
+    Jim_ListAppendElement(interp, statsObj, Jim_NewStringObj(interp, name, -1)); \
+    Jim_ListAppendElement(interp, statsObj, Jim_NewIntObj(interp, value))
+
+    JimAddCollectStat("running", gc->marking);
+    JimAddCollectStat("references", interp->references.used);
+    JimAddCollectStat("cycles", gc->cycles);
+    JimAddCollectStat("steps", gc->steps);
+    JimAddCollectStat("abandoned", gc->abandons);
+    JimAddCollectStat("collected", gc->collected);
+    JimAddCollectStat("scanned", gc->lastScanned);
+    JimAddCollectStat("lastpause", gc->lastPause);
+    JimAddCollectStat("maxpause", gc->maxPause);
+    JimAddCollectStat("totalpause", gc->totalPause);
+
+#undef JimAddCollectStat
+    return statsObj;
+}
+#endif
+
+static int JimIsBigEndian(void)
+{
+    union {
+        unsigned short s;
         unsigned char c[2];
     } uval = {0x0102};
 
@@ -5249,13 +7314,23 @@ Jim_Interp *Jim_CreateInterp(void)
     i->lastCollectTime = time(NULL);
 
     /* Note that we can create objects only after the
-     * interpreter liveList and freeList pointers are
+     * interpreter objSlabs and freeList pointers are
      * initialized to NULL. */
-    Jim_InitHashTable(&i->commands, &JimCommandsHashTableType, i);
+    i->freeObjLimit = JIM_OBJ_FREE_HIGHWATER;
+#ifdef JIM_REFERENCES
+    i->gcState = Jim_Alloc(sizeof(*i->gcState));
+    memset(i->gcState, 0, sizeof(*i->gcState));
+#endif
+    JimSystemRandomBytes(i, &i->hashSeed, sizeof(i->hashSeed));
+    JimInitSeededHashTable(i, &i->commands, &JimCommandsHashTableType);
 #ifdef JIM_REFERENCES
     Jim_InitHashTable(&i->references, &JimReferencesHashTableType, i);
 #endif
-    Jim_InitHashTable(&i->assocData, &JimAssocDataHashTableType, i);
+    JimInitSeededHashTable(i, &i->assocData, &JimAssocDataHashTableType);
+    i->smallInts = Jim_Alloc(sizeof(*i->smallInts) * (JIM_SMALLINT_MAX - JIM_SMALLINT_MIN + 1));
+    memset(i->smallInts, 0, sizeof(*i->smallInts) * (JIM_SMALLINT_MAX - JIM_SMALLINT_MIN + 1));
+    JimInitSeededHashTable(i, &i->interned, &JimInternHashTableType);
+    i->internPurgeSize = JIM_INTERN_PURGE_SIZE;
     Jim_InitHashTable(&i->packages, &JimPackageHashTableType, NULL);
     i->emptyObj = Jim_NewEmptyStringObj(i);
     i->trueObj = Jim_NewIntObj(i, 1);
@@ -5295,8 +7370,15 @@ Jim_Interp *Jim_CreateInterp(void)
 void Jim_FreeInterp(Jim_Interp *i)
 {
     Jim_CallFrame *cf = i->framePtr, *prevcf, *nextcf;
-    Jim_Obj *objPtr, *nextObjPtr;
+    Jim_ObjSlab *slab, *nextslab;
+    int leaks = 0;
+    int j;
 
+#ifdef JIM_REFERENCES
+    if (i->gcState->marking) {
+        JimAbandonMarking(i);
+    }
+#endif
     Jim_DecrRefCount(i, i->emptyObj);
     Jim_DecrRefCount(i, i->trueObj);
     Jim_DecrRefCount(i, i->falseObj);
@@ -5320,15 +7402,30 @@ void Jim_FreeInterp(Jim_Interp *i)
         JimFreeCallFrame(i, cf, JIM_FCF_NONE);
         cf = prevcf;
     }
-    /* Check that the live object list is empty, otherwise
+    Jim_FreeHashTable(&i->interned);
+    for (j = 0; j <= JIM_SMALLINT_MAX - JIM_SMALLINT_MIN; j++) {
+        if (i->smallInts[j]) {
+            JimReleaseSmallInt(i, i->smallInts[j]);
+        }
+    }
+    Jim_Free(i->smallInts);
+    /* Check that there are no live objects, otherwise
      * there is a memory leak. */
-    if (i->liveList != NULL) {
-        objPtr = i->liveList;
+    for (slab = i->objSlabs; slab; slab = slab->next) {
+        int n;
 
-        printf(JIM_NL "-------------------------------------" JIM_NL);
-        printf("Objects still in the free list:" JIM_NL);
-        while (objPtr) {
-            const char *type = objPtr->typePtr ? objPtr->typePtr->name : "string";
+        for (n = 0; n < JIM_OBJ_SLAB_SIZE; n++) {
+            Jim_Obj *objPtr = &slab->objs[n];
+            const char *type;
+
+            if (objPtr->refCount == -1) {
+                continue;
+            }
+            if (leaks++ == 0) {
+                printf(JIM_NL "-------------------------------------" JIM_NL);
+                printf("Objects still in the free list:" JIM_NL);
+            }
+            type = objPtr->typePtr ? objPtr->typePtr->name : "string";
 
             if (objPtr->bytes && strlen(objPtr->bytes) > 20) {
                 printf("%p (%d) %-10s: '%.20s...'" JIM_NL,
@@ -5343,17 +7440,16 @@ void Jim_FreeInterp(Jim_Interp *i)
                     Jim_String(objPtr->internalRep.sourceValue.fileNameObj),
                     objPtr->internalRep.sourceValue.lineNumber);
             }
-            objPtr = objPtr->nextObjPtr;
         }
+    }
+    if (leaks) {
         printf("-------------------------------------" JIM_NL JIM_NL);
         JimPanic((1, "Live list non empty freeing the interpreter! Leak?"));
     }
-    /* Free all the freed objects. */
-    objPtr = i->freeList;
-    while (objPtr) {
-        nextObjPtr = objPtr->nextObjPtr;
-        Jim_Free(objPtr);
-        objPtr = nextObjPtr;
+    /* Free all the object slabs. */
+    for (slab = i->objSlabs; slab; slab = nextslab) {
+        nextslab = slab->next;
+        Jim_Free(slab);
     }
     /* Free cached CallFrame structures */
     cf = i->freeFramesList;
@@ -5361,12 +7457,17 @@ void Jim_FreeInterp(Jim_Interp *i)
         nextcf = cf->next;
         if (cf->vars.table != NULL)
             Jim_Free(cf->vars.table);
+        Jim_Free(cf->slots);
         Jim_Free(cf);
         cf = nextcf;
     }
 #ifdef jim_ext_load
     Jim_FreeLoadHandles(i);
 #endif
+#ifdef JIM_REFERENCES
+    Jim_Free(i->gcState->candidates);
+    Jim_Free(i->gcState);
+#endif
 
     /* Free the interpreter structure. */
     Jim_Free(i);
@@ -5573,7 +7674,6 @@ int Jim_GetExitCode(Jim_Interp *interp)
 /* -----------------------------------------------------------------------------
  * Integer object
  * ---------------------------------------------------------------------------*/
-#define JIM_INTEGER_SPACE 24
 
 static void UpdateStringOfInt(struct Jim_Obj *objPtr);
 static int SetIntFromAny(Jim_Interp *interp, Jim_Obj *objPtr, int flags);
@@ -5606,7 +7706,7 @@ void UpdateStringOfInt(struct Jim_Obj *objPtr)
     char buf[JIM_INTEGER_SPACE + 1];
 
     len = Jim_WideToString(buf, JimWideValue(objPtr));
-    objPtr->bytes = Jim_Alloc(len + 1);
+    objPtr->bytes = JimAllocStringRep(objPtr, len);
     memcpy(objPtr->bytes, buf, len + 1);
     objPtr->length = len;
 }
@@ -5679,7 +7779,8 @@ int Jim_GetLong(Jim_Interp *interp, Jim_Obj *objPtr, long *longPtr)
     return JIM_ERR;
 }
 
-Jim_Obj *Jim_NewIntObj(Jim_Interp *interp, jim_wide wideValue)
+/* Returns a new (unshared) int object, which the caller may modify in place */
+static Jim_Obj *JimNewUnsharedIntObj(Jim_Interp *interp, jim_wide wideValue)
 {
     Jim_Obj *objPtr;
 
@@ -5690,6 +7791,43 @@ Jim_Obj *Jim_NewIntObj(Jim_Interp *interp, jim_wide wideValue)
     return objPtr;
 }
 
+/* interp->smallInts holds two references to each object, so that it is
+ * always Jim_IsShared() and is copied rather than modified in place,
+ * even by a caller which has not taken a reference of its own. */
+static void JimReleaseSmallInt(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    Jim_DecrRefCount(interp, objPtr);
+    Jim_DecrRefCount(interp, objPtr);
+}
+
+/* Returns an int object, which is shared if in the range JIM_SMALLINT_MIN to JIM_SMALLINT_MAX */
+Jim_Obj *Jim_NewIntObj(Jim_Interp *interp, jim_wide wideValue)
+{
+    Jim_Obj *objPtr;
+    Jim_Obj **smallIntPtr;
+
+    if (wideValue < JIM_SMALLINT_MIN || wideValue > JIM_SMALLINT_MAX) {
+        return JimNewUnsharedIntObj(interp, wideValue);
+    }
+    smallIntPtr = &interp->smallInts[wideValue - JIM_SMALLINT_MIN];
+    objPtr = *smallIntPtr;
+    if (objPtr) {
+        if (objPtr->typePtr == &intObjType) {
+            return objPtr;
+        }
+        /* Shimmered to another type and may still be in use as that type, so replace it */
+        JimReleaseSmallInt(interp, objPtr);
+    }
+    objPtr = JimNewUnsharedIntObj(interp, wideValue);
+    Jim_IncrRefCount(objPtr);
+    Jim_IncrRefCount(objPtr);
+    /* Generate the string rep now so that the value survives if the shared
+     * object is later converted to another type */
+    Jim_String(objPtr);
+    *smallIntPtr = objPtr;
+    return objPtr;
+}
+
 /* -----------------------------------------------------------------------------
  * Double object
  * ---------------------------------------------------------------------------*/
@@ -5712,7 +7850,7 @@ void UpdateStringOfDouble(struct Jim_Obj *objPtr)
     char buf[JIM_DOUBLE_SPACE + 1];
 
     len = Jim_DoubleToString(buf, objPtr->internalRep.doubleValue);
-    objPtr->bytes = Jim_Alloc(len + 1);
+    objPtr->bytes = JimAllocStringRep(objPtr, len);
     memcpy(objPtr->bytes, buf, len + 1);
     objPtr->length = len;
 }
@@ -5796,8 +7934,8 @@ Jim_Obj *Jim_NewDoubleObj(Jim_Interp *interp, double doubleValue)
 /* -----------------------------------------------------------------------------
  * List object
  * ---------------------------------------------------------------------------*/
-static void ListInsertElements(Jim_Obj *listPtr, int idx, int elemc, Jim_Obj *const *elemVec);
-static void ListAppendElement(Jim_Obj *listPtr, Jim_Obj *objPtr);
+static void ListInsertElements(Jim_Interp *interp, Jim_Obj *listPtr, int idx, int elemc, Jim_Obj *const *elemVec);
+static void ListAppendElement(Jim_Interp *interp, Jim_Obj *listPtr, Jim_Obj *objPtr);
 static void FreeListInternalRep(Jim_Interp *interp, Jim_Obj *objPtr);
 static void DupListInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr);
 static void UpdateStringOfList(struct Jim_Obj *objPtr);
@@ -5815,10 +7953,239 @@ static const Jim_ObjType listObjType = {
     JIM_TYPE_NONE,
 };
 
+/* Lists may share their elements with other lists, so that a range of a list
+ * or a duplicate of a list doesn't need to copy (and incr) every element.
+ * The shared elements are kept in a Jim_ListStore, which holds a reference to
+ * each element, and each list sharing the store is a slice of it:
+ * listValue.ele points into store->ele.
+ * Otherwise listValue.store is NULL and the list owns listValue.ele.
+ *
+ * A list must own its elements before they are modified, except that elements
+ * may be appended directly to the store by a list that ends at the end of the
+ * store, since no other list can see them.
+ *
+ * A store that is searched repeatedly for exact matches also gets a hash index
+ * of its elements, which is discarded if the elements change.
+ */
+typedef struct Jim_ListStore {
+    int refCount;       /* Number of lists sharing the store */
+    int start;          /* Elements before this are no longer referenced */
+    int len;            /* Elements from start up to len are referenced */
+    int maxLen;         /* Allocated 'ele' length */
+    Jim_Obj **ele;
+    int searches;       /* Exact searches without an index */
+    struct Jim_ListHashIndex *hashIndex; /* Index of the elements by string value, or NULL */
+} Jim_ListStore;
+
+/* The elements of a store by string value. Each bucket chains the positions of
+ * its elements in increasing order, so the first match in a slice is found first.
+ */
+typedef struct Jim_ListHashIndex {
+    unsigned mask;      /* Number of buckets - 1. Positions up to mask can be indexed */
+    unsigned seed;      /* The interpreter's hashSeed */
+    int *buckets;       /* First position in each bucket, or -1 */
+    int *next;          /* Next position in the same bucket, or -1 */
+} Jim_ListHashIndex;
+
+/* Shorter lists are simply copied rather than shared */
+#define JIM_LIST_SHARE_MIN 16
+
+/* Lists at least this long are indexed on their second exact search */
+#define JIM_LIST_HASH_MIN 32
+
+static void JimListStoreDiscardIndex(Jim_ListStore *store)
+{
+    if (store->hashIndex) {
+        Jim_Free(store->hashIndex->buckets);
+        Jim_Free(store->hashIndex->next);
+        Jim_Free(store->hashIndex);
+        store->hashIndex = NULL;
+    }
+    store->searches = 0;
+}
+
+static void JimFreeListStore(Jim_Interp *interp, Jim_ListStore *store)
+{
+    int i;
+
+    for (i = store->start; i < store->len; i++) {
+        Jim_DecrRefCount(interp, store->ele[i]);
+    }
+    JimListStoreDiscardIndex(store);
+    Jim_Free(store->ele);
+    Jim_Free(store);
+}
+
+/* Returns the store for the elements of the list, creating it if necessary */
+static Jim_ListStore *JimListStore(Jim_Obj *listPtr)
+{
+    Jim_ListStore *store = listPtr->internalRep.listValue.store;
+
+    if (store == NULL) {
+        store = Jim_Alloc(sizeof(*store));
+        store->refCount = 1;
+        store->start = 0;
+        store->len = listPtr->internalRep.listValue.len;
+        store->maxLen = listPtr->internalRep.listValue.maxLen;
+        store->ele = listPtr->internalRep.listValue.ele;
+        store->searches = 0;
+        store->hashIndex = NULL;
+        listPtr->internalRep.listValue.store = store;
+    }
+    return store;
+}
+
+/* Releases the elements of the store outside the given list,
+ * which must be the only list using the store */
+static void JimListStoreTrim(Jim_Interp *interp, Jim_Obj *listPtr)
+{
+    Jim_ListStore *store = listPtr->internalRep.listValue.store;
+    int first = listPtr->internalRep.listValue.ele - store->ele;
+    int end = first + listPtr->internalRep.listValue.len;
+
+    while (store->start < first) {
+        Jim_DecrRefCount(interp, store->ele[store->start]);
+        store->start++;
+    }
+    if (store->len > end) {
+        /* The positions may be reused by appended elements */
+        JimListStoreDiscardIndex(store);
+        while (store->len > end) {
+            store->len--;
+            Jim_DecrRefCount(interp, store->ele[store->len]);
+        }
+    }
+}
+
+/* Adds the store positions from 'first' up to store->len to the end of their hash chains */
+static void JimListHashIndexAdd(Jim_ListStore *store, int first)
+{
+    Jim_ListHashIndex *index = store->hashIndex;
+    int i;
+
+    for (i = first; i < store->len; i++) {
+        int *pos = &index->buckets[JimObjectHTSeededHashFunction(store->ele[i], index->seed) & index->mask];
+
+        while (*pos >= 0) {
+            pos = &index->next[*pos];
+        }
+        *pos = i;
+        index->next[i] = -1;
+    }
+}
+
+static void JimListStoreBuildIndex(Jim_Interp *interp, Jim_ListStore *store)
+{
+    Jim_ListHashIndex *index = Jim_Alloc(sizeof(*index));
+    unsigned size = 16;
+    int i;
+
+    /* Leave room to append as many elements again */
+    while (size < (unsigned)store->len * 2) {
+        size <<= 1;
+    }
+    index->mask = size - 1;
+    index->seed = interp->hashSeed;
+    index->buckets = Jim_Alloc(size * sizeof(*index->buckets));
+    index->next = Jim_Alloc(size * sizeof(*index->next));
+    memset(index->buckets, -1, size * sizeof(*index->buckets));
+
+    /* Insert in reverse so that each chain is in increasing order */
+    for (i = store->len - 1; i >= store->start; i--) {
+        int *bucket = &index->buckets[JimObjectHTSeededHashFunction(store->ele[i], index->seed) & index->mask];
+
+        index->next[i] = *bucket;
+        *bucket = i;
+    }
+    store->hashIndex = index;
+}
+
+/* Sets the list to own a copy of the given elements, with room for maxLen elements */
+static void JimListSetElements(Jim_Obj *listPtr, Jim_Obj *const *ele, int len, int maxLen)
+{
+    int i;
+
+    listPtr->internalRep.listValue.len = len;
+    listPtr->internalRep.listValue.maxLen = maxLen;
+    listPtr->internalRep.listValue.ele = Jim_Alloc(sizeof(Jim_Obj *) * maxLen);
+    listPtr->internalRep.listValue.store = NULL;
+    if (len) {
+        memcpy(listPtr->internalRep.listValue.ele, ele, sizeof(Jim_Obj *) * len);
+    }
+    for (i = 0; i < len; i++) {
+        Jim_IncrRefCount(ele[i]);
+    }
+}
+
+/* Ensures that the list owns its elements, with room for at least maxLen,
+ * so that they can be modified */
+static void JimListUnshare(Jim_Interp *interp, Jim_Obj *listPtr, int maxLen)
+{
+    Jim_ListStore *store = listPtr->internalRep.listValue.store;
+
+    if (store) {
+        if (store->refCount == 1 && listPtr->internalRep.listValue.ele == store->ele) {
+            /* Nothing else uses the store, so just take over the elements */
+            JimListStoreTrim(interp, listPtr);
+            JimListStoreDiscardIndex(store);
+            listPtr->internalRep.listValue.maxLen = store->maxLen;
+            listPtr->internalRep.listValue.store = NULL;
+            Jim_Free(store);
+        }
+        else {
+            int len = listPtr->internalRep.listValue.len;
+
+            JimListSetElements(listPtr, listPtr->internalRep.listValue.ele, len, maxLen > len ? maxLen : len);
+            if (--store->refCount == 0) {
+                JimFreeListStore(interp, store);
+            }
+        }
+    }
+}
+
+/* Returns a new list of 'len' elements of the list starting at 'first' */
+static Jim_Obj *JimListSlice(Jim_Interp *interp, Jim_Obj *listPtr, int first, int len)
+{
+    Jim_Obj **ele = listPtr->internalRep.listValue.ele + first;
+    Jim_ListStore *store = listPtr->internalRep.listValue.store;
+    Jim_Obj *objPtr;
+
+    /* A shared store keeps all its elements alive, so only share
+     * if the slice is at least half of it */
+    if (len < JIM_LIST_SHARE_MIN || len * 2 < (store ? store->len - store->start : listPtr->internalRep.listValue.len)) {
+        return Jim_NewListObj(interp, ele, len);
+    }
+    store = JimListStore(listPtr);
+    store->refCount++;
+
+    objPtr = Jim_NewObj(interp);
+    objPtr->typePtr = &listObjType;
+    objPtr->bytes = NULL;
+    objPtr->internalRep.listValue.ele = ele;
+    objPtr->internalRep.listValue.len = len;
+    objPtr->internalRep.listValue.maxLen = 0;
+    objPtr->internalRep.listValue.store = store;
+    return objPtr;
+}
+
 void FreeListInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
 {
     int i;
+    Jim_ListStore *store = objPtr->internalRep.listValue.store;
 
+#ifdef JIM_REFERENCES
+    if (objPtr->bytes) {
+        /* The string rep may hold references which were only in the elements */
+        JimInheritGcCandidates(interp, objPtr, objPtr->internalRep.listValue.ele,
+            objPtr->internalRep.listValue.len);
+    }
+#endif
+    if (store) {
+        if (--store->refCount == 0) {
+            JimFreeListStore(interp, store);
+        }
+        return;
+    }
     for (i = 0; i < objPtr->internalRep.listValue.len; i++) {
         Jim_DecrRefCount(interp, objPtr->internalRep.listValue.ele[i]);
     }
@@ -5827,18 +8194,16 @@ void FreeListInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
 
 void DupListInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
 {
-    int i;
-
     JIM_NOTUSED(interp);
 
-    dupPtr->internalRep.listValue.len = srcPtr->internalRep.listValue.len;
-    dupPtr->internalRep.listValue.maxLen = srcPtr->internalRep.listValue.maxLen;
-    dupPtr->internalRep.listValue.ele =
-        Jim_Alloc(sizeof(Jim_Obj *) * srcPtr->internalRep.listValue.maxLen);
-    memcpy(dupPtr->internalRep.listValue.ele, srcPtr->internalRep.listValue.ele,
-        sizeof(Jim_Obj *) * srcPtr->internalRep.listValue.len);
-    for (i = 0; i < dupPtr->internalRep.listValue.len; i++) {
-        Jim_IncrRefCount(dupPtr->internalRep.listValue.ele[i]);
+    if (srcPtr->internalRep.listValue.len >= JIM_LIST_SHARE_MIN) {
+        /* Share the elements instead of copying them */
+        JimListStore(srcPtr)->refCount++;
+        dupPtr->internalRep.listValue = srcPtr->internalRep.listValue;
+    }
+    else {
+        JimListSetElements(dupPtr, srcPtr->internalRep.listValue.ele, srcPtr->internalRep.listValue.len,
+            srcPtr->internalRep.listValue.store ? srcPtr->internalRep.listValue.len : srcPtr->internalRep.listValue.maxLen);
     }
     dupPtr->typePtr = &listObjType;
 }
@@ -6036,7 +8401,7 @@ static void JimMakeListStringRep(Jim_Obj *objPtr, Jim_Obj **objv, int objc)
     bufLen++;
 
     /* Generate the string rep. */
-    p = objPtr->bytes = Jim_Alloc(bufLen + 1);
+    p = objPtr->bytes = JimAllocStringRep(objPtr, bufLen);
     realLength = 0;
     for (i = 0; i < objc; i++) {
         int len, qlen;
@@ -6094,9 +8459,11 @@ static int SetListFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
         return JIM_OK;
     }
 
-#if 0
-    /* Optimise dict -> list. XXX: Is it worth it?  */
-    if (Jim_IsDict(objPtr)) {
+    /* Optimise dict -> list. Since the dict is ordered, this gives the same
+     * list as its string representation, but only if the string
+     * representation was generated from the dict rather than parsed
+     * (which may contain duplicate keys). */
+    if (Jim_IsDict(objPtr) && objPtr->bytes == NULL) {
         Jim_Obj **listObjPtrPtr;
         int len;
         int i;
@@ -6112,10 +8479,10 @@ static int SetListFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
         objPtr->internalRep.listValue.len = len;
         objPtr->internalRep.listValue.maxLen = len;
         objPtr->internalRep.listValue.ele = listObjPtrPtr;
+        objPtr->internalRep.listValue.store = NULL;
 
         return JIM_OK;
     }
-#endif
 
     /* Try to preserve information about filename / line number */
     if (objPtr->typePtr == &sourceObjType) {
@@ -6138,6 +8505,7 @@ static int SetListFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
     objPtr->internalRep.listValue.len = 0;
     objPtr->internalRep.listValue.maxLen = 0;
     objPtr->internalRep.listValue.ele = NULL;
+    objPtr->internalRep.listValue.store = NULL;
 
     /* Convert into a list */
     JimParserInit(&parser, str, strLen, linenr);
@@ -6149,7 +8517,8 @@ static int SetListFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
             continue;
         elementPtr = JimParserGetTokenObj(interp, &parser);
         JimSetSourceInfo(interp, elementPtr, fileNameObj, parser.tline);
-        ListAppendElement(objPtr, elementPtr);
+        JimInheritGcCandidate(interp, elementPtr, objPtr);
+        ListAppendElement(interp, objPtr, elementPtr);
     }
     Jim_DecrRefCount(interp, fileNameObj);
     return JIM_OK;
@@ -6165,9 +8534,10 @@ Jim_Obj *Jim_NewListObj(Jim_Interp *interp, Jim_Obj *const *elements, int len)
     objPtr->internalRep.listValue.ele = NULL;
     objPtr->internalRep.listValue.len = 0;
     objPtr->internalRep.listValue.maxLen = 0;
+    objPtr->internalRep.listValue.store = NULL;
 
     if (len) {
-        ListInsertElements(objPtr, 0, len, elements);
+        ListInsertElements(interp, objPtr, 0, len, elements);
     }
 
     return objPtr;
@@ -6200,129 +8570,483 @@ static int JimSign(jim_wide w)
 
 /* ListSortElements type values */
 struct lsort_info {
-    jmp_buf jmpbuf;
     Jim_Obj *command;
     Jim_Interp *interp;
     enum {
         JIM_LSORT_ASCII,
         JIM_LSORT_NOCASE,
         JIM_LSORT_INTEGER,
+        JIM_LSORT_REAL,
         JIM_LSORT_COMMAND
     } type;
     int order;
     int index;
     int indexed;
-    int (*subfn)(Jim_Obj **, Jim_Obj **);
+    int unique;
+    int rc;                 /* Set if a comparison fails. Later comparisons do nothing */
+    int cmdc;               /* For -command, the command words plus two slots for the arguments */
+    Jim_Obj **cmdv;
 };
 
-static struct lsort_info *sort_info;
+/* An element of the list being sorted, along with its sort key.
+ * Keys are extracted (and for -integer and -real, converted) just once, before sorting.
+ */
+struct lsort_elem {
+    Jim_Obj *objPtr;
+    Jim_Obj *keyObj;
+    jim_wide wideValue;
+    double doubleValue;
+};
+
+/* Runs shorter than this are extended with insertion sort before merging */
+#define JIM_LSORT_MIN_RUN 32
+
+/* At least this many -integer or -real elements are radix sorted */
+#define JIM_LSORT_RADIX_MIN 256
 
-static int ListSortIndexHelper(Jim_Obj **lhsObj, Jim_Obj **rhsObj)
+static int ListSortCommand(struct lsort_info *info, Jim_Obj *lhsObj, Jim_Obj *rhsObj)
 {
-    Jim_Obj *lObj, *rObj;
+    Jim_Interp *interp = info->interp;
+    jim_wide ret = 0;
+    int rc;
+
+    info->cmdv[info->cmdc - 2] = lhsObj;
+    info->cmdv[info->cmdc - 1] = rhsObj;
+    rc = Jim_EvalObjVector(interp, info->cmdc, info->cmdv);
 
-    if (Jim_ListIndex(sort_info->interp, *lhsObj, sort_info->index, &lObj, JIM_ERRMSG) != JIM_OK ||
-        Jim_ListIndex(sort_info->interp, *rhsObj, sort_info->index, &rObj, JIM_ERRMSG) != JIM_OK) {
-        longjmp(sort_info->jmpbuf, JIM_ERR);
+    if (rc != JIM_OK || Jim_GetWide(interp, Jim_GetResult(interp), &ret) != JIM_OK) {
+        info->rc = rc == JIM_OK ? JIM_ERR : rc;
+        return 0;
     }
-    return sort_info->subfn(&lObj, &rObj);
+
+    return JimSign(ret);
 }
 
-/* Sort the internal rep of a list. */
-static int ListSortString(Jim_Obj **lhsObj, Jim_Obj **rhsObj)
+static int ListSortCompare(struct lsort_info *info, const struct lsort_elem *lhs, const struct lsort_elem *rhs)
 {
-    return Jim_StringCompareObj(sort_info->interp, *lhsObj, *rhsObj, 0) * sort_info->order;
+    int cmp;
+
+    switch (info->type) {
+        case JIM_LSORT_ASCII:
+            cmp = Jim_StringCompareObj(info->interp, lhs->keyObj, rhs->keyObj, 0);
+            break;
+        case JIM_LSORT_NOCASE:
+            cmp = Jim_StringCompareObj(info->interp, lhs->keyObj, rhs->keyObj, 1);
+            break;
+        case JIM_LSORT_INTEGER:
+            cmp = (lhs->wideValue > rhs->wideValue) - (lhs->wideValue < rhs->wideValue);
+            break;
+        case JIM_LSORT_REAL:
+            cmp = (lhs->doubleValue > rhs->doubleValue) - (lhs->doubleValue < rhs->doubleValue);
+            break;
+        default:
+            if (info->rc != JIM_OK) {
+                /* Just let the sort run to completion */
+                return 0;
+            }
+            cmp = ListSortCommand(info, lhs->keyObj, rhs->keyObj);
+            break;
+    }
+    return cmp * info->order;
 }
 
-static int ListSortStringNoCase(Jim_Obj **lhsObj, Jim_Obj **rhsObj)
+/* Sorts a[0..len) where a[0..sorted) is already sorted, using a binary search to keep comparisons
+ * down. Equal elements are inserted after existing ones, so the sort is stable.
+ */
+static void ListSortInsertion(struct lsort_info *info, struct lsort_elem *a, int sorted, int len)
 {
-    return Jim_StringCompareObj(sort_info->interp, *lhsObj, *rhsObj, 1) * sort_info->order;
+    int i;
+
+    for (i = sorted; i < len; i++) {
+        struct lsort_elem elem = a[i];
+        int lo = 0;
+        int hi = i;
+
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+
+            if (ListSortCompare(info, &elem, &a[mid]) < 0) {
+                hi = mid;
+            }
+            else {
+                lo = mid + 1;
+            }
+        }
+        memmove(&a[lo + 1], &a[lo], (i - lo) * sizeof(*a));
+        a[lo] = elem;
+    }
 }
 
-static int ListSortInteger(Jim_Obj **lhsObj, Jim_Obj **rhsObj)
+/* Merges the sorted runs a[0..mid) and a[mid..len), using tmp (which must have room for mid elements) */
+static void ListSortMerge(struct lsort_info *info, struct lsort_elem *a, int mid, int len, struct lsort_elem *tmp)
 {
-    jim_wide lhs = 0, rhs = 0;
+    int i = 0;
+    int j = mid;
+    int k = 0;
+
+    if (ListSortCompare(info, &a[mid - 1], &a[mid]) <= 0) {
+        /* Already in order, as is common for partly sorted input */
+        return;
+    }
+    memcpy(tmp, a, mid * sizeof(*a));
+    while (i < mid && j < len) {
+        /* Take from the left run on ties, for stability */
+        if (ListSortCompare(info, &a[j], &tmp[i]) < 0) {
+            a[k++] = a[j++];
+        }
+        else {
+            a[k++] = tmp[i++];
+        }
+    }
+    /* Anything left in the right run is already in place */
+    memcpy(&a[k], &tmp[i], (mid - i) * sizeof(*a));
+}
+
+/**
+ * A stable natural merge sort, in the style of timsort.
+ *
+ * Ascending and strictly descending runs already present in the input are found first
+ * (descending ones are reversed), with short runs extended to JIM_LSORT_MIN_RUN by
+ * insertion sort. Adjacent runs are then merged pairwise until one remains.
+ * This needs few comparisons on presorted data, which matters most for -command.
+ */
+static void ListSortMergeSort(struct lsort_info *info, struct lsort_elem *a, int len)
+{
+    struct lsort_elem *tmp;
+    int *runs;
+    int nruns = 0;
+    int start, end;
+
+    /* Every run except the last has at least JIM_LSORT_MIN_RUN elements */
+    runs = Jim_Alloc((len / JIM_LSORT_MIN_RUN + 1) * sizeof(*runs));
+    tmp = Jim_Alloc(len * sizeof(*tmp));
+
+    for (start = 0; start < len; start = end) {
+        end = start + 1;
+        if (end < len) {
+            if (ListSortCompare(info, &a[end], &a[start]) < 0) {
+                int i, j;
+
+                /* Strictly descending, so reversing it cannot reorder equal elements */
+                while (++end < len && ListSortCompare(info, &a[end], &a[end - 1]) < 0) {
+                }
+                for (i = start, j = end - 1; i < j; i++, j--) {
+                    struct lsort_elem t = a[i];
+                    a[i] = a[j];
+                    a[j] = t;
+                }
+            }
+            else {
+                while (++end < len && ListSortCompare(info, &a[end], &a[end - 1]) >= 0) {
+                }
+            }
+        }
+        if (end - start < JIM_LSORT_MIN_RUN && end < len) {
+            int extend = len - start < JIM_LSORT_MIN_RUN ? len : start + JIM_LSORT_MIN_RUN;
 
-    if (Jim_GetWide(sort_info->interp, *lhsObj, &lhs) != JIM_OK ||
-        Jim_GetWide(sort_info->interp, *rhsObj, &rhs) != JIM_OK) {
-        longjmp(sort_info->jmpbuf, JIM_ERR);
+            ListSortInsertion(info, a + start, end - start, extend - start);
+            end = extend;
+        }
+        runs[nruns++] = end;
+    }
+
+    while (nruns > 1) {
+        int i;
+        int n = 0;
+
+        start = 0;
+        for (i = 0; i + 1 < nruns; i += 2) {
+            ListSortMerge(info, a + start, runs[i] - start, runs[i + 1] - start, tmp);
+            start = runs[i + 1];
+            runs[n++] = start;
+        }
+        if (i < nruns) {
+            runs[n++] = runs[i];
+        }
+        nruns = n;
     }
 
-    return JimSign(lhs - rhs) * sort_info->order;
+    Jim_Free(tmp);
+    Jim_Free(runs);
 }
 
-static int ListSortCommand(Jim_Obj **lhsObj, Jim_Obj **rhsObj)
+/* Returns an unsigned integer which orders the same way as the -integer or -real key */
+static unsigned jim_wide ListSortRadixKey(struct lsort_info *info, const struct lsort_elem *elem)
 {
-    Jim_Obj *compare_script;
-    int rc;
+    const unsigned jim_wide signBit = (unsigned jim_wide)1 << (sizeof(jim_wide) * 8 - 1);
+    unsigned jim_wide key;
 
-    jim_wide ret = 0;
+    if (info->type == JIM_LSORT_INTEGER) {
+        key = (unsigned jim_wide)elem->wideValue ^ signBit;
+    }
+    else {
+        /* -0.0 compares equal to 0.0, so must have the same key */
+        double d = elem->doubleValue == 0 ? 0.0 : elem->doubleValue;
 
-    /* This must be a valid list */
-    compare_script = Jim_DuplicateObj(sort_info->interp, sort_info->command);
-    Jim_ListAppendElement(sort_info->interp, compare_script, *lhsObj);
-    Jim_ListAppendElement(sort_info->interp, compare_script, *rhsObj);
+        memcpy(&key, &d, sizeof(key));
+        key = (key & signBit) ? ~key : key ^ signBit;
+    }
+    return info->order < 0 ? ~key : key;
+}
 
-    rc = Jim_EvalObj(sort_info->interp, compare_script);
+/**
+ * Sorts -integer or -real elements with a least significant digit radix sort,
+ * a byte at a time, skipping any byte which is the same for every key.
+ * Like ListSortMergeSort(), this is stable.
+ */
+static void ListSortRadix(struct lsort_info *info, struct lsort_elem *a, int len)
+{
+    struct lsort_radix {
+        unsigned jim_wide key;
+        int index;
+    } *src, *dst;
+    struct lsort_elem *sorted;
+    int counts[sizeof(jim_wide)][256];
+    unsigned b;
+    int i;
 
-    if (rc != JIM_OK || Jim_GetWide(sort_info->interp, Jim_GetResult(sort_info->interp), &ret) != JIM_OK) {
-        longjmp(sort_info->jmpbuf, rc);
+    src = Jim_Alloc(len * sizeof(*src));
+    dst = Jim_Alloc(len * sizeof(*dst));
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < len; i++) {
+        src[i].key = ListSortRadixKey(info, &a[i]);
+        src[i].index = i;
+        for (b = 0; b < sizeof(jim_wide); b++) {
+            counts[b][(src[i].key >> (b * 8)) & 0xff]++;
+        }
     }
 
-    return JimSign(ret) * sort_info->order;
+    for (b = 0; b < sizeof(jim_wide); b++) {
+        int *count = counts[b];
+        int shift = b * 8;
+        int total = 0;
+        struct lsort_radix *t;
+
+        if (count[(src[0].key >> shift) & 0xff] == len) {
+            continue;
+        }
+        for (i = 0; i < 256; i++) {
+            int c = count[i];
+
+            count[i] = total;
+            total += c;
+        }
+        for (i = 0; i < len; i++) {
+            dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+        }
+        t = src;
+        src = dst;
+        dst = t;
+    }
+
+    sorted = Jim_Alloc(len * sizeof(*sorted));
+    for (i = 0; i < len; i++) {
+        sorted[i] = a[src[i].index];
+    }
+    memcpy(a, sorted, len * sizeof(*a));
+    Jim_Free(sorted);
+    Jim_Free(src);
+    Jim_Free(dst);
+}
+
+/**
+ * For -unique, keeps only the last of each set of elements with equal keys.
+ *
+ * If 'sorted' is set, the elements are sorted and adjacent elements are compared.
+ * Otherwise the keys (which must not be -nocase or -command) are hashed, so that duplicates
+ * can be removed before sorting, leaving less to sort.
+ *
+ * The remaining elements keep their order and are moved to the front, with the removed
+ * elements after them. Returns the number remaining.
+ */
+static int ListSortRemoveDuplicates(struct lsort_info *info, struct lsort_elem *a, int len, int sorted)
+{
+    unsigned char *removed = Jim_Alloc(len);
+    struct lsort_elem *tmp;
+    int i, n;
+
+    if (len) {
+        memset(removed, 0, len);
+    }
+    if (sorted) {
+        for (i = 0; i + 1 < len; i++) {
+            removed[i] = ListSortCompare(info, &a[i], &a[i + 1]) == 0;
+        }
+    }
+    else {
+        unsigned mask = 1;
+        unsigned seed = info->interp->hashSeed;
+        int *slots;
+
+        while (mask < (unsigned)len * 2) {
+            mask <<= 1;
+        }
+        slots = Jim_Alloc(mask * sizeof(*slots));
+        memset(slots, -1, mask * sizeof(*slots));
+        mask--;
+        for (i = 0; i < len; i++) {
+            unsigned h;
+
+            if (info->type == JIM_LSORT_INTEGER) {
+                h = JimHashBytes((const unsigned char *)&a[i].wideValue, sizeof(a[i].wideValue), seed);
+            }
+            else if (info->type == JIM_LSORT_REAL) {
+                double d = a[i].doubleValue == 0 ? 0.0 : a[i].doubleValue;
+
+                h = JimHashBytes((const unsigned char *)&d, sizeof(d), seed);
+            }
+            else {
+                int keyLen;
+                const char *key = Jim_GetString(a[i].keyObj, &keyLen);
+
+                h = JimHashBytes((const unsigned char *)key, keyLen, seed);
+            }
+            for (h &= mask; slots[h] >= 0; h = (h + 1) & mask) {
+                if (ListSortCompare(info, &a[slots[h]], &a[i]) == 0) {
+                    removed[slots[h]] = 1;
+                    break;
+                }
+            }
+            slots[h] = i;
+        }
+        Jim_Free(slots);
+    }
+
+    if (info->rc != JIM_OK) {
+        Jim_Free(removed);
+        return len;
+    }
+
+    tmp = Jim_Alloc(len * sizeof(*tmp));
+    n = 0;
+    for (i = 0; i < len; i++) {
+        if (!removed[i]) {
+            a[n++] = a[i];
+        }
+        else {
+            tmp[i - n] = a[i];
+        }
+    }
+    if (len > n) {
+        memcpy(a + n, tmp, (len - n) * sizeof(*a));
+    }
+    Jim_Free(tmp);
+    Jim_Free(removed);
+    return n;
 }
 
 /* Sort a list *in place*. MUST be called with non-shared objects. */
 static int ListSortElements(Jim_Interp *interp, Jim_Obj *listObjPtr, struct lsort_info *info)
 {
-    struct lsort_info *prev_info;
-
-    typedef int (qsort_comparator) (const void *, const void *);
-    int (*fn) (Jim_Obj **, Jim_Obj **);
+    struct lsort_elem *elems;
     Jim_Obj **vector;
     int len;
-    int rc;
+    int i;
+    int n;
+    int kept;
+    /* Can duplicates be found by hashing the keys? */
+    int hashUnique = info->unique && info->type != JIM_LSORT_NOCASE && info->type != JIM_LSORT_COMMAND;
 
     JimPanic((Jim_IsShared(listObjPtr), "Jim_ListSortElements called with shared object"));
     SetListFromAny(interp, listObjPtr);
-
-    /* Allow lsort to be called reentrantly */
-    prev_info = sort_info;
-    sort_info = info;
+    /* Own the elements, since -unique may release some of them */
+    JimListUnshare(interp, listObjPtr, 0);
 
     vector = listObjPtr->internalRep.listValue.ele;
     len = listObjPtr->internalRep.listValue.len;
-    switch (info->type) {
-        case JIM_LSORT_ASCII:
-            fn = ListSortString;
-            break;
-        case JIM_LSORT_NOCASE:
-            fn = ListSortStringNoCase;
-            break;
-        case JIM_LSORT_INTEGER:
-            fn = ListSortInteger;
+    info->rc = JIM_OK;
+    info->cmdv = NULL;
+
+    /* Decorate each element with its key */
+    elems = Jim_Alloc(len * sizeof(*elems));
+    for (n = 0; n < len; n++) {
+        Jim_Obj *keyObj = vector[n];
+
+        if (info->indexed) {
+            if (Jim_ListIndex(interp, vector[n], info->index, &keyObj, JIM_ERRMSG) != JIM_OK) {
+                info->rc = JIM_ERR;
+                break;
+            }
+            /* A -command script could shimmer the element, so hold on to the key */
+            Jim_IncrRefCount(keyObj);
+        }
+        elems[n].objPtr = vector[n];
+        elems[n].keyObj = keyObj;
+        if ((info->type == JIM_LSORT_INTEGER && Jim_GetWide(interp, keyObj, &elems[n].wideValue) != JIM_OK) ||
+            (info->type == JIM_LSORT_REAL && Jim_GetDouble(interp, keyObj, &elems[n].doubleValue) != JIM_OK)) {
+            info->rc = JIM_ERR;
+            n++;
             break;
-        case JIM_LSORT_COMMAND:
-            fn = ListSortCommand;
+        }
+        /* NaN is unordered, so would break both the comparisons and the radix keys */
+        if (info->type == JIM_LSORT_REAL && elems[n].doubleValue != elems[n].doubleValue) {
+            Jim_SetResultString(interp, "floating point value is Not a Number", -1);
+            info->rc = JIM_ERR;
+            n++;
             break;
-        default:
-            fn = NULL;          /* avoid warning */
-            JimPanic((1, "ListSort called with invalid sort type"));
+        }
     }
+    kept = n;
+
+    if (info->rc == JIM_OK) {
+        if (info->type == JIM_LSORT_COMMAND) {
+            /* Resolve the command prefix to words once, rather than building a script per comparison */
+            int cmdc = Jim_ListLength(interp, info->command);
+
+            info->cmdv = Jim_Alloc((cmdc + 2) * sizeof(*info->cmdv));
+            for (i = 0; i < cmdc; i++) {
+                info->cmdv[i] = Jim_ListGetIndex(interp, info->command, i);
+                Jim_IncrRefCount(info->cmdv[i]);
+            }
+            info->cmdc = cmdc + 2;
+        }
 
-    if (info->indexed) {
-        /* Need to interpose a "list index" function */
-        info->subfn = fn;
-        fn = ListSortIndexHelper;
+        if (hashUnique) {
+            kept = ListSortRemoveDuplicates(info, elems, len, 0);
+        }
+
+        if (kept >= JIM_LSORT_RADIX_MIN && (info->type == JIM_LSORT_INTEGER ||
+                (info->type == JIM_LSORT_REAL && sizeof(double) == sizeof(jim_wide)))) {
+            ListSortRadix(info, elems, kept);
+        }
+        else {
+            ListSortMergeSort(info, elems, kept);
+        }
+
+        if (info->unique && !hashUnique) {
+            kept = ListSortRemoveDuplicates(info, elems, kept, 1);
+        }
+
+        if (info->cmdv) {
+            for (i = 0; i < info->cmdc - 2; i++) {
+                Jim_DecrRefCount(interp, info->cmdv[i]);
+            }
+            Jim_Free(info->cmdv);
+        }
     }
 
-    if ((rc = setjmp(info->jmpbuf)) == 0) {
-        qsort(vector, len, sizeof(Jim_Obj *), (qsort_comparator *) fn);
+    /* Undecorate. Even after an error the elements are a permutation of the original */
+    for (i = 0; i < n; i++) {
+        if (info->rc == JIM_OK) {
+            if (i < kept) {
+                vector[i] = elems[i].objPtr;
+            }
+            else {
+                /* Removed by -unique */
+                Jim_DecrRefCount(interp, elems[i].objPtr);
+            }
+        }
+        if (info->indexed) {
+            Jim_DecrRefCount(interp, elems[i].keyObj);
+        }
+    }
+    if (info->rc == JIM_OK) {
+        listObjPtr->internalRep.listValue.len = kept;
     }
+    Jim_Free(elems);
     Jim_InvalidateStringRep(listObjPtr);
-    sort_info = prev_info;
 
-    return rc;
+    return info->rc;
 }
 
 /* This is the low-level function to insert elements into a list.
@@ -6335,12 +9059,57 @@ static int ListSortElements(Jim_Interp *interp, Jim_Obj *listObjPtr, struct lsor
  *
  * An insertion point (idx) of -1 means end-of-list.
  */
-static void ListInsertElements(Jim_Obj *listPtr, int idx, int elemc, Jim_Obj *const *elemVec)
+static void ListInsertElements(Jim_Interp *interp, Jim_Obj *listPtr, int idx, int elemc, Jim_Obj *const *elemVec)
 {
     int currentLen = listPtr->internalRep.listValue.len;
     int requiredLen = currentLen + elemc;
     int i;
     Jim_Obj **point;
+    Jim_ListStore *store = listPtr->internalRep.listValue.store;
+
+    if (store) {
+        int end = listPtr->internalRep.listValue.ele - store->ele + currentLen;
+
+        if (store->refCount == 1) {
+            JimListStoreTrim(interp, listPtr);
+        }
+        if ((idx < 0 || idx == currentLen) && end == store->len &&
+                (store->refCount == 1 || end + elemc <= store->maxLen)) {
+            /* Append to the store, beyond the end of any other list sharing it */
+            if (end + elemc > store->maxLen) {
+                Jim_Obj **ele = store->ele;
+
+                /* Not realloc since elemVec may point into the store */
+                store->maxLen = (end + elemc) * 2;
+                store->ele = Jim_Alloc(sizeof(Jim_Obj *) * store->maxLen);
+                memcpy(store->ele + store->start, ele + store->start, sizeof(Jim_Obj *) * (end - store->start));
+                listPtr->internalRep.listValue.ele = store->ele + end - currentLen;
+                for (i = 0; i < elemc; ++i) {
+                    store->ele[end + i] = elemVec[i];
+                    Jim_IncrRefCount(elemVec[i]);
+                }
+                Jim_Free(ele);
+            }
+            else {
+                for (i = 0; i < elemc; ++i) {
+                    store->ele[end + i] = elemVec[i];
+                    Jim_IncrRefCount(elemVec[i]);
+                }
+            }
+            store->len += elemc;
+            listPtr->internalRep.listValue.len += elemc;
+            if (store->hashIndex) {
+                if ((unsigned)store->len - 1 <= store->hashIndex->mask) {
+                    JimListHashIndexAdd(store, end);
+                }
+                else {
+                    JimListStoreDiscardIndex(store);
+                }
+            }
+            return;
+        }
+        JimListUnshare(interp, listPtr, requiredLen * 2);
+    }
 
     if (requiredLen > listPtr->internalRep.listValue.maxLen) {
         listPtr->internalRep.listValue.maxLen = requiredLen * 2;
@@ -6362,18 +9131,18 @@ static void ListInsertElements(Jim_Obj *listPtr, int idx, int elemc, Jim_Obj *co
 
 /* Convenience call to ListInsertElements() to append a single element.
  */
-static void ListAppendElement(Jim_Obj *listPtr, Jim_Obj *objPtr)
+static void ListAppendElement(Jim_Interp *interp, Jim_Obj *listPtr, Jim_Obj *objPtr)
 {
-    ListInsertElements(listPtr, -1, 1, &objPtr);
+    ListInsertElements(interp, listPtr, -1, 1, &objPtr);
 }
 
 /* Appends every element of appendListPtr into listPtr.
  * Both have to be of the list type.
  * Convenience call to ListInsertElements()
  */
-static void ListAppendList(Jim_Obj *listPtr, Jim_Obj *appendListPtr)
+static void ListAppendList(Jim_Interp *interp, Jim_Obj *listPtr, Jim_Obj *appendListPtr)
 {
-    ListInsertElements(listPtr, -1,
+    ListInsertElements(interp, listPtr, -1,
         appendListPtr->internalRep.listValue.len, appendListPtr->internalRep.listValue.ele);
 }
 
@@ -6382,7 +9151,7 @@ void Jim_ListAppendElement(Jim_Interp *interp, Jim_Obj *listPtr, Jim_Obj *objPtr
     JimPanic((Jim_IsShared(listPtr), "Jim_ListAppendElement called with shared object"));
     SetListFromAny(interp, listPtr);
     Jim_InvalidateStringRep(listPtr);
-    ListAppendElement(listPtr, objPtr);
+    ListAppendElement(interp, listPtr, objPtr);
 }
 
 void Jim_ListAppendList(Jim_Interp *interp, Jim_Obj *listPtr, Jim_Obj *appendListPtr)
@@ -6391,7 +9160,7 @@ void Jim_ListAppendList(Jim_Interp *interp, Jim_Obj *listPtr, Jim_Obj *appendLis
     SetListFromAny(interp, listPtr);
     SetListFromAny(interp, appendListPtr);
     Jim_InvalidateStringRep(listPtr);
-    ListAppendList(listPtr, appendListPtr);
+    ListAppendList(interp, listPtr, appendListPtr);
 }
 
 int Jim_ListLength(Jim_Interp *interp, Jim_Obj *objPtr)
@@ -6410,7 +9179,7 @@ void Jim_ListInsertElements(Jim_Interp *interp, Jim_Obj *listPtr, int idx,
     else if (idx < 0)
         idx = 0;
     Jim_InvalidateStringRep(listPtr);
-    ListInsertElements(listPtr, idx, objc, objVec);
+    ListInsertElements(interp, listPtr, idx, objc, objVec);
 }
 
 Jim_Obj *Jim_ListGetIndex(Jim_Interp *interp, Jim_Obj *listPtr, int idx)
@@ -6437,6 +9206,64 @@ int Jim_ListIndex(Jim_Interp *interp, Jim_Obj *listPtr, int idx, Jim_Obj **objPt
     return JIM_OK;
 }
 
+/**
+ * Returns the index of the first element of the list from 'start' onwards
+ * with the same string value as valObj, or -1 if there is none.
+ *
+ * A long list is hash indexed on its second search, so that repeated
+ * membership tests don't need to compare every element.
+ */
+static int JimListFindExact(Jim_Interp *interp, Jim_Obj *listPtr, Jim_Obj *valObj, int start)
+{
+    int len = Jim_ListLength(interp, listPtr);
+    Jim_Obj **ele = listPtr->internalRep.listValue.ele;
+    int i;
+
+    if (len >= JIM_LIST_HASH_MIN) {
+        Jim_ListStore *store = JimListStore(listPtr);
+
+        if (store->hashIndex || ++store->searches > 1) {
+            int first = ele - store->ele;
+            int end = first + len;
+
+            if (!store->hashIndex) {
+                JimListStoreBuildIndex(interp, store);
+            }
+            i = store->hashIndex->buckets[JimObjectHTSeededHashFunction(valObj, store->hashIndex->seed) &
+                store->hashIndex->mask];
+            for (; i >= 0 && i < end; i = store->hashIndex->next[i]) {
+                if (i >= first + start && Jim_StringEqObj(store->ele[i], valObj)) {
+                    return i - first;
+                }
+            }
+            return -1;
+        }
+    }
+    for (i = start; i < len; i++) {
+        if (Jim_StringEqObj(ele[i], valObj)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Prepares the list for its elements to be modified in place.
+ * Elements of a shared store are also seen by other lists, so the list gets
+ * its own copy of them, and an unshared store loses its hash index */
+static void JimListModify(Jim_Interp *interp, Jim_Obj *listPtr)
+{
+    Jim_ListStore *store = listPtr->internalRep.listValue.store;
+
+    if (store) {
+        if (store->refCount > 1) {
+            JimListUnshare(interp, listPtr, 0);
+        }
+        else {
+            JimListStoreDiscardIndex(store);
+        }
+    }
+}
+
 static int ListSetIndex(Jim_Interp *interp, Jim_Obj *listPtr, int idx,
     Jim_Obj *newObjPtr, int flags)
 {
@@ -6450,6 +9277,7 @@ static int ListSetIndex(Jim_Interp *interp, Jim_Obj *listPtr, int idx,
     }
     if (idx < 0)
         idx = listPtr->internalRep.listValue.len + idx;
+    JimListModify(interp, listPtr);
     Jim_DecrRefCount(interp, listPtr->internalRep.listValue.ele[idx]);
     listPtr->internalRep.listValue.ele[idx] = newObjPtr;
     Jim_IncrRefCount(newObjPtr);
@@ -6477,6 +9305,10 @@ int Jim_SetListIndex(Jim_Interp *interp, Jim_Obj *varNamePtr,
         if (Jim_ListIndex(interp, listObjPtr, idx, &objPtr, JIM_ERRMSG) != JIM_OK) {
             goto err;
         }
+        /* The element is about to be modified, so it must not be seen by other
+         * lists through a shared store (and then it is shared, as both
+         * the store and this list hold it) */
+        JimListModify(interp, listObjPtr);
         if (Jim_IsShared(objPtr)) {
             objPtr = Jim_DuplicateObj(interp, objPtr);
             ListSetIndex(interp, listObjPtr, idx, objPtr, JIM_NONE);
@@ -6521,6 +9353,7 @@ Jim_Obj *Jim_ListJoin(Jim_Interp *interp, Jim_Obj *listObjPtr, const char *joinS
 Jim_Obj *Jim_ConcatObj(Jim_Interp *interp, int objc, Jim_Obj *const *objv)
 {
     int i;
+    Jim_Obj *objPtr;
 
     /* If all the objects in objv are lists,
      * it's possible to return a list as result, that's the
@@ -6530,10 +9363,10 @@ Jim_Obj *Jim_ConcatObj(Jim_Interp *interp, int objc, Jim_Obj *const *objv)
             break;
     }
     if (i == objc) {
-        Jim_Obj *objPtr = Jim_NewListObj(interp, NULL, 0);
+        objPtr = Jim_NewListObj(interp, NULL, 0);
 
         for (i = 0; i < objc; i++)
-            ListAppendList(objPtr, objv[i]);
+            ListAppendList(interp, objPtr, objv[i]);
         return objPtr;
     }
     else {
@@ -6581,7 +9414,11 @@ Jim_Obj *Jim_ConcatObj(Jim_Interp *interp, int objc, Jim_Obj *const *objv)
             }
         }
         *p = '\0';
-        return Jim_NewStringObjNoAlloc(interp, bytes, len);
+        objPtr = Jim_NewStringObjNoAlloc(interp, bytes, len);
+#ifdef JIM_REFERENCES
+        JimInheritGcCandidates(interp, objPtr, objv, objc);
+#endif
+        return objPtr;
     }
 }
 
@@ -6604,7 +9441,7 @@ Jim_Obj *Jim_ListRange(Jim_Interp *interp, Jim_Obj *listObjPtr, Jim_Obj *firstOb
     if (first == 0 && last == len) {
         return listObjPtr;
     }
-    return Jim_NewListObj(interp, listObjPtr->internalRep.listValue.ele + first, rangeLen);
+    return JimListSlice(interp, listObjPtr, first, rangeLen);
 }
 
 /* -----------------------------------------------------------------------------
@@ -6615,36 +9452,64 @@ static void DupDictInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dup
 static void UpdateStringOfDict(struct Jim_Obj *objPtr);
 static int SetDictFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr);
 
-/* Dict HashTable Type.
+/* Dict internal representation.
  *
- * Keys and Values are Jim objects. */
-
-static unsigned int JimObjectHTHashFunction(const void *key)
+ * The key/value pairs are stored in insertion order in a dense array,
+ * along with a small open addressed hash table of indexes into this array
+ * (the same scheme as the hash table above).
+ * Iterating over the dict or generating its string representation is simply
+ * a walk over the array.
+ *
+ * Removing a key leaves a hole (a NULL key) in the array.
+ * Holes are squeezed out once there are too many of them, or before the array
+ * is handed out by JimDictPairs(). */
+typedef struct JimDictHashEntry {
+    int offset;                 /* 1 + index of the pair in table, 0 if empty */
+    unsigned int hash;
+} JimDictHashEntry;
+
+typedef struct Jim_Dict {
+    JimDictHashEntry *ht;       /* Hash index of the pairs */
+    unsigned int size;          /* Size of the hash index, a power of 2 */
+    unsigned int sizemask;
+    unsigned int uniq;          /* Seed for the hash of every key, the interpreter's hashSeed */
+    unsigned int deleted;       /* Number of deleted entries in the hash index */
+    Jim_Obj **table;            /* Key/value pairs in insertion order */
+    int len;                    /* Number of elements of table in use, including holes */
+    int maxLen;                 /* Allocated number of elements of table */
+    int count;                  /* Number of pairs in the dict */
+} Jim_Dict;
+
+#define JIM_DICT_DELETED -1     /* offset of a deleted entry in the hash index */
+#define JIM_DICT_INITIAL_SIZE 8 /* Minimum size of the hash index */
+
+/* Objects are always hashed with their interpreter's hashSeed, so the
+ * cached hash of an interned object can be used as is. */
+static unsigned int JimObjectHTSeededHashFunction(const void *key, unsigned int seed)
 {
     int len;
-    const char *str = Jim_GetString((Jim_Obj *)key, &len);
-    return Jim_GenHashFunction((const unsigned char *)str, len);
+    const char *str;
+
+    if (((Jim_Obj *)key)->hash) {
+        /* Interned, so the hash is already known */
+        return ((Jim_Obj *)key)->hash;
+    }
+    str = Jim_GetString((Jim_Obj *)key, &len);
+    return JimHashBytes((const unsigned char *)str, len, seed);
 }
 
 static int JimObjectHTKeyCompare(void *privdata, const void *key1, const void *key2)
 {
-    return Jim_StringEqObj((Jim_Obj *)key1, (Jim_Obj *)key2);
-}
+    const Jim_Obj *aObjPtr = key1;
+    const Jim_Obj *bObjPtr = key2;
 
-static void JimObjectHTKeyValDestructor(void *interp, void *val)
-{
-    Jim_DecrRefCount(interp, (Jim_Obj *)val);
+    if (aObjPtr->hash && bObjPtr->hash) {
+        /* Both interned, so equal only if the same object */
+        return aObjPtr == bObjPtr;
+    }
+    return Jim_StringEqObj((Jim_Obj *)key1, (Jim_Obj *)key2);
 }
 
-static const Jim_HashTableType JimDictHashTableType = {
-    JimObjectHTHashFunction,    /* hash function */
-    NULL,                       /* key dup */
-    NULL,                       /* val dup */
-    JimObjectHTKeyCompare,      /* key compare */
-    JimObjectHTKeyValDestructor,    /* key destructor */
-    JimObjectHTKeyValDestructor /* val destructor */
-};
-
 /* Note that while the elements of the dict may contain references,
  * the list object itself can't. This basically means that the
  * dict object string representation as a whole can't contain references
@@ -6657,74 +9522,241 @@ static const Jim_ObjType dictObjType = {
     JIM_TYPE_NONE,
 };
 
-void FreeDictInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
+static unsigned int JimDictHashKey(Jim_Dict *dict, Jim_Obj *keyObjPtr)
 {
-    JIM_NOTUSED(interp);
+    return JimObjectHTSeededHashFunction(keyObjPtr, dict->uniq);
+}
 
-    Jim_FreeHashTable(objPtr->internalRep.ptr);
-    Jim_Free(objPtr->internalRep.ptr);
+/* Returns the size of a hash index that can hold 'pairs' pairs
+ * while remaining no more than 3/4 full */
+static unsigned int JimDictIndexSize(int pairs)
+{
+    unsigned int size = JIM_DICT_INITIAL_SIZE;
+
+    while (pairs * 4 >= size * 3) {
+        size *= 2;
+    }
+    return size;
 }
 
-void DupDictInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
+/* Creates an empty dict with room for 'pairs' key/value pairs */
+static Jim_Dict *JimNewDict(Jim_Interp *interp, int pairs)
 {
-    Jim_HashTable *ht, *dupHt;
-    Jim_HashTableIterator *htiter;
-    Jim_HashEntry *he;
+    Jim_Dict *dict = Jim_Alloc(sizeof(*dict));
+    unsigned int size = JimDictIndexSize(pairs);
 
-    /* Create a new hash table */
-    ht = srcPtr->internalRep.ptr;
-    dupHt = Jim_Alloc(sizeof(*dupHt));
-    Jim_InitHashTable(dupHt, &JimDictHashTableType, interp);
-    if (ht->size != 0)
-        Jim_ExpandHashTable(dupHt, ht->size);
-    /* Copy every element from the source to the dup hash table */
-    htiter = Jim_GetHashTableIterator(ht);
-    while ((he = Jim_NextHashEntry(htiter)) != NULL) {
-        const Jim_Obj *keyObjPtr = he->key;
-        Jim_Obj *valObjPtr = he->u.val;
+    dict->ht = Jim_Alloc(size * sizeof(*dict->ht));
+    memset(dict->ht, 0, size * sizeof(*dict->ht));
+    dict->size = size;
+    dict->sizemask = size - 1;
+    dict->uniq = interp->hashSeed;
+    dict->deleted = 0;
+    dict->maxLen = pairs * 2;
+    dict->table = pairs ? Jim_Alloc(dict->maxLen * sizeof(*dict->table)) : NULL;
+    dict->len = 0;
+    dict->count = 0;
+    return dict;
+}
+
+/* Returns the hash index entry for the given key, or NULL if not found */
+static JimDictHashEntry *JimDictFindEntry(Jim_Dict *dict, Jim_Obj *keyObjPtr, unsigned int h)
+{
+    unsigned int i;
+
+    for (i = h & dict->sizemask; dict->ht[i].offset; i = (i + 1) & dict->sizemask) {
+        JimDictHashEntry *he = &dict->ht[i];
+
+        if (he->hash == h && he->offset != JIM_DICT_DELETED) {
+            Jim_Obj *objPtr = dict->table[(he->offset - 1) * 2];
+            if (JimObjectHTKeyCompare(NULL, keyObjPtr, objPtr)) {
+                return he;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Adds the pair at 'offset' (1 + index into the table) to the hash index.
+ * The key must not already be present. */
+static void JimDictIndexPair(Jim_Dict *dict, int offset, unsigned int h)
+{
+    unsigned int i;
 
-        Jim_IncrRefCount((Jim_Obj *)keyObjPtr); /* ATTENTION: const cast */
-        Jim_IncrRefCount(valObjPtr);
-        Jim_AddHashEntry(dupHt, keyObjPtr, valObjPtr);
+    for (i = h & dict->sizemask; dict->ht[i].offset; i = (i + 1) & dict->sizemask) {
+        if (dict->ht[i].offset == JIM_DICT_DELETED) {
+            dict->deleted--;
+            break;
+        }
     }
-    Jim_FreeHashTableIterator(htiter);
+    dict->ht[i].offset = offset;
+    dict->ht[i].hash = h;
+}
 
-    dupPtr->internalRep.ptr = dupHt;
-    dupPtr->typePtr = &dictObjType;
+/* Squeezes any holes out of the table and rebuilds the hash index
+ * with the given size */
+static void JimDictRebuild(Jim_Dict *dict, unsigned int size)
+{
+    int i, j;
+
+    if (size != dict->size) {
+        Jim_Free(dict->ht);
+        dict->ht = Jim_Alloc(size * sizeof(*dict->ht));
+        dict->size = size;
+        dict->sizemask = size - 1;
+    }
+    memset(dict->ht, 0, size * sizeof(*dict->ht));
+    dict->deleted = 0;
+
+    for (i = j = 0; i < dict->len; i += 2) {
+        if (dict->table[i]) {
+            dict->table[j] = dict->table[i];
+            dict->table[j + 1] = dict->table[i + 1];
+            j += 2;
+            JimDictIndexPair(dict, j / 2, JimDictHashKey(dict, dict->table[j - 2]));
+        }
+    }
+    dict->len = j;
 }
 
-static Jim_Obj **JimDictPairs(Jim_Obj *dictPtr, int *len)
+/* Sets the value for the given key, adding the key at the end if it
+ * doesn't exist. The dict takes a reference to the key (if added) and value.
+ * Returns 1 if the key already existed, or 0 if not. */
+static int JimDictAdd(Jim_Interp *interp, Jim_Dict *dict, Jim_Obj *keyObjPtr, Jim_Obj *valObjPtr)
+{
+    unsigned int h = JimDictHashKey(dict, keyObjPtr);
+    JimDictHashEntry *he = JimDictFindEntry(dict, keyObjPtr, h);
+
+    Jim_IncrRefCount(valObjPtr);
+    if (he) {
+        Jim_Obj **pair = &dict->table[(he->offset - 1) * 2];
+
+        Jim_DecrRefCount(interp, pair[1]);
+        pair[1] = valObjPtr;
+        return 1;
+    }
+
+    if ((dict->count + dict->deleted + 1) * 4 > dict->size * 3) {
+        /* The hash index is too full. Rebuild it, also squeezing out any holes */
+        JimDictRebuild(dict, JimDictIndexSize((dict->count + 1) * 2));
+    }
+    if (dict->len == dict->maxLen) {
+        if (dict->len && (dict->len - dict->count * 2) * 4 >= dict->len) {
+            /* At least 1/4 of the table is holes, so reuse them */
+            JimDictRebuild(dict, dict->size);
+        }
+        else {
+            dict->maxLen = dict->maxLen ? dict->maxLen * 2 : 4;
+            dict->table = Jim_Realloc(dict->table, dict->maxLen * sizeof(*dict->table));
+        }
+    }
+    Jim_IncrRefCount(keyObjPtr);
+    dict->table[dict->len++] = keyObjPtr;
+    dict->table[dict->len++] = valObjPtr;
+    dict->count++;
+    JimDictIndexPair(dict, dict->len / 2, h);
+    return 0;
+}
+
+/* Removes the given key from the dict.
+ * Returns JIM_OK if the key was removed or JIM_ERR if it didn't exist */
+static int JimDictDelete(Jim_Interp *interp, Jim_Dict *dict, Jim_Obj *keyObjPtr)
+{
+    JimDictHashEntry *he = JimDictFindEntry(dict, keyObjPtr, JimDictHashKey(dict, keyObjPtr));
+    Jim_Obj **pair;
+
+    if (he == NULL) {
+        return JIM_ERR;
+    }
+    pair = &dict->table[(he->offset - 1) * 2];
+    Jim_DecrRefCount(interp, pair[0]);
+    Jim_DecrRefCount(interp, pair[1]);
+    pair[0] = pair[1] = NULL;
+    he->offset = JIM_DICT_DELETED;
+    dict->deleted++;
+    dict->count--;
+
+    /* Trailing holes can simply be dropped */
+    while (dict->len && dict->table[dict->len - 2] == NULL) {
+        dict->len -= 2;
+    }
+    /* Once more than half of the table is holes, squeeze them out */
+    if (dict->count * 4 < dict->len) {
+        JimDictRebuild(dict, JimDictIndexSize(dict->count * 2));
+    }
+    return JIM_OK;
+}
+
+static void JimFreeDict(Jim_Interp *interp, Jim_Dict *dict)
 {
-    Jim_HashTable *ht;
-    Jim_HashTableIterator *htiter;
-    Jim_HashEntry *he;
-    Jim_Obj **objv;
     int i;
 
-    ht = dictPtr->internalRep.ptr;
+    for (i = 0; i < dict->len; i++) {
+        if (dict->table[i]) {
+            Jim_DecrRefCount(interp, dict->table[i]);
+        }
+    }
+    Jim_Free(dict->table);
+    Jim_Free(dict->ht);
+    Jim_Free(dict);
+}
 
-    /* Turn the hash table into a flat vector of Jim_Objects. */
-    objv = Jim_Alloc((ht->used * 2) * sizeof(Jim_Obj *));
-    htiter = Jim_GetHashTableIterator(ht);
-    i = 0;
-    while ((he = Jim_NextHashEntry(htiter)) != NULL) {
-        objv[i++] = (Jim_Obj *)he->key;
-        objv[i++] = he->u.val;
+void FreeDictInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+#ifdef JIM_REFERENCES
+    if (objPtr->bytes) {
+        /* The string rep may hold references which were only in the keys and values */
+        Jim_Dict *dict = objPtr->internalRep.ptr;
+
+        JimInheritGcCandidates(interp, objPtr, dict->table, dict->len);
     }
-    *len = i;
-    Jim_FreeHashTableIterator(htiter);
-    return objv;
+#endif
+    JimFreeDict(interp, objPtr->internalRep.ptr);
+}
+
+/* Returns the key/value pairs of the dict in order.
+ * Note that this is the internal array of the dict, not a copy. */
+static Jim_Obj **JimDictPairs(Jim_Obj *dictPtr, int *len)
+{
+    Jim_Dict *dict = dictPtr->internalRep.ptr;
+
+    if (dict->count * 2 != dict->len) {
+        JimDictRebuild(dict, dict->size);
+    }
+    *len = dict->len;
+    return dict->table;
+}
+
+void DupDictInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
+{
+    Jim_Dict *dict, *dupDict;
+    Jim_Obj **table;
+    int i, len;
+
+    /* Without holes, the hash index is also valid for the copy */
+    table = JimDictPairs(srcPtr, &len);
+    dict = srcPtr->internalRep.ptr;
+
+    dupDict = Jim_Alloc(sizeof(*dupDict));
+    *dupDict = *dict;
+    dupDict->ht = Jim_Alloc(dict->size * sizeof(*dict->ht));
+    memcpy(dupDict->ht, dict->ht, dict->size * sizeof(*dict->ht));
+    dupDict->maxLen = len;
+    dupDict->table = len ? Jim_Alloc(len * sizeof(*table)) : NULL;
+    for (i = 0; i < len; i++) {
+        dupDict->table[i] = table[i];
+        Jim_IncrRefCount(table[i]);
+    }
+
+    dupPtr->internalRep.ptr = dupDict;
+    dupPtr->typePtr = &dictObjType;
 }
 
 static void UpdateStringOfDict(struct Jim_Obj *objPtr)
 {
-    /* Turn the hash table into a flat vector of Jim_Objects. */
     int len;
     Jim_Obj **objv = JimDictPairs(objPtr, &len);
 
     JimMakeListStringRep(objPtr, objv, len);
-
-    Jim_Free(objv);
 }
 
 static int SetDictFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
@@ -6748,12 +9780,9 @@ static int SetDictFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
     }
     else {
         /* Now it is easy to convert to a dict from a list, and it can't fail */
-        Jim_HashTable *ht;
+        Jim_Dict *dict = JimNewDict(interp, listlen / 2);
         int i;
 
-        ht = Jim_Alloc(sizeof(*ht));
-        Jim_InitHashTable(ht, &JimDictHashTableType, interp);
-
         for (i = 0; i < listlen; i += 2) {
             Jim_Obj *keyObjPtr;
             Jim_Obj *valObjPtr;
@@ -6761,23 +9790,13 @@ static int SetDictFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
             Jim_ListIndex(interp, objPtr, i, &keyObjPtr, JIM_NONE);
             Jim_ListIndex(interp, objPtr, i + 1, &valObjPtr, JIM_NONE);
 
-            Jim_IncrRefCount(keyObjPtr);
-            Jim_IncrRefCount(valObjPtr);
-
-            if (Jim_AddHashEntry(ht, keyObjPtr, valObjPtr) != JIM_OK) {
-                Jim_HashEntry *he;
-
-                he = Jim_FindHashEntry(ht, keyObjPtr);
-                Jim_DecrRefCount(interp, keyObjPtr);
-                /* ATTENTION: const cast */
-                Jim_DecrRefCount(interp, (Jim_Obj *)he->u.val);
-                he->u.val = valObjPtr;
-            }
+            /* A repeated key keeps its first position, with the last value */
+            JimDictAdd(interp, dict, keyObjPtr, valObjPtr);
         }
 
         Jim_FreeIntRep(interp, objPtr);
         objPtr->typePtr = &dictObjType;
-        objPtr->internalRep.ptr = ht;
+        objPtr->internalRep.ptr = dict;
 
         return JIM_OK;
     }
@@ -6794,17 +9813,12 @@ static int SetDictFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
 static int DictAddElement(Jim_Interp *interp, Jim_Obj *objPtr,
     Jim_Obj *keyObjPtr, Jim_Obj *valueObjPtr)
 {
-    Jim_HashTable *ht = objPtr->internalRep.ptr;
+    Jim_Dict *dict = objPtr->internalRep.ptr;
 
     if (valueObjPtr == NULL) {  /* unset */
-        return Jim_DeleteHashEntry(ht, keyObjPtr);
-    }
-    Jim_IncrRefCount(keyObjPtr);
-    Jim_IncrRefCount(valueObjPtr);
-    if (Jim_ReplaceHashEntry(ht, keyObjPtr, valueObjPtr)) {
-        /* Value existed, so need to decrement key ref count */
-        Jim_DecrRefCount(interp, keyObjPtr);
+        return JimDictDelete(interp, dict, keyObjPtr);
     }
+    JimDictAdd(interp, dict, keyObjPtr, valueObjPtr);
     return JIM_OK;
 }
 
@@ -6834,8 +9848,7 @@ Jim_Obj *Jim_NewDictObj(Jim_Interp *interp, Jim_Obj *const *elements, int len)
     objPtr = Jim_NewObj(interp);
     objPtr->typePtr = &dictObjType;
     objPtr->bytes = NULL;
-    objPtr->internalRep.ptr = Jim_Alloc(sizeof(Jim_HashTable));
-    Jim_InitHashTable(objPtr->internalRep.ptr, &JimDictHashTableType, interp);
+    objPtr->internalRep.ptr = JimNewDict(interp, len / 2);
     for (i = 0; i < len; i += 2)
         DictAddElement(interp, objPtr, elements[i], elements[i + 1]);
     return objPtr;
@@ -6847,30 +9860,34 @@ Jim_Obj *Jim_NewDictObj(Jim_Interp *interp, Jim_Obj *const *elements, int len)
 int Jim_DictKey(Jim_Interp *interp, Jim_Obj *dictPtr, Jim_Obj *keyPtr,
     Jim_Obj **objPtrPtr, int flags)
 {
-    Jim_HashEntry *he;
-    Jim_HashTable *ht;
+    JimDictHashEntry *he;
+    Jim_Dict *dict;
 
     if (SetDictFromAny(interp, dictPtr) != JIM_OK) {
         return -1;
     }
-    ht = dictPtr->internalRep.ptr;
-    if ((he = Jim_FindHashEntry(ht, keyPtr)) == NULL) {
+    dict = dictPtr->internalRep.ptr;
+    if ((he = JimDictFindEntry(dict, keyPtr, JimDictHashKey(dict, keyPtr))) == NULL) {
         if (flags & JIM_ERRMSG) {
             Jim_SetResultFormatted(interp, "key \"%#s\" not known in dictionary", keyPtr);
         }
         return JIM_ERR;
     }
-    *objPtrPtr = he->u.val;
+    *objPtrPtr = dict->table[(he->offset - 1) * 2 + 1];
     return JIM_OK;
 }
 
 /* Return an allocated array of key/value pairs for the dictionary. Stores the length in *len */
 int Jim_DictPairs(Jim_Interp *interp, Jim_Obj *dictPtr, Jim_Obj ***objPtrPtr, int *len)
 {
+    Jim_Obj **table;
+
     if (SetDictFromAny(interp, dictPtr) != JIM_OK) {
         return JIM_ERR;
     }
-    *objPtrPtr = JimDictPairs(dictPtr, len);
+    table = JimDictPairs(dictPtr, len);
+    *objPtrPtr = Jim_Alloc(*len * sizeof(*table));
+    memcpy(*objPtrPtr, table, *len * sizeof(*table));
 
     return JIM_OK;
 }
@@ -7012,7 +10029,7 @@ void UpdateStringOfIndex(struct Jim_Obj *objPtr)
     else {
         len = sprintf(buf, "end%d", objPtr->internalRep.intValue + 1);
     }
-    objPtr->bytes = Jim_Alloc(len + 1);
+    objPtr->bytes = JimAllocStringRep(objPtr, len);
     memcpy(objPtr->bytes, buf, len + 1);
     objPtr->length = len;
 }
@@ -7154,6 +10171,8 @@ int SetReturnCodeFromAny(Jim_Interp *interp, Jim_Obj *objPtr)
         Jim_SetResultFormatted(interp, "expected return code but got \"%#s\"", objPtr);
         return JIM_ERR;
     }
+    /* The return code type has no string rep of its own */
+    Jim_String(objPtr);
     /* Free the old internal repr and set the new one. */
     Jim_FreeIntRep(interp, objPtr);
     objPtr->typePtr = &returnCodeObjType;
@@ -7294,82 +10313,140 @@ static Jim_Obj *ExprPop(struct JimExprState *e)
     return e->stack[--e->stacklen];
 }
 
-static int JimExprOpNumUnary(Jim_Interp *interp, struct JimExprState *e)
+/* An expression operand or result held without boxing it in a Jim_Obj */
+enum
 {
-    int intresult = 0;
-    int rc = JIM_OK;
-    Jim_Obj *A = ExprPop(e);
-    double dA, dC = 0;
-    jim_wide wA, wC = 0;
+    JIM_EXPRVAL_OBJ,            /* Not yet classified. Only objPtr is valid */
+    JIM_EXPRVAL_INT,
+    JIM_EXPRVAL_DOUBLE
+};
+
+typedef struct JimExprValue
+{
+    int type;                   /* JIM_EXPRVAL_... */
+    union {
+        jim_wide w;
+        double d;
+    } u;
+    Jim_Obj *objPtr;            /* The operand this value came from, or NULL if it was computed */
+} JimExprValue;
+
+/* Classifies v->objPtr as an int or a double in the same way as the numeric operators.
+ * Note that a pure double (one without a string rep) is never treated as an int.
+ *
+ * Returns JIM_ERR (and sets the interp result) if the value is not a number.
+ */
+static int JimExprValueNumber(Jim_Interp *interp, JimExprValue *v)
+{
+    Jim_Obj *objPtr = v->objPtr;
+
+    if (v->type != JIM_EXPRVAL_OBJ) {
+        return JIM_OK;
+    }
+    if ((objPtr->typePtr != &doubleObjType || objPtr->bytes) && JimGetWideNoErr(interp, objPtr, &v->u.w) == JIM_OK) {
+        v->type = JIM_EXPRVAL_INT;
+        return JIM_OK;
+    }
+    if (Jim_GetDouble(interp, objPtr, &v->u.d) != JIM_OK) {
+        return JIM_ERR;
+    }
+    v->type = JIM_EXPRVAL_DOUBLE;
+    return JIM_OK;
+}
 
-    if ((A->typePtr != &doubleObjType || A->bytes) && JimGetWideNoErr(interp, A, &wA) == JIM_OK) {
-        intresult = 1;
+static double JimExprValueDouble(const JimExprValue *v)
+{
+    return v->type == JIM_EXPRVAL_INT ? (double)v->u.w : v->u.d;
+}
 
-        switch (e->opcode) {
+static Jim_Obj *JimExprValueObj(Jim_Interp *interp, const JimExprValue *v)
+{
+    if (v->objPtr) {
+        return v->objPtr;
+    }
+    if (v->type == JIM_EXPRVAL_INT) {
+        return Jim_NewIntObj(interp, v->u.w);
+    }
+    return Jim_NewDoubleObj(interp, v->u.d);
+}
+
+/* A unary numeric operation on a classified value. The result may replace the argument. */
+static void JimExprNumUnaryOp(int opcode, const JimExprValue *A, JimExprValue *C)
+{
+    if (A->type == JIM_EXPRVAL_INT) {
+        jim_wide wA = A->u.w;
+
+        C->type = JIM_EXPRVAL_INT;
+        switch (opcode) {
             case JIM_EXPROP_FUNC_INT:
-                wC = wA;
-                break;
             case JIM_EXPROP_FUNC_ROUND:
-                wC = wA;
+            case JIM_EXPROP_UNARYPLUS:
+                C->u.w = wA;
                 break;
             case JIM_EXPROP_FUNC_DOUBLE:
-                dC = wA;
-                intresult = 0;
+                C->type = JIM_EXPRVAL_DOUBLE;
+                C->u.d = wA;
                 break;
             case JIM_EXPROP_FUNC_ABS:
-                wC = wA >= 0 ? wA : -wA;
+                C->u.w = wA >= 0 ? wA : -wA;
                 break;
             case JIM_EXPROP_UNARYMINUS:
-                wC = -wA;
-                break;
-            case JIM_EXPROP_UNARYPLUS:
-                wC = wA;
+                C->u.w = -wA;
                 break;
             case JIM_EXPROP_NOT:
-                wC = !wA;
+                C->u.w = !wA;
                 break;
             default:
                 abort();
         }
     }
-    else if ((rc = Jim_GetDouble(interp, A, &dA)) == JIM_OK) {
-        switch (e->opcode) {
+    else {
+        double dA = A->u.d;
+
+        C->type = JIM_EXPRVAL_DOUBLE;
+        switch (opcode) {
             case JIM_EXPROP_FUNC_INT:
-                wC = dA;
-                intresult = 1;
+                C->type = JIM_EXPRVAL_INT;
+                C->u.w = dA;
                 break;
             case JIM_EXPROP_FUNC_ROUND:
-                wC = dA < 0 ? (dA - 0.5) : (dA + 0.5);
-                intresult = 1;
+                C->type = JIM_EXPRVAL_INT;
+                C->u.w = dA < 0 ? (dA - 0.5) : (dA + 0.5);
                 break;
             case JIM_EXPROP_FUNC_DOUBLE:
-                dC = dA;
+            case JIM_EXPROP_UNARYPLUS:
+                C->u.d = dA;
                 break;
             case JIM_EXPROP_FUNC_ABS:
-                dC = dA >= 0 ? dA : -dA;
+                C->u.d = dA >= 0 ? dA : -dA;
                 break;
             case JIM_EXPROP_UNARYMINUS:
-                dC = -dA;
-                break;
-            case JIM_EXPROP_UNARYPLUS:
-                dC = dA;
+                C->u.d = -dA;
                 break;
             case JIM_EXPROP_NOT:
-                wC = !dA;
-                intresult = 1;
+                C->type = JIM_EXPRVAL_INT;
+                C->u.w = !dA;
                 break;
             default:
                 abort();
         }
     }
+    C->objPtr = NULL;
+}
+
+static int JimExprOpNumUnary(Jim_Interp *interp, struct JimExprState *e)
+{
+    int rc;
+    Jim_Obj *A = ExprPop(e);
+    JimExprValue v;
 
+    v.type = JIM_EXPRVAL_OBJ;
+    v.objPtr = A;
+
+    rc = JimExprValueNumber(interp, &v);
     if (rc == JIM_OK) {
-        if (intresult) {
-            ExprPush(e, Jim_NewIntObj(interp, wC));
-        }
-        else {
-            ExprPush(e, Jim_NewDoubleObj(interp, dC));
-        }
+        JimExprNumUnaryOp(e->opcode, &v, &v);
+        ExprPush(e, JimExprValueObj(interp, &v));
     }
 
     Jim_DecrRefCount(interp, A);
@@ -7420,153 +10497,147 @@ static int JimExprOpNone(Jim_Interp *interp, struct JimExprState *e)
 }
 
 #ifdef JIM_MATH_FUNCTIONS
+static double JimExprDoubleUnaryOp(int opcode, double dA)
+{
+    switch (opcode) {
+        case JIM_EXPROP_FUNC_SIN:
+            return sin(dA);
+        case JIM_EXPROP_FUNC_COS:
+            return cos(dA);
+        case JIM_EXPROP_FUNC_TAN:
+            return tan(dA);
+        case JIM_EXPROP_FUNC_ASIN:
+            return asin(dA);
+        case JIM_EXPROP_FUNC_ACOS:
+            return acos(dA);
+        case JIM_EXPROP_FUNC_ATAN:
+            return atan(dA);
+        case JIM_EXPROP_FUNC_SINH:
+            return sinh(dA);
+        case JIM_EXPROP_FUNC_COSH:
+            return cosh(dA);
+        case JIM_EXPROP_FUNC_TANH:
+            return tanh(dA);
+        case JIM_EXPROP_FUNC_CEIL:
+            return ceil(dA);
+        case JIM_EXPROP_FUNC_FLOOR:
+            return floor(dA);
+        case JIM_EXPROP_FUNC_EXP:
+            return exp(dA);
+        case JIM_EXPROP_FUNC_LOG:
+            return log(dA);
+        case JIM_EXPROP_FUNC_LOG10:
+            return log10(dA);
+        case JIM_EXPROP_FUNC_SQRT:
+            return sqrt(dA);
+        default:
+            abort();
+    }
+}
+
 static int JimExprOpDoubleUnary(Jim_Interp *interp, struct JimExprState *e)
 {
     int rc;
     Jim_Obj *A = ExprPop(e);
-    double dA, dC;
+    double dA;
 
     rc = Jim_GetDouble(interp, A, &dA);
     if (rc == JIM_OK) {
-        switch (e->opcode) {
-            case JIM_EXPROP_FUNC_SIN:
-                dC = sin(dA);
-                break;
-            case JIM_EXPROP_FUNC_COS:
-                dC = cos(dA);
-                break;
-            case JIM_EXPROP_FUNC_TAN:
-                dC = tan(dA);
-                break;
-            case JIM_EXPROP_FUNC_ASIN:
-                dC = asin(dA);
-                break;
-            case JIM_EXPROP_FUNC_ACOS:
-                dC = acos(dA);
-                break;
-            case JIM_EXPROP_FUNC_ATAN:
-                dC = atan(dA);
-                break;
-            case JIM_EXPROP_FUNC_SINH:
-                dC = sinh(dA);
-                break;
-            case JIM_EXPROP_FUNC_COSH:
-                dC = cosh(dA);
-                break;
-            case JIM_EXPROP_FUNC_TANH:
-                dC = tanh(dA);
-                break;
-            case JIM_EXPROP_FUNC_CEIL:
-                dC = ceil(dA);
-                break;
-            case JIM_EXPROP_FUNC_FLOOR:
-                dC = floor(dA);
-                break;
-            case JIM_EXPROP_FUNC_EXP:
-                dC = exp(dA);
-                break;
-            case JIM_EXPROP_FUNC_LOG:
-                dC = log(dA);
-                break;
-            case JIM_EXPROP_FUNC_LOG10:
-                dC = log10(dA);
-                break;
-            case JIM_EXPROP_FUNC_SQRT:
-                dC = sqrt(dA);
-                break;
-            default:
-                abort();
-        }
-        ExprPush(e, Jim_NewDoubleObj(interp, dC));
+        ExprPush(e, Jim_NewDoubleObj(interp, JimExprDoubleUnaryOp(e->opcode, dA)));
     }
 
     Jim_DecrRefCount(interp, A);
 
     return rc;
 }
-#endif
+#endif
+
+/* A binary operation on two ints. Sets the interp result on error. */
+static int JimExprIntBinOp(Jim_Interp *interp, int opcode, jim_wide wA, jim_wide wB, jim_wide *wCPtr)
+{
+    jim_wide wC;
+
+    switch (opcode) {
+        case JIM_EXPROP_LSHIFT:
+            wC = wA << wB;
+            break;
+        case JIM_EXPROP_RSHIFT:
+            wC = wA >> wB;
+            break;
+        case JIM_EXPROP_BITAND:
+            wC = wA & wB;
+            break;
+        case JIM_EXPROP_BITXOR:
+            wC = wA ^ wB;
+            break;
+        case JIM_EXPROP_BITOR:
+            wC = wA | wB;
+            break;
+        case JIM_EXPROP_MOD:
+            if (wB == 0) {
+                Jim_SetResultString(interp, "Division by zero", -1);
+                return JIM_ERR;
+            }
+            else {
+                /*
+                 * From Tcl 8.x
+                 *
+                 * This code is tricky: C doesn't guarantee much
+                 * about the quotient or remainder, but Tcl does.
+                 * The remainder always has the same sign as the
+                 * divisor and a smaller absolute value.
+                 */
+                int negative = 0;
+
+                if (wB < 0) {
+                    wB = -wB;
+                    wA = -wA;
+                    negative = 1;
+                }
+                wC = wA % wB;
+                if (wC < 0) {
+                    wC += wB;
+                }
+                if (negative) {
+                    wC = -wC;
+                }
+            }
+            break;
+        case JIM_EXPROP_ROTL:
+        case JIM_EXPROP_ROTR:{
+                /* uint32_t would be better. But not everyone has inttypes.h? */
+                unsigned long uA = (unsigned long)wA;
+                unsigned long uB = (unsigned long)wB;
+                const unsigned int S = sizeof(unsigned long) * 8;
+
+                /* Shift left by the word size or more is undefined. */
+                uB %= S;
+
+                if (opcode == JIM_EXPROP_ROTR) {
+                    uB = S - uB;
+                }
+                wC = (unsigned long)(uA << uB) | (uA >> (S - uB));
+                break;
+            }
+        default:
+            abort();
+    }
+    *wCPtr = wC;
+    return JIM_OK;
+}
 
-/* A binary operation on two ints */
 static int JimExprOpIntBin(Jim_Interp *interp, struct JimExprState *e)
 {
     Jim_Obj *B = ExprPop(e);
     Jim_Obj *A = ExprPop(e);
-    jim_wide wA, wB;
+    jim_wide wA, wB, wC;
     int rc = JIM_ERR;
 
     if (Jim_GetWide(interp, A, &wA) == JIM_OK && Jim_GetWide(interp, B, &wB) == JIM_OK) {
-        jim_wide wC;
-
-        rc = JIM_OK;
-
-        switch (e->opcode) {
-            case JIM_EXPROP_LSHIFT:
-                wC = wA << wB;
-                break;
-            case JIM_EXPROP_RSHIFT:
-                wC = wA >> wB;
-                break;
-            case JIM_EXPROP_BITAND:
-                wC = wA & wB;
-                break;
-            case JIM_EXPROP_BITXOR:
-                wC = wA ^ wB;
-                break;
-            case JIM_EXPROP_BITOR:
-                wC = wA | wB;
-                break;
-            case JIM_EXPROP_MOD:
-                if (wB == 0) {
-                    wC = 0;
-                    Jim_SetResultString(interp, "Division by zero", -1);
-                    rc = JIM_ERR;
-                }
-                else {
-                    /*
-                     * From Tcl 8.x
-                     *
-                     * This code is tricky: C doesn't guarantee much
-                     * about the quotient or remainder, but Tcl does.
-                     * The remainder always has the same sign as the
-                     * divisor and a smaller absolute value.
-                     */
-                    int negative = 0;
-
-                    if (wB < 0) {
-                        wB = -wB;
-                        wA = -wA;
-                        negative = 1;
-                    }
-                    wC = wA % wB;
-                    if (wC < 0) {
-                        wC += wB;
-                    }
-                    if (negative) {
-                        wC = -wC;
-                    }
-                }
-                break;
-            case JIM_EXPROP_ROTL:
-            case JIM_EXPROP_ROTR:{
-                    /* uint32_t would be better. But not everyone has inttypes.h? */
-                    unsigned long uA = (unsigned long)wA;
-                    unsigned long uB = (unsigned long)wB;
-                    const unsigned int S = sizeof(unsigned long) * 8;
-
-                    /* Shift left by the word size or more is undefined. */
-                    uB %= S;
-
-                    if (e->opcode == JIM_EXPROP_ROTR) {
-                        uB = S - uB;
-                    }
-                    wC = (unsigned long)(uA << uB) | (uA >> (S - uB));
-                    break;
-                }
-            default:
-                abort();
+        rc = JimExprIntBinOp(interp, e->opcode, wA, wB, &wC);
+        if (rc == JIM_OK) {
+            ExprPush(e, Jim_NewIntObj(interp, wC));
         }
-        ExprPush(e, Jim_NewIntObj(interp, wC));
-
     }
 
     Jim_DecrRefCount(interp, A);
@@ -7575,27 +10646,18 @@ static int JimExprOpIntBin(Jim_Interp *interp, struct JimExprState *e)
     return rc;
 }
 
-
-/* A binary operation on two ints or two doubles (or two strings for some ops) */
-static int JimExprOpBin(Jim_Interp *interp, struct JimExprState *e)
+/* A binary operation on two classified numbers, computed on two ints if both
+ * are ints, otherwise on two doubles. The result may replace either argument.
+ * Sets the interp result on error.
+ */
+static int JimExprNumBinOp(Jim_Interp *interp, int opcode, const JimExprValue *A, const JimExprValue *B, JimExprValue *C)
 {
-    int intresult = 0;
-    int rc = JIM_OK;
-    double dA, dB, dC = 0;
-    jim_wide wA, wB, wC = 0;
-
-    Jim_Obj *B = ExprPop(e);
-    Jim_Obj *A = ExprPop(e);
-
-    if ((A->typePtr != &doubleObjType || A->bytes) &&
-        (B->typePtr != &doubleObjType || B->bytes) &&
-        JimGetWideNoErr(interp, A, &wA) == JIM_OK && JimGetWideNoErr(interp, B, &wB) == JIM_OK) {
-
-        /* Both are ints */
-
-        intresult = 1;
+    if (A->type == JIM_EXPRVAL_INT && B->type == JIM_EXPRVAL_INT) {
+        jim_wide wA = A->u.w;
+        jim_wide wB = B->u.w;
+        jim_wide wC;
 
-        switch (e->opcode) {
+        switch (opcode) {
             case JIM_EXPROP_POW:
             case JIM_EXPROP_FUNC_POW:
                 wC = JimPowWide(wA, wB);
@@ -7612,7 +10674,7 @@ static int JimExprOpBin(Jim_Interp *interp, struct JimExprState *e)
             case JIM_EXPROP_DIV:
                 if (wB == 0) {
                     Jim_SetResultString(interp, "Division by zero", -1);
-                    rc = JIM_ERR;
+                    return JIM_ERR;
                 }
                 else {
                     /*
@@ -7654,18 +10716,26 @@ static int JimExprOpBin(Jim_Interp *interp, struct JimExprState *e)
             default:
                 abort();
         }
+        C->type = JIM_EXPRVAL_INT;
+        C->u.w = wC;
     }
-    else if (Jim_GetDouble(interp, A, &dA) == JIM_OK && Jim_GetDouble(interp, B, &dB) == JIM_OK) {
-        switch (e->opcode) {
+    else {
+        double dA = JimExprValueDouble(A);
+        double dB = JimExprValueDouble(B);
+        double dC = 0;
+        jim_wide wC = 0;
+        int intresult = 0;
+
+        switch (opcode) {
             case JIM_EXPROP_POW:
             case JIM_EXPROP_FUNC_POW:
 #ifdef JIM_MATH_FUNCTIONS
                 dC = pow(dA, dB);
+                break;
 #else
                 Jim_SetResultString(interp, "unsupported", -1);
-                rc = JIM_ERR;
+                return JIM_ERR;
 #endif
-                break;
             case JIM_EXPROP_ADD:
                 dC = dA + dB;
                 break;
@@ -7714,14 +10784,44 @@ static int JimExprOpBin(Jim_Interp *interp, struct JimExprState *e)
             default:
                 abort();
         }
+        if (intresult) {
+            C->type = JIM_EXPRVAL_INT;
+            C->u.w = wC;
+        }
+        else {
+            C->type = JIM_EXPRVAL_DOUBLE;
+            C->u.d = dC;
+        }
+    }
+    C->objPtr = NULL;
+    return JIM_OK;
+}
+
+/* A binary operation on two ints or two doubles (or two strings for some ops) */
+static int JimExprOpBin(Jim_Interp *interp, struct JimExprState *e)
+{
+    int rc = JIM_OK;
+    JimExprValue vA, vB;
+
+    Jim_Obj *B = ExprPop(e);
+    Jim_Obj *A = ExprPop(e);
+
+    vA.type = vB.type = JIM_EXPRVAL_OBJ;
+    vA.objPtr = A;
+    vB.objPtr = B;
+
+    if (JimExprValueNumber(interp, &vA) == JIM_OK && JimExprValueNumber(interp, &vB) == JIM_OK) {
+        rc = JimExprNumBinOp(interp, e->opcode, &vA, &vB, &vA);
+        if (rc == JIM_OK) {
+            ExprPush(e, JimExprValueObj(interp, &vA));
+        }
     }
     else {
         /* Handle the string case */
 
         /* REVISIT: Could optimise the eq/ne case by checking lengths */
         int i = Jim_StringCompareObj(interp, A, B, 0);
-
-        intresult = 1;
+        jim_wide wC;
 
         switch (e->opcode) {
             case JIM_EXPROP_LT:
@@ -7746,15 +10846,9 @@ static int JimExprOpBin(Jim_Interp *interp, struct JimExprState *e)
                 rc = JIM_ERR;
                 break;
         }
-    }
-
-    if (rc == JIM_OK) {
-        if (intresult) {
+        if (rc == JIM_OK) {
             ExprPush(e, Jim_NewIntObj(interp, wC));
         }
-        else {
-            ExprPush(e, Jim_NewDoubleObj(interp, dC));
-        }
     }
 
     Jim_DecrRefCount(interp, A);
@@ -7765,20 +10859,7 @@ static int JimExprOpBin(Jim_Interp *interp, struct JimExprState *e)
 
 static int JimSearchList(Jim_Interp *interp, Jim_Obj *listObjPtr, Jim_Obj *valObj)
 {
-    int listlen;
-    int i;
-
-    listlen = Jim_ListLength(interp, listObjPtr);
-    for (i = 0; i < listlen; i++) {
-        Jim_Obj *objPtr;
-
-        Jim_ListIndex(interp, listObjPtr, i, &objPtr, JIM_NONE);
-
-        if (Jim_StringEqObj(objPtr, valObj)) {
-            return 1;
-        }
-    }
-    return 0;
+    return JimListFindExact(interp, listObjPtr, valObj, 0) >= 0;
 }
 
 static int JimExprOpStrBin(Jim_Interp *interp, struct JimExprState *e)
@@ -8300,6 +11381,7 @@ typedef struct ExprByteCode
     int len;                    /* Length as number of tokens. */
     ScriptToken *token;         /* Tokens array. */
     int inUse;                  /* Used for sharing. */
+    int unboxed;                /* 1 if the expression may be evaluated by JimExprEvalUnboxed() */
 } ExprByteCode;
 
 static void ExprFreeByteCode(Jim_Interp *interp, ExprByteCode * expr)
@@ -8369,6 +11451,160 @@ static int ExprCheckCorrectness(ExprByteCode * expr)
     return JIM_OK;
 }
 
+#ifdef JIM_OPTIMIZATION
+/* Returns 1 if the operator is a pure numeric operator, supported by JimExprValueOp() */
+static int JimExprIsNumericOp(int opcode)
+{
+    int (*funcop) (Jim_Interp *interp, struct JimExprState * e);
+
+    if (opcode == JIM_EXPROP_BITNOT) {
+        return 1;
+    }
+    if (opcode < JIM_TT_EXPR_OP) {
+        return 0;
+    }
+    funcop = JimExprOperatorInfoByOpcode(opcode)->funcop;
+    return funcop == JimExprOpBin || funcop == JimExprOpIntBin || funcop == JimExprOpNumUnary
+#ifdef JIM_MATH_FUNCTIONS
+        || funcop == JimExprOpDoubleUnary
+#endif
+        ;
+}
+
+/* Performs the numeric operator 'opcode' on A (and B for a binary operator),
+ * replacing A with the result.
+ *
+ * Returns JIM_ERR if an operand is not suitable or the operation fails.
+ */
+static int JimExprValueOp(Jim_Interp *interp, int opcode, JimExprValue *A, JimExprValue *B)
+{
+    const struct Jim_ExprOperator *op = JimExprOperatorInfoByOpcode(opcode);
+
+    if (JimExprValueNumber(interp, A) != JIM_OK) {
+        return JIM_ERR;
+    }
+    if (op->arity == 1) {
+        if (opcode == JIM_EXPROP_BITNOT) {
+            if (A->type != JIM_EXPRVAL_INT) {
+                return JIM_ERR;
+            }
+            A->u.w = ~A->u.w;
+            A->objPtr = NULL;
+        }
+#ifdef JIM_MATH_FUNCTIONS
+        else if (op->funcop == JimExprOpDoubleUnary) {
+            A->u.d = JimExprDoubleUnaryOp(opcode, JimExprValueDouble(A));
+            A->type = JIM_EXPRVAL_DOUBLE;
+            A->objPtr = NULL;
+        }
+#endif
+        else {
+            JimExprNumUnaryOp(opcode, A, A);
+        }
+        return JIM_OK;
+    }
+
+    if (JimExprValueNumber(interp, B) != JIM_OK) {
+        return JIM_ERR;
+    }
+    if (op->funcop == JimExprOpIntBin) {
+        if (A->type != JIM_EXPRVAL_INT || B->type != JIM_EXPRVAL_INT) {
+            return JIM_ERR;
+        }
+        A->objPtr = NULL;
+        return JimExprIntBinOp(interp, opcode, A->u.w, B->u.w, &A->u.w);
+    }
+    return JimExprNumBinOp(interp, opcode, A, B, A);
+}
+
+/* Returns 1 if every instruction of the expression is a numeric operation, or a
+ * constant or variable operand. Such an expression has no side effects and its
+ * intermediate results need not be boxed (see JimExprEvalUnboxed()).
+ */
+static int ExprCanEvalUnboxed(ExprByteCode *expr)
+{
+    int i;
+
+    for (i = 0; i < expr->len; i++) {
+        switch (expr->token[i].type) {
+            case JIM_TT_EXPR_INT:
+            case JIM_TT_EXPR_DOUBLE:
+            case JIM_TT_VAR:
+            case JIM_TT_STR:
+            case JIM_EXPROP_LOGICAND_LEFT:
+            case JIM_EXPROP_LOGICAND_RIGHT:
+            case JIM_EXPROP_LOGICOR_LEFT:
+            case JIM_EXPROP_LOGICOR_RIGHT:
+            case JIM_EXPROP_TERNARY_LEFT:
+            case JIM_EXPROP_TERNARY_RIGHT:
+            case JIM_EXPROP_COLON_LEFT:
+            case JIM_EXPROP_COLON_RIGHT:
+                continue;
+        }
+        if (!JimExprIsNumericOp(expr->token[i].type)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Called as each operator is added to the expression.
+ * If the operator is a pure numeric operator and all its operands are
+ * constants, replaces the operator and its operands with the constant result.
+ * Since this happens as each operator is added, constant subexpressions
+ * fold completely. e.g. $x * (60*60*24) becomes $x 86400 *
+ *
+ * If the operation fails (e.g. division by zero), the expression is left
+ * unchanged so that the error occurs at runtime.
+ */
+static void ExprFoldConstants(Jim_Interp *interp, ExprByteCode *expr)
+{
+    int opcode = expr->token[expr->len - 1].type;
+    int arity = JimExprOperatorInfoByOpcode(opcode)->arity;
+    ScriptToken *t;
+    JimExprValue v[2];
+    Jim_Obj *resultObjPtr;
+    int i;
+    int rc;
+
+    if (expr->len <= arity || !JimExprIsNumericOp(opcode)) {
+        return;
+    }
+    t = &expr->token[expr->len - 1 - arity];
+    for (i = 0; i < arity; i++) {
+        if (t[i].type != JIM_TT_EXPR_INT && t[i].type != JIM_TT_EXPR_DOUBLE) {
+            return;
+        }
+        v[i].type = JIM_EXPRVAL_OBJ;
+        v[i].objPtr = t[i].objPtr;
+    }
+
+    /* Don't let a failed operation change the interpreter result */
+    resultObjPtr = Jim_GetResult(interp);
+    Jim_IncrRefCount(resultObjPtr);
+    rc = JimExprValueOp(interp, opcode, &v[0], &v[1]);
+    Jim_SetResult(interp, resultObjPtr);
+    Jim_DecrRefCount(interp, resultObjPtr);
+    if (rc != JIM_OK) {
+        return;
+    }
+
+    /* The operands are not yet referenced */
+    for (i = 0; i < arity; i++) {
+        Jim_FreeNewObj(interp, t[i].objPtr);
+    }
+    if (v[0].type == JIM_EXPRVAL_INT) {
+        t->type = JIM_TT_EXPR_INT;
+        t->objPtr = Jim_NewIntObj(interp, v[0].u.w);
+    }
+    else {
+        t->type = JIM_TT_EXPR_DOUBLE;
+        t->objPtr = Jim_NewDoubleObj(interp, v[0].u.d);
+    }
+    expr->len -= arity;
+}
+#endif
+
 /* This procedure converts every occurrence of || and && opereators
  * in lazy unary versions.
  *
@@ -8430,7 +11666,8 @@ static int ExprAddLazyOperator(Jim_Interp *interp, ExprByteCode * expr, ParseTok
     expr->token[leftindex + 1].objPtr = interp->emptyObj;
 
     expr->token[leftindex].type = JIM_TT_EXPR_INT;
-    expr->token[leftindex].objPtr = Jim_NewIntObj(interp, offset);
+    /* Unshared, since the offset is adjusted and read directly from the int rep */
+    expr->token[leftindex].objPtr = JimNewUnsharedIntObj(interp, offset);
 
     /* Now add the 'R' operator */
     expr->token[expr->len].objPtr = interp->emptyObj;
@@ -8464,6 +11701,9 @@ static int ExprAddOperator(Jim_Interp *interp, ExprByteCode * expr, ParseToken *
         token->objPtr = interp->emptyObj;
         token->type = t->type;
         expr->len++;
+#ifdef JIM_OPTIMIZATION
+        ExprFoldConstants(interp, expr);
+#endif
     }
     return JIM_OK;
 }
@@ -8891,6 +12131,10 @@ static int SetExprFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
         goto invalidexpr;
     }
 
+#ifdef JIM_OPTIMIZATION
+    expr->unboxed = ExprCanEvalUnboxed(expr);
+#endif
+
     rc = JIM_OK;
 
   err:
@@ -8929,6 +12173,168 @@ static ExprByteCode *JimGetExpression(Jim_Interp *interp, Jim_Obj *objPtr)
  * ---------------------------------------------------------------------------*/
 #define JIM_EE_STATICSTACK_LEN 10
 
+#ifdef JIM_OPTIMIZATION
+/* Same as ExprBool(), but avoids boxing a computed value */
+static int JimExprValueBool(Jim_Interp *interp, const JimExprValue *v)
+{
+    if (v->objPtr) {
+        return ExprBool(interp, v->objPtr);
+    }
+    if (v->type == JIM_EXPRVAL_INT) {
+        return (long)v->u.w != 0;
+    }
+    return v->u.d != 0;
+}
+
+/* Evaluates an expression for which ExprCanEvalUnboxed() is true, keeping
+ * operands and intermediate results as unboxed ints and doubles.
+ * Only the final result is stored as an object in *exprResultPtrPtr.
+ *
+ * Returns JIM_ERR if the expression can't be evaluated this way (e.g. an operand
+ * is not numeric, a variable doesn't exist or an operator fails), leaving the
+ * caller to evaluate the expression as usual to get the correct result or error.
+ * This is possible because such expressions have no side effects.
+ */
+static int JimExprEvalUnboxed(Jim_Interp *interp, ExprByteCode *expr, Jim_Obj **exprResultPtrPtr)
+{
+    JimExprValue staticStack[JIM_EE_STATICSTACK_LEN];
+    Jim_Obj *staticVars[JIM_EE_STATICSTACK_LEN];
+    JimExprValue *stack = staticStack;
+    Jim_Obj **vars = staticVars;
+    int sp = 0;
+    int nvars = 0;
+    int i;
+    int rc = JIM_OK;
+
+    if (expr->len > JIM_EE_STATICSTACK_LEN) {
+        stack = Jim_Alloc(sizeof(*stack) * expr->len);
+        vars = Jim_Alloc(sizeof(*vars) * expr->len);
+    }
+    /* Keep the compiler happy */
+    stack[0].objPtr = NULL;
+
+    for (i = 0; i < expr->len && rc == JIM_OK; i++) {
+        ScriptToken *t = &expr->token[i];
+        JimExprValue *A;
+        JimExprValue *B;
+        int skip;
+
+        switch (t->type) {
+            case JIM_TT_EXPR_INT:
+            case JIM_TT_EXPR_DOUBLE:
+            case JIM_TT_STR:
+                stack[sp].type = JIM_EXPRVAL_OBJ;
+                stack[sp++].objPtr = t->objPtr;
+                continue;
+
+            case JIM_TT_VAR:
+                stack[sp].type = JIM_EXPRVAL_OBJ;
+                stack[sp].objPtr = Jim_GetVariable(interp, t->objPtr, JIM_NONE);
+                if (stack[sp].objPtr == NULL) {
+                    rc = JIM_ERR;
+                    continue;
+                }
+                /* Hold a reference in case classifying another operand frees this one */
+                Jim_IncrRefCount(stack[sp].objPtr);
+                vars[nvars++] = stack[sp++].objPtr;
+                continue;
+
+            case JIM_EXPROP_LOGICAND_LEFT:
+            case JIM_EXPROP_LOGICOR_LEFT:
+                skip = JimWideValue(stack[--sp].objPtr);
+                switch (JimExprValueBool(interp, &stack[--sp])) {
+                    case 0:
+                        if (t->type == JIM_EXPROP_LOGICAND_LEFT) {
+                            /* false, so skip RHS opcodes with a 0 result */
+                            i += skip;
+                            stack[sp].type = JIM_EXPRVAL_INT;
+                            stack[sp].u.w = 0;
+                            stack[sp++].objPtr = NULL;
+                        }
+                        break;
+                    case 1:
+                        if (t->type == JIM_EXPROP_LOGICOR_LEFT) {
+                            /* true, so skip RHS opcodes with a 1 result */
+                            i += skip;
+                            stack[sp].type = JIM_EXPRVAL_INT;
+                            stack[sp].u.w = 1;
+                            stack[sp++].objPtr = NULL;
+                        }
+                        break;
+                    default:
+                        rc = JIM_ERR;
+                        break;
+                }
+                continue;
+
+            case JIM_EXPROP_LOGICAND_RIGHT:
+            case JIM_EXPROP_LOGICOR_RIGHT:
+                A = &stack[sp - 1];
+                A->u.w = JimExprValueBool(interp, A);
+                if (A->u.w < 0) {
+                    rc = JIM_ERR;
+                }
+                A->type = JIM_EXPRVAL_INT;
+                A->objPtr = NULL;
+                continue;
+
+            case JIM_EXPROP_TERNARY_LEFT:
+                skip = JimWideValue(stack[--sp].objPtr);
+                switch (JimExprValueBool(interp, &stack[sp - 1])) {
+                    case 0:
+                        /* false, skip RHS opcodes and push a dummy value */
+                        i += skip;
+                        stack[sp].type = JIM_EXPRVAL_INT;
+                        stack[sp].u.w = 0;
+                        stack[sp++].objPtr = NULL;
+                        break;
+                    case 1:
+                        break;
+                    default:
+                        rc = JIM_ERR;
+                        break;
+                }
+                continue;
+
+            case JIM_EXPROP_COLON_LEFT:
+                skip = JimWideValue(stack[--sp].objPtr);
+                B = &stack[--sp];
+                A = &stack[--sp];
+                if (JimExprValueBool(interp, A)) {
+                    /* true, so skip RHS opcodes and repush B as the answer */
+                    i += skip;
+                    stack[sp++] = *B;
+                }
+                continue;
+
+            case JIM_EXPROP_TERNARY_RIGHT:
+            case JIM_EXPROP_COLON_RIGHT:
+                continue;
+        }
+
+        /* Otherwise a numeric operator */
+        if (JimExprOperatorInfoByOpcode(t->type)->arity == 2) {
+            sp--;
+        }
+        rc = JimExprValueOp(interp, t->type, &stack[sp - 1], &stack[sp]);
+    }
+
+    if (rc == JIM_OK) {
+        *exprResultPtrPtr = JimExprValueObj(interp, &stack[0]);
+        Jim_IncrRefCount(*exprResultPtrPtr);
+    }
+
+    for (i = 0; i < nvars; i++) {
+        Jim_DecrRefCount(interp, vars[i]);
+    }
+    if (stack != staticStack) {
+        Jim_Free(stack);
+        Jim_Free(vars);
+    }
+    return rc;
+}
+#endif
+
 int Jim_EvalExpression(Jim_Interp *interp, Jim_Obj *exprObjPtr, Jim_Obj **exprResultPtrPtr)
 {
     ExprByteCode *expr;
@@ -9055,6 +12461,14 @@ int Jim_EvalExpression(Jim_Interp *interp, Jim_Obj *exprObjPtr, Jim_Obj **exprRe
                 break;
         }
     }
+
+    if (expr->unboxed) {
+        if (JimExprEvalUnboxed(interp, expr, exprResultPtrPtr) == JIM_OK) {
+            return JIM_OK;
+        }
+        /* Operands of this expression aren't always numeric, so don't bother next time */
+        expr->unboxed = 0;
+    }
 #endif
 
     /* In order to avoid that the internal repr gets freed due to
@@ -9451,45 +12865,66 @@ static int SetScanFmtFromAny(Jim_Interp *interp, Jim_Obj *objPtr)
 
 /* JimScanAString is used to scan an unspecified string that ends with
  * next WS, or a string that is specified via a charset.
- *
+ * Only the matching part of str is copied, not the rest of the input.
  */
 static Jim_Obj *JimScanAString(Jim_Interp *interp, const char *sdescr, const char *str)
 {
-    char *buffer = Jim_StrDup(str);
-    char *p = buffer;
+    const char *p = str;
 
-    while (*str) {
+    while (*p) {
         int c;
         int n;
 
-        if (!sdescr && isspace(UCHAR(*str)))
+        if (!sdescr && isspace(UCHAR(*p)))
             break;              /* EOS via WS if unspecified */
 
-        n = utf8_tounicode(str, &c);
+        n = utf8_tounicode(p, &c);
         if (sdescr && !JimCharsetMatch(sdescr, c, JIM_CHARSET_SCAN))
             break;
-        while (n--)
-            *p++ = *str++;
+        p += n;
+    }
+    return Jim_NewStringObj(interp, str, p - str);
+}
+
+/* JimScanLiteral matches the literal text of a format at the start of str,
+ * where white space in the literal matches any amount of white space.
+ * Returns the number of bytes matched, or -1 if the literal didn't match */
+
+static int JimScanLiteral(const char *literal, const char *str, int strLen)
+{
+    int pos = 0;
+
+    for (; *literal; ++literal) {
+        if (isspace(UCHAR(*literal))) {
+            while (pos < strLen && isspace(UCHAR(str[pos])))
+                ++pos;
+        }
+        else if (pos < strLen && *literal == str[pos])
+            ++pos;
+        else
+            return -1;
     }
-    *p = 0;
-    return Jim_NewStringObjNoAlloc(interp, buffer, p - buffer);
+    return pos;
 }
 
 /* ScanOneEntry will scan one entry out of the string passed as argument.
  * It use the sscanf() function for this task. After extracting and
- * converting of the value, the count of scanned characters will be
+ * converting of the value, the count of scanned bytes will be
  * returned of -1 in case of no conversion tool place and string was
- * already scanned thru */
+ * already scanned thru.
+ *
+ * pos and strLen are byte offsets, and charPos is the char index at pos.
+ * If ascii is set, every char is a single byte, so no chars need counting */
 
 static int ScanOneEntry(Jim_Interp *interp, const char *str, int pos, int strLen,
-    ScanFmtStringObj * fmtObj, long idx, Jim_Obj **valObjPtr)
+    int charPos, int ascii, ScanFmtStringObj * fmtObj, long idx, Jim_Obj **valObjPtr)
 {
     const char *tok;
     const ScanFmtPartDescr *descr = &fmtObj->descr[idx];
-    size_t scanned = 0;
-    size_t anchor = pos;
+    int scanned = 0;
+    int anchor = pos;
     int i;
-    Jim_Obj *tmpObj = NULL;
+    char *tmp = NULL;
 
     /* First pessimistically assume, we will not scan anything :-) */
     *valObjPtr = 0;
@@ -9523,7 +12958,7 @@ static int ScanOneEntry(Jim_Interp *interp, const char *str, int pos, int strLen
     /* %c is a special, simple case. no width */
     if (descr->type == 'n') {
         /* Return pseudo conversion means: how much scanned so far? */
-        *valObjPtr = Jim_NewIntObj(interp, anchor + scanned);
+        *valObjPtr = Jim_NewIntObj(interp, charPos + (ascii ? scanned : utf8_strlen(str + anchor, scanned)));
     }
     else if (pos >= strLen) {
         /* Cannot scan anything, as str is totally consumed */
@@ -9539,12 +12974,16 @@ static int ScanOneEntry(Jim_Interp *interp, const char *str, int pos, int strLen
         /* Processing of conversions follows ... */
         if (descr->width > 0) {
             /* Do not try to scan as fas as possible but only the given width.
-             * To ensure this, we copy the part that should be scanned. */
-            size_t sLen = utf8_strlen(&str[pos], strLen - pos);
-            size_t tLen = descr->width > sLen ? sLen : descr->width;
-
-            tmpObj = Jim_NewStringObjUtf8(interp, str + pos, tLen);
-            tok = tmpObj->bytes;
+             * To ensure this, we copy the part that should be scanned.
+             * Only up to width chars are walked, not the rest of the input. */
+            int tLen = 0;
+            size_t n;
+
+            for (n = 0; n < descr->width && pos + tLen < strLen; n++) {
+                int c;
+                tLen += ascii ? 1 : utf8_tounicode(str + pos + tLen, &c);
+            }
+            tok = tmp = Jim_StrDupLen(str + pos, tLen);
         }
         else {
             /* As no width was given, simply refer to the original string */
@@ -9617,23 +13056,28 @@ static int ScanOneEntry(Jim_Interp *interp, const char *str, int pos, int strLen
         }
         /* If a substring was allocated (due to pre-defined width) do not
          * forget to free it */
-        if (tmpObj) {
-            Jim_FreeNewObj(interp, tmpObj);
-        }
+        Jim_Free(tmp);
     }
     return scanned;
 }
 
-/* Jim_ScanString is the workhorse of string scanning. It will scan a given
- * string and returns all converted (and not ignored) values in a list back
- * to the caller. If an error occured, a NULL pointer will be returned */
+/* JimScanStringAt is like Jim_ScanString, but starts scanning at char
+ * index *posPtr and sets *posPtr to the char index following what was
+ * scanned (including any literal text at the end of the format).
+ *
+ * The scan keeps a running byte offset and char index rather than
+ * converting between them, so it is linear in the length of the string */
 
-Jim_Obj *Jim_ScanString(Jim_Interp *interp, Jim_Obj *strObjPtr, Jim_Obj *fmtObjPtr, int flags)
+static Jim_Obj *JimScanStringAt(Jim_Interp *interp, Jim_Obj *strObjPtr, Jim_Obj *fmtObjPtr,
+    int *posPtr, int flags)
 {
-    size_t i, pos;
+    size_t i;
     int scanned = 1;
-    const char *str = Jim_String(strObjPtr);
-    int strLen = Jim_Utf8Length(interp, strObjPtr);
+    int strLen;
+    const char *str = Jim_GetString(strObjPtr, &strLen);
+    int charLen = Jim_Utf8Length(interp, strObjPtr);
+    int ascii = (charLen == strLen);
+    int pos, charPos;
     Jim_Obj *resultList = 0;
     Jim_Obj **resultVec = 0;
     int resultc;
@@ -9660,22 +13104,41 @@ Jim_Obj *Jim_ScanString(Jim_Interp *interp, Jim_Obj *strObjPtr, Jim_Obj *fmtObjP
             Jim_ListAppendElement(interp, resultList, emptyStr);
         JimListGetElements(interp, resultList, &resultc, &resultVec);
     }
+    /* Find where to start */
+    charPos = *posPtr;
+    if (charPos < 0)
+        charPos = 0;
+    else if (charPos > charLen)
+        charPos = charLen;
+    pos = ascii ? charPos : JimStringUtf8Offset(interp, strObjPtr, charPos);
+
     /* Now handle every partial format description */
-    for (i = 0, pos = 0; i < fmtObj->count; ++i) {
+    for (i = 0; i < fmtObj->count; ++i) {
         ScanFmtPartDescr *descr = &(fmtObj->descr[i]);
         Jim_Obj *value = 0;
 
-        /* Only last type may be "literal" w/o conversion - skip it! */
-        if (descr->type == 0)
+        /* Only last type may be "literal" w/o conversion. It converts
+         * nothing, but it is consumed if everything before it was */
+        if (descr->type == 0) {
+            int n;
+
+            if (scanned > 0 && (n = JimScanLiteral(descr->prefix, str + pos, strLen - pos)) > 0) {
+                charPos += ascii ? n : utf8_strlen(str + pos, n);
+                pos += n;
+            }
             continue;
+        }
         /* As long as any conversion could be done, we will proceed */
         if (scanned > 0)
-            scanned = ScanOneEntry(interp, str, pos, strLen, fmtObj, i, &value);
+            scanned = ScanOneEntry(interp, str, pos, strLen, charPos, ascii, fmtObj, i, &value);
         /* In case our first try results in EOF, we will leave */
         if (scanned == -1 && i == 0)
             goto eof;
         /* Advance next pos-to-be-scanned for the amount scanned already */
-        pos += scanned;
+        if (scanned > 0) {
+            charPos += ascii ? scanned : utf8_strlen(str + pos, scanned);
+            pos += scanned;
+        }
 
         /* value == 0 means no conversion took place so take empty string */
         if (value == 0)
@@ -9700,6 +13163,7 @@ Jim_Obj *Jim_ScanString(Jim_Interp *interp, Jim_Obj *strObjPtr, Jim_Obj *fmtObjP
         }
     }
     Jim_DecrRefCount(interp, emptyStr);
+    *posPtr = charPos;
     return resultList;
   eof:
     Jim_DecrRefCount(interp, emptyStr);
@@ -9711,6 +13175,17 @@ Jim_Obj *Jim_ScanString(Jim_Interp *interp, Jim_Obj *strObjPtr, Jim_Obj *fmtObjP
     return 0;
 }
 
+/* Jim_ScanString is the workhorse of string scanning. It will scan a given
+ * string and returns all converted (and not ignored) values in a list back
+ * to the caller. If an error occured, a NULL pointer will be returned */
+
+Jim_Obj *Jim_ScanString(Jim_Interp *interp, Jim_Obj *strObjPtr, Jim_Obj *fmtObjPtr, int flags)
+{
+    int pos = 0;
+
+    return JimScanStringAt(interp, strObjPtr, fmtObjPtr, &pos, flags);
+}
+
 /* -----------------------------------------------------------------------------
  * Pseudo Random Number Generation
  * ---------------------------------------------------------------------------*/
@@ -9755,6 +13230,24 @@ static void JimRandomBytes(Jim_Interp *interp, void *dest, unsigned int len)
     }
 }
 
+/* Generates N bytes that can't be predicted, for hash seeds.
+ * The PRNG is seeded from the time, so only used if the system has no random source.
+ */
+static void JimSystemRandomBytes(Jim_Interp *interp, void *dest, unsigned int len)
+{
+    FILE *fh = fopen("/dev/urandom", "rb");
+
+    if (fh) {
+        size_t n = fread(dest, 1, len, fh);
+
+        fclose(fh);
+        if (n == len) {
+            return;
+        }
+    }
+    JimRandomBytes(interp, dest, len);
+}
+
 /* Re-seed the generator with user-provided bytes */
 static void JimPrngSeed(Jim_Interp *interp, unsigned char *seed, int seedLen)
 {
@@ -9939,6 +13432,165 @@ int Jim_EvalObjPrefix(Jim_Interp *interp, Jim_Obj *prefix, int objc, Jim_Obj *co
     return ret;
 }
 
+#ifdef JIM_OPTIMIZATION
+static int Jim_SetCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv);
+static int Jim_IfCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv);
+static int Jim_LappendCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv);
+static int Jim_ReturnCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv);
+static int Jim_ExprCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv);
+
+/* The core command implementing each JIM_SCRIPTOP_... opcode */
+static const Jim_CmdProc JimScriptOpCommands[] = {
+    NULL,
+    Jim_SetCoreCommand,
+    Jim_IncrCoreCommand,
+    Jim_IfCoreCommand,
+    Jim_LappendCoreCommand,
+    Jim_ReturnCoreCommand,
+    Jim_ExprCoreCommand
+};
+
+/**
+ * Evaluates a word consisting of a single token, as Jim_EvalObj() does.
+ * Returns the resulting object (with unchanged refcount) or NULL with
+ * *retcodePtr set if the substitution failed.
+ */
+static Jim_Obj *JimEvalOneTokenWord(Jim_Interp *interp, const ScriptToken *token, int *retcodePtr)
+{
+    Jim_Obj *objPtr;
+
+    switch (token->type) {
+        case JIM_TT_ESC:
+        case JIM_TT_STR:
+            return token->objPtr;
+        case JIM_TT_VAR:
+            objPtr = Jim_GetVariable(interp, token->objPtr, JIM_ERRMSG);
+            break;
+        case JIM_TT_EXPRSUGAR:
+            objPtr = JimExpandExprSugar(interp, token->objPtr);
+            break;
+        case JIM_TT_DICTSUGAR:
+            objPtr = JimExpandDictSugar(interp, token->objPtr);
+            break;
+        case JIM_TT_CMD:
+            *retcodePtr = Jim_EvalObj(interp, token->objPtr);
+            if (*retcodePtr != JIM_OK) {
+                return NULL;
+            }
+            return Jim_GetResult(interp);
+        default:
+            JimPanic((1, "default token type reached " "in JimEvalOneTokenWord()."));
+            objPtr = NULL;
+    }
+    if (objPtr == NULL) {
+        *retcodePtr = JIM_ERR;
+    }
+    return objPtr;
+}
+
+/**
+ * Executes a command line compiled to the specialised opcode 'op'
+ * (see JimScriptLineOp()). 'token' points to the 'argc' single-token words.
+ *
+ * The words are substituted in order exactly as for a normal command.
+ * If the command name no longer resolves to the corresponding core command,
+ * the command is invoked normally.
+ */
+static int JimEvalScriptOp(Jim_Interp *interp, int op, const ScriptToken *token, int argc)
+{
+    Jim_Obj *argv[JIM_SCRIPTOP_MAXARGS];
+    Jim_Cmd *cmdPtr;
+    int retcode = JIM_OK;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        argv[i] = JimEvalOneTokenWord(interp, &token[i], &retcode);
+        if (argv[i] == NULL) {
+            while (i-- > 0) {
+                Jim_DecrRefCount(interp, argv[i]);
+            }
+            return retcode;
+        }
+        Jim_IncrRefCount(argv[i]);
+    }
+
+    cmdPtr = Jim_GetCommand(interp, argv[0], JIM_NONE);
+    if (cmdPtr == NULL || cmdPtr->isproc || cmdPtr->u.native.cmdProc != JimScriptOpCommands[op]) {
+        /* Renamed or redefined, so do it the slow way */
+        retcode = JimInvokeCommand(interp, argc, argv);
+        goto out;
+    }
+    if (interp->evalDepth == interp->maxEvalDepth) {
+        Jim_SetResultString(interp, "Infinite eval recursion", -1);
+        retcode = JIM_ERR;
+        goto out;
+    }
+    interp->evalDepth++;
+
+    switch (op) {
+        case JIM_SCRIPTOP_INCR:
+            if (argc == 2 || argv[2]->typePtr == &intObjType) {
+                Jim_Obj *objPtr = Jim_GetVariable(interp, argv[1], JIM_NONE);
+
+                /* Only the common case: an unshared int in a simple variable */
+                if (objPtr && !Jim_IsShared(objPtr) && objPtr->typePtr == &intObjType
+                    && argv[1]->typePtr == &variableObjType) {
+                    JimWideValue(objPtr) += (argc == 2) ? 1 : JimWideValue(argv[2]);
+                    Jim_InvalidateStringRep(objPtr);
+                    Jim_SetResult(interp, objPtr);
+                    break;
+                }
+            }
+            retcode = Jim_IncrCoreCommand(interp, argc, argv);
+            break;
+
+        case JIM_SCRIPTOP_IF:{
+                int boolean;
+
+                retcode = Jim_GetBoolFromExpr(interp, argv[1], &boolean);
+                if (retcode == JIM_OK) {
+                    if (boolean) {
+                        retcode = Jim_EvalObj(interp, argv[2]);
+                    }
+                    else if (argc == 5) {
+                        retcode = Jim_EvalObj(interp, argv[4]);
+                    }
+                    else {
+                        Jim_SetEmptyResult(interp);
+                    }
+                }
+                break;
+            }
+
+        case JIM_SCRIPTOP_RETURN:
+            interp->returnCode = JIM_OK;
+            interp->returnLevel = 1;
+            if (argc == 2) {
+                Jim_SetResult(interp, argv[1]);
+            }
+            else {
+                Jim_SetEmptyResult(interp);
+            }
+            retcode = JIM_RETURN;
+            break;
+
+        default:
+            /* set, lappend and expr don't need anything special,
+             * but still avoid the dispatch overhead */
+            Jim_SetEmptyResult(interp);
+            retcode = JimScriptOpCommands[op](interp, argc, argv);
+            break;
+    }
+    interp->evalDepth--;
+
+  out:
+    for (i = 0; i < argc; i++) {
+        Jim_DecrRefCount(interp, argv[i]);
+    }
+    return retcode;
+}
+#endif
+
 static void JimAddErrorToStack(Jim_Interp *interp, int retcode, ScriptObj *script)
 {
     int rc = retcode;
@@ -10101,8 +13753,11 @@ static Jim_Obj *JimInterpolateTokens(Jim_Interp *interp, const ScriptToken * tok
         Jim_IncrRefCount(intv[2]);
     }
 
-    s = objPtr->bytes = Jim_Alloc(totlen + 1);
+    s = objPtr->bytes = JimAllocStringRep(objPtr, totlen);
     objPtr->length = totlen;
+#ifdef JIM_REFERENCES
+    JimInheritGcCandidates(interp, objPtr, intv, tokens);
+#endif
     for (i = 0; i < tokens; i++) {
         if (intv[i]) {
             memcpy(s, intv[i]->bytes, intv[i]->length);
@@ -10225,6 +13880,19 @@ int Jim_EvalObj(Jim_Interp *interp, Jim_Obj *scriptObjPtr)
         argc = token[i].objPtr->internalRep.scriptLineValue.argc;
         script->linenr = token[i].objPtr->internalRep.scriptLineValue.line;
 
+#ifdef JIM_OPTIMIZATION
+        if (token[i].objPtr->internalRep.scriptLineValue.op != JIM_SCRIPTOP_NONE) {
+            /* Compiled to a specialised opcode. Every word is a single token. */
+            retcode = JimEvalScriptOp(interp, token[i].objPtr->internalRep.scriptLineValue.op,
+                &token[i + 1], argc);
+            i += argc + 1;
+            if (retcode == JIM_OK && interp->signal_level && interp->sigmask) {
+                retcode = JIM_SIGNAL;
+            }
+            continue;
+        }
+#endif
+
         /* Allocate the arguments vector if required */
         if (argc > JIM_EVAL_SARGV_LEN)
             argv = Jim_Alloc(sizeof(Jim_Obj *) * argc);
@@ -10486,6 +14154,226 @@ int Jim_EvalNamespace(Jim_Interp *interp, Jim_Obj *scriptObj, Jim_Obj *nsObj)
 }
 #endif
 
+/* -----------------------------------------------------------------------------
+ * Procedure local variable slots
+ * ---------------------------------------------------------------------------*/
+#define JIM_LOCALSLOTS_MAXDEPTH 8   /* How deeply nested bodies are examined */
+#define JIM_LOCALSLOTS_MAXWORDS 16  /* Words of each command which are examined */
+
+/* Adds the name to the slots, unless it can't or needn't be a slot variable */
+static void JimAddLocalSlot(Jim_Interp *interp, Jim_LocalSlots *localSlots, Jim_Cmd *cmd,
+    Jim_Obj *nameObjPtr)
+{
+    int len;
+    const char *name = Jim_GetString(nameObjPtr, &len);
+
+    /* Leave qualified names, dict sugar and statics to the normal lookup */
+    if (len == 0 || memchr(name, '\0', len) || strstr(name, "::") || strchr(name, '(')) {
+        return;
+    }
+    if (cmd->u.proc.staticVars && Jim_FindHashEntry(cmd->u.proc.staticVars, name)) {
+        return;
+    }
+    if (JimFindLocalSlot(localSlots, name) >= 0) {
+        return;
+    }
+    if (localSlots->count == localSlots->maxNames) {
+        localSlots->maxNames = localSlots->maxNames * 2 + 4;
+        localSlots->names = Jim_Realloc(localSlots->names, sizeof(Jim_Obj *) * localSlots->maxNames);
+    }
+    Jim_IncrRefCount(nameObjPtr);
+    localSlots->names[localSlots->count++] = nameObjPtr;
+}
+
+static int JimIsWord(Jim_Obj *wordObjPtr, const char *str)
+{
+    return wordObjPtr && strcmp(Jim_String(wordObjPtr), str) == 0;
+}
+
+/**
+ * Examines the given procedure body (or nested body) for commands
+ * which create local variables with literal names, and adds each name
+ * to the slots.
+ *
+ * This need not find every local variable, and may find names which
+ * are never used. Other variables are simply stored in the vars hash table.
+ */
+static void JimScanLocalSlots(Jim_Interp *interp, Jim_LocalSlots *localSlots, Jim_Cmd *cmd,
+    Jim_Obj *bodyObjPtr, int depth)
+{
+    ScriptObj *script;
+    ScriptToken *token;
+    int i;
+
+    if (bodyObjPtr == NULL || depth > JIM_LOCALSLOTS_MAXDEPTH) {
+        return;
+    }
+    script = Jim_GetScript(interp, bodyObjPtr);
+    token = script->token;
+
+    for (i = 0; i < script->len; ) {
+        /* The literal words of this command, or NULL for other words */
+        Jim_Obj *word[JIM_LOCALSLOTS_MAXWORDS];
+        int argc = token[i].objPtr->internalRep.scriptLineValue.argc;
+        int nwords = 0;
+        int j;
+        const char *cmdname;
+
+        i++;
+        for (j = 0; j < argc; j++) {
+            long wordtokens = 1;
+            Jim_Obj *wordObjPtr = NULL;
+
+            if (token[i].type == JIM_TT_WORD) {
+                wordtokens = JimWideValue(token[i++].objPtr);
+                if (wordtokens < 0) {
+                    wordtokens = -wordtokens;
+                }
+            }
+            else if (token[i].type == JIM_TT_STR || token[i].type == JIM_TT_ESC) {
+                wordObjPtr = token[i].objPtr;
+            }
+            if (nwords < JIM_LOCALSLOTS_MAXWORDS) {
+                word[nwords++] = wordObjPtr;
+            }
+            i += wordtokens;
+        }
+
+        if (nwords == 0 || word[0] == NULL) {
+            continue;
+        }
+        cmdname = Jim_String(word[0]);
+
+        if (strcmp(cmdname, "set") == 0 || strcmp(cmdname, "incr") == 0 ||
+            strcmp(cmdname, "append") == 0 || strcmp(cmdname, "lappend") == 0) {
+            if (nwords >= 2 && word[1]) {
+                JimAddLocalSlot(interp, localSlots, cmd, word[1]);
+            }
+        }
+        else if (strcmp(cmdname, "foreach") == 0 || strcmp(cmdname, "lmap") == 0) {
+            if (nwords == argc && argc >= 4) {
+                for (j = 1; j < argc - 1; j += 2) {
+                    if (word[j]) {
+                        int k;
+                        int len = Jim_ListLength(interp, word[j]);
+                        for (k = 0; k < len; k++) {
+                            JimAddLocalSlot(interp, localSlots, cmd, Jim_ListGetIndex(interp, word[j], k));
+                        }
+                    }
+                }
+                JimScanLocalSlots(interp, localSlots, cmd, word[argc - 1], depth + 1);
+            }
+        }
+        else if (strcmp(cmdname, "loop") == 0) {
+            if (nwords == argc && argc >= 5) {
+                if (word[1]) {
+                    JimAddLocalSlot(interp, localSlots, cmd, word[1]);
+                }
+                JimScanLocalSlots(interp, localSlots, cmd, word[argc - 1], depth + 1);
+            }
+        }
+        else if (strcmp(cmdname, "lassign") == 0 || strcmp(cmdname, "global") == 0) {
+            for (j = (*cmdname == 'l') ? 2 : 1; j < nwords; j++) {
+                if (word[j]) {
+                    JimAddLocalSlot(interp, localSlots, cmd, word[j]);
+                }
+            }
+        }
+        else if (strcmp(cmdname, "upvar") == 0) {
+            /* upvar ?level? otherVar myVar ?otherVar myVar ...? */
+            for (j = (argc % 2) ? 2 : 3; j < nwords; j += 2) {
+                if (word[j]) {
+                    JimAddLocalSlot(interp, localSlots, cmd, word[j]);
+                }
+            }
+        }
+        else if (strcmp(cmdname, "while") == 0) {
+            if (argc == 3) {
+                JimScanLocalSlots(interp, localSlots, cmd, word[2], depth + 1);
+            }
+        }
+        else if (strcmp(cmdname, "for") == 0) {
+            if (argc == 5) {
+                JimScanLocalSlots(interp, localSlots, cmd, word[1], depth + 1);
+                JimScanLocalSlots(interp, localSlots, cmd, word[3], depth + 1);
+                JimScanLocalSlots(interp, localSlots, cmd, word[4], depth + 1);
+            }
+        }
+        else if (strcmp(cmdname, "catch") == 0) {
+            for (j = 1; j < nwords && word[j] && Jim_String(word[j])[0] == '-'; j++) {
+            }
+            if (j < nwords) {
+                JimScanLocalSlots(interp, localSlots, cmd, word[j], depth + 1);
+            }
+        }
+        else if (strcmp(cmdname, "if") == 0) {
+            /* if expr ?then? body ?elseif expr ?then? body ...? ?else? ?body? */
+            j = 2;
+            while (j < nwords) {
+                if (JimIsWord(word[j], "then")) {
+                    j++;
+                }
+                if (j < nwords) {
+                    JimScanLocalSlots(interp, localSlots, cmd, word[j], depth + 1);
+                }
+                j++;
+                if (j < nwords && JimIsWord(word[j], "elseif")) {
+                    j += 2;
+                }
+                else if (j < nwords && JimIsWord(word[j], "else")) {
+                    j++;
+                }
+                else {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* Returns the local variable slots for the procedure, based on its
+ * arguments and body. */
+static Jim_LocalSlots *JimCreateLocalSlots(Jim_Interp *interp, Jim_Cmd *cmd)
+{
+    int d;
+    Jim_LocalSlots *localSlots = Jim_Alloc(sizeof(*localSlots));
+
+    /* Unique with respect to call frame ids */
+    localSlots->id = interp->callFrameEpoch++;
+    localSlots->count = 0;
+    localSlots->maxNames = 0;
+    localSlots->names = NULL;
+
+    for (d = 0; d < cmd->u.proc.argListLen; d++) {
+        Jim_Obj *nameObjPtr = cmd->u.proc.arglist[d].nameObjPtr;
+
+        if (d == cmd->u.proc.argsPos && cmd->u.proc.arglist[d].defaultObjPtr) {
+            /* Renamed args */
+            nameObjPtr = cmd->u.proc.arglist[d].defaultObjPtr;
+        }
+        else if (*Jim_String(nameObjPtr) == '&') {
+            nameObjPtr = Jim_NewStringObj(interp, Jim_String(nameObjPtr) + 1, -1);
+        }
+        Jim_IncrRefCount(nameObjPtr);
+        JimAddLocalSlot(interp, localSlots, cmd, nameObjPtr);
+        Jim_DecrRefCount(interp, nameObjPtr);
+    }
+    JimScanLocalSlots(interp, localSlots, cmd, cmd->u.proc.bodyObjPtr, 0);
+
+    return localSlots;
+}
+
+static void JimFreeLocalSlots(Jim_Interp *interp, Jim_LocalSlots *localSlots)
+{
+    int i;
+
+    for (i = 0; i < localSlots->count; i++) {
+        Jim_DecrRefCount(interp, localSlots->names[i]);
+    }
+    Jim_Free(localSlots->names);
+    Jim_Free(localSlots);
+}
+
 /* Call a procedure implemented in Tcl.
  * It's possible to speed-up a lot this function, currently
  * the callframes are not cached, but allocated and
@@ -10514,6 +14402,10 @@ static int JimCallProcedure(Jim_Interp *interp, Jim_Cmd *cmd, int argc, Jim_Obj
         return JIM_ERR;
     }
 
+    if (cmd->u.proc.localSlots == NULL) {
+        cmd->u.proc.localSlots = JimCreateLocalSlots(interp, cmd);
+    }
+
     /* Create a new callframe */
     callFramePtr = JimCreateCallFrame(interp, interp->framePtr, cmd->u.proc.nsObj);
     callFramePtr->argv = argv;
@@ -10522,6 +14414,18 @@ static int JimCallProcedure(Jim_Interp *interp, Jim_Cmd *cmd, int argc, Jim_Obj
     callFramePtr->procBodyObjPtr = cmd->u.proc.bodyObjPtr;
     callFramePtr->staticVars = cmd->u.proc.staticVars;
 
+    /* All the slot variables start out unset */
+    if (cmd->u.proc.localSlots->count) {
+        int count = cmd->u.proc.localSlots->count;
+
+        if (count > callFramePtr->maxSlots) {
+            callFramePtr->slots = Jim_Realloc(callFramePtr->slots, sizeof(Jim_Var) * count);
+            callFramePtr->maxSlots = count;
+        }
+        memset(callFramePtr->slots, 0, sizeof(Jim_Var) * count);
+        callFramePtr->localSlots = cmd->u.proc.localSlots;
+    }
+
     /* Remember where we were called from. */
     script = Jim_GetScript(interp, interp->currentScriptObj);
     callFramePtr->fileNameObj = script->fileNameObj;
@@ -10984,7 +14888,7 @@ static Jim_Obj *JimHashtablePatternMatch(Jim_Interp *interp, Jim_HashTable *ht,
     else {
         Jim_HashTableIterator *htiter = Jim_GetHashTableIterator(ht);
         while ((he = Jim_NextHashEntry(htiter)) != NULL) {
-            if (patternObjPtr == NULL || JimGlobMatch(Jim_String(patternObjPtr), he->key, 0)) {
+            if (patternObjPtr == NULL || JimGlobMatchObj(interp, patternObjPtr, he->key, -1, 0)) {
                 callback(interp, listObjPtr, he, type);
             }
         }
@@ -11050,6 +14954,24 @@ static void JimVariablesMatch(Jim_Interp *interp, Jim_Obj *listObjPtr,
     }
 }
 
+/**
+ * Returns the name and value of each static of the proc, in declaration order.
+ */
+static Jim_Obj *JimStaticsList(Jim_Interp *interp, Jim_Cmd *cmdPtr)
+{
+    Jim_Obj *listObjPtr = Jim_NewListObj(interp, NULL, 0);
+    int len = Jim_ListLength(interp, cmdPtr->u.proc.staticNamesObjPtr);
+    int i;
+
+    for (i = 0; i < len; i++) {
+        Jim_Obj *nameObjPtr = Jim_ListGetIndex(interp, cmdPtr->u.proc.staticNamesObjPtr, i);
+        Jim_HashEntry *he = Jim_FindHashEntry(cmdPtr->u.proc.staticVars, Jim_String(nameObjPtr));
+
+        JimVariablesMatch(interp, listObjPtr, he, JIM_VARLIST_LOCALS | JIM_VARLIST_VALUES);
+    }
+    return listObjPtr;
+}
+
 /* mode is JIM_VARLIST_xxx */
 static Jim_Obj *JimVariablesList(Jim_Interp *interp, Jim_Obj *patternObjPtr, int mode)
 {
@@ -11060,7 +14982,31 @@ static Jim_Obj *JimVariablesList(Jim_Interp *interp, Jim_Obj *patternObjPtr, int
     }
     else {
         Jim_CallFrame *framePtr = (mode == JIM_VARLIST_GLOBALS) ? interp->topFramePtr : interp->framePtr;
-        return JimHashtablePatternMatch(interp, &framePtr->vars, patternObjPtr, JimVariablesMatch, mode);
+        Jim_Obj *listObjPtr = JimHashtablePatternMatch(interp, &framePtr->vars, patternObjPtr, JimVariablesMatch, mode);
+
+        if (framePtr->localSlots) {
+            /* Now the slot variables */
+            int i;
+
+            for (i = 0; i < framePtr->localSlots->count; i++) {
+                Jim_Var *varPtr = &framePtr->slots[i];
+                Jim_Obj *nameObjPtr = framePtr->localSlots->names[i];
+
+                if (varPtr->objPtr == NULL) {
+                    continue;
+                }
+                if (patternObjPtr && !Jim_StringMatchObj(interp, patternObjPtr, nameObjPtr, 0)) {
+                    continue;
+                }
+                if (mode != JIM_VARLIST_LOCALS || varPtr->linkFramePtr == NULL) {
+                    Jim_ListAppendElement(interp, listObjPtr, nameObjPtr);
+                    if (mode & JIM_VARLIST_VALUES) {
+                        Jim_ListAppendElement(interp, listObjPtr, varPtr->objPtr);
+                    }
+                }
+            }
+        }
+        return listObjPtr;
     }
 }
 
@@ -12010,21 +15956,51 @@ static int Jim_LlengthCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *
 }
 
 /* [lsearch] */
+/* Compares a list element with the value for lsearch -exact or -sorted, as a string
+ * or with -integer or -real, as a number. Returns JIM_ERR if either isn't a number.
+ */
+static int JimLsearchCompare(Jim_Interp *interp, int type, Jim_Obj *objPtr, Jim_Obj *valObj, int nocase, int *cmpPtr)
+{
+    if (type == JIM_LSORT_INTEGER) {
+        jim_wide lhs, rhs;
+
+        if (Jim_GetWide(interp, objPtr, &lhs) != JIM_OK || Jim_GetWide(interp, valObj, &rhs) != JIM_OK) {
+            return JIM_ERR;
+        }
+        *cmpPtr = (lhs > rhs) - (lhs < rhs);
+    }
+    else if (type == JIM_LSORT_REAL) {
+        double lhs, rhs;
+
+        if (Jim_GetDouble(interp, objPtr, &lhs) != JIM_OK || Jim_GetDouble(interp, valObj, &rhs) != JIM_OK) {
+            return JIM_ERR;
+        }
+        *cmpPtr = (lhs > rhs) - (lhs < rhs);
+    }
+    else {
+        *cmpPtr = Jim_StringCompareObj(interp, objPtr, valObj, nocase);
+    }
+    return JIM_OK;
+}
+
 static int Jim_LsearchCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
     static const char * const options[] = {
         "-bool", "-not", "-nocase", "-exact", "-glob", "-regexp", "-all", "-inline", "-command",
-            NULL
+        "-sorted", "-integer", "-real", "-decreasing", NULL
     };
     enum
     { OPT_BOOL, OPT_NOT, OPT_NOCASE, OPT_EXACT, OPT_GLOB, OPT_REGEXP, OPT_ALL, OPT_INLINE,
-            OPT_COMMAND };
+            OPT_COMMAND, OPT_SORTED, OPT_INTEGER, OPT_REAL, OPT_DECREASING };
     int i;
     int opt_bool = 0;
     int opt_not = 0;
     int opt_nocase = 0;
     int opt_all = 0;
     int opt_inline = 0;
+    int opt_sorted = 0;
+    int opt_order = 1;
+    int opt_type = JIM_LSORT_ASCII;
     int opt_match = OPT_EXACT;
     int listlen;
     int rc = JIM_OK;
@@ -12062,6 +16038,19 @@ static int Jim_LsearchCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *
             case OPT_ALL:
                 opt_all = 1;
                 break;
+            case OPT_SORTED:
+                opt_sorted = 1;
+                opt_match = OPT_EXACT;
+                break;
+            case OPT_INTEGER:
+                opt_type = JIM_LSORT_INTEGER;
+                break;
+            case OPT_REAL:
+                opt_type = JIM_LSORT_REAL;
+                break;
+            case OPT_DECREASING:
+                opt_order = -1;
+                break;
             case OPT_COMMAND:
                 if (i >= argc - 2) {
                     goto wrongargs;
@@ -12089,6 +16078,56 @@ static int Jim_LsearchCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *
     }
 
     listlen = Jim_ListLength(interp, argv[0]);
+
+    if (opt_match == OPT_EXACT && !opt_all && !opt_not &&
+            (opt_sorted || (opt_type == JIM_LSORT_ASCII && !opt_nocase))) {
+        /* Looking for the first match, so binary search a sorted list,
+         * or use the hash index for an exact string match */
+        if (opt_sorted) {
+            int lo = 0;
+            int hi = listlen;
+            int cmp = 1;
+
+            while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+
+                if (JimLsearchCompare(interp, opt_type, Jim_ListGetIndex(interp, argv[0], mid), argv[1],
+                        opt_nocase, &cmp) != JIM_OK) {
+                    rc = JIM_ERR;
+                    goto done;
+                }
+                if (cmp * opt_order < 0) {
+                    lo = mid + 1;
+                }
+                else {
+                    hi = mid;
+                }
+            }
+            if (lo < listlen && JimLsearchCompare(interp, opt_type, Jim_ListGetIndex(interp, argv[0], lo), argv[1],
+                    opt_nocase, &cmp) != JIM_OK) {
+                rc = JIM_ERR;
+                goto done;
+            }
+            i = (lo < listlen && cmp == 0) ? lo : -1;
+        }
+        else {
+            i = JimListFindExact(interp, argv[0], argv[1], 0);
+        }
+        if (i < 0) {
+            goto nomatch;
+        }
+        if (opt_bool) {
+            Jim_SetResultBool(interp, 1);
+        }
+        else if (!opt_inline) {
+            Jim_SetResultInt(interp, i);
+        }
+        else {
+            Jim_SetResult(interp, Jim_ListGetIndex(interp, argv[0], i));
+        }
+        goto done;
+    }
+
     for (i = 0; i < listlen; i++) {
         Jim_Obj *objPtr;
         int eq = 0;
@@ -12096,7 +16135,14 @@ static int Jim_LsearchCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *
         Jim_ListIndex(interp, argv[0], i, &objPtr, JIM_NONE);
         switch (opt_match) {
             case OPT_EXACT:
-                eq = Jim_StringCompareObj(interp, argv[1], objPtr, opt_nocase) == 0;
+                if (JimLsearchCompare(interp, opt_type, objPtr, argv[1], opt_nocase, &eq) != JIM_OK) {
+                    if (listObjPtr) {
+                        Jim_FreeNewObj(interp, listObjPtr);
+                    }
+                    rc = JIM_ERR;
+                    goto done;
+                }
+                eq = (eq == 0);
                 break;
 
             case OPT_GLOB:
@@ -12149,6 +16195,7 @@ static int Jim_LsearchCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *
         Jim_SetResult(interp, listObjPtr);
     }
     else {
+      nomatch:
         /* No match */
         if (opt_bool) {
             Jim_SetResultBool(interp, opt_not);
@@ -12273,10 +16320,10 @@ static int Jim_LreplaceCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const
     newListObj = Jim_NewListObj(interp, listObj->internalRep.listValue.ele, first);
 
     /* Add supplied elements */
-    ListInsertElements(newListObj, -1, argc - 4, argv + 4);
+    ListInsertElements(interp, newListObj, -1, argc - 4, argv + 4);
 
     /* Add the remaining elements */
-    ListInsertElements(newListObj, -1, len - first - rangeLen, listObj->internalRep.listValue.ele + first + rangeLen);
+    ListInsertElements(interp, newListObj, -1, len - first - rangeLen, listObj->internalRep.listValue.ele + first + rangeLen);
 
     Jim_SetResult(interp, newListObj);
     return JIM_OK;
@@ -12305,10 +16352,12 @@ static int Jim_LsetCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *arg
 static int Jim_LsortCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const argv[])
 {
     static const char * const options[] = {
-        "-ascii", "-nocase", "-increasing", "-decreasing", "-command", "-integer", "-index", NULL
+        "-ascii", "-nocase", "-increasing", "-decreasing", "-command", "-integer", "-real", "-index",
+        "-unique", NULL
     };
     enum
-    { OPT_ASCII, OPT_NOCASE, OPT_INCREASING, OPT_DECREASING, OPT_COMMAND, OPT_INTEGER, OPT_INDEX };
+    { OPT_ASCII, OPT_NOCASE, OPT_INCREASING, OPT_DECREASING, OPT_COMMAND, OPT_INTEGER, OPT_REAL,
+        OPT_INDEX, OPT_UNIQUE };
     Jim_Obj *resObj;
     int i;
     int retCode;
@@ -12323,6 +16372,7 @@ static int Jim_LsortCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const arg
     info.type = JIM_LSORT_ASCII;
     info.order = 1;
     info.indexed = 0;
+    info.unique = 0;
     info.command = NULL;
     info.interp = interp;
 
@@ -12342,6 +16392,12 @@ static int Jim_LsortCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const arg
             case OPT_INTEGER:
                 info.type = JIM_LSORT_INTEGER;
                 break;
+            case OPT_REAL:
+                info.type = JIM_LSORT_REAL;
+                break;
+            case OPT_UNIQUE:
+                info.unique = 1;
+                break;
             case OPT_INCREASING:
                 info.order = 1;
                 break;
@@ -12428,13 +16484,13 @@ static int Jim_DebugCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
 #if defined(JIM_DEBUG_COMMAND) && !defined(JIM_BOOTSTRAP)
     static const char * const options[] = {
         "refcount", "objcount", "objects", "invstr", "scriptlen", "exprlen",
-        "exprbc", "show",
+        "exprbc", "show", "cmdcache",
         NULL
     };
     enum
     {
         OPT_REFCOUNT, OPT_OBJCOUNT, OPT_OBJECTS, OPT_INVSTR, OPT_SCRIPTLEN,
-        OPT_EXPRLEN, OPT_EXPRBC, OPT_SHOW,
+        OPT_EXPRLEN, OPT_EXPRBC, OPT_SHOW, OPT_CMDCACHE,
     };
     int option;
 
@@ -12455,36 +16511,64 @@ static int Jim_DebugCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
     else if (option == OPT_OBJCOUNT) {
         int freeobj = 0, liveobj = 0;
         char buf[256];
-        Jim_Obj *objPtr;
+        Jim_ObjSlab *slab;
 
         if (argc != 2) {
             Jim_WrongNumArgs(interp, 2, argv, "");
             return JIM_ERR;
         }
-        /* Count the number of free objects. */
-        objPtr = interp->freeList;
-        while (objPtr) {
-            freeobj++;
-            objPtr = objPtr->nextObjPtr;
-        }
-        /* Count the number of live objects. */
-        objPtr = interp->liveList;
-        while (objPtr) {
-            liveobj++;
-            objPtr = objPtr->nextObjPtr;
+        /* Count the number of free and live objects. */
+        for (slab = interp->objSlabs; slab; slab = slab->next) {
+            int i;
+
+            for (i = 0; i < JIM_OBJ_SLAB_SIZE; i++) {
+                if (slab->objs[i].refCount == -1) {
+                    freeobj++;
+                }
+                else {
+                    liveobj++;
+                }
+            }
         }
         /* Set the result string and return. */
         sprintf(buf, "free %d used %d", freeobj, liveobj);
         Jim_SetResultString(interp, buf, -1);
         return JIM_OK;
     }
-    else if (option == OPT_OBJECTS) {
-        Jim_Obj *objPtr, *listObjPtr, *subListObjPtr;
+    else if (option == OPT_CMDCACHE) {
+        char buf[64];
 
-        /* Count the number of live objects. */
-        objPtr = interp->liveList;
+        if (argc != 2) {
+            Jim_WrongNumArgs(interp, 2, argv, "");
+            return JIM_ERR;
+        }
+        sprintf(buf, "hits %lu misses %lu", interp->cmdCacheHits, interp->cmdCacheMisses);
+        Jim_SetResultString(interp, buf, -1);
+        return JIM_OK;
+    }
+    else if (option == OPT_OBJECTS) {
+        Jim_Obj *listObjPtr, *subListObjPtr;
+        Jim_Obj **live;
+        Jim_ObjSlab *slab;
+        int i, count = 0;
+
+        /* Take a snapshot of the live objects first, since the objects
+         * created below are allocated from the same slabs. */
+        for (slab = interp->objSlabs; slab; slab = slab->next) {
+            count += JIM_OBJ_SLAB_SIZE;
+        }
+        live = Jim_Alloc(sizeof(*live) * (count + 1));
+        count = 0;
+        for (slab = interp->objSlabs; slab; slab = slab->next) {
+            for (i = 0; i < JIM_OBJ_SLAB_SIZE; i++) {
+                if (slab->objs[i].refCount != -1) {
+                    live[count++] = &slab->objs[i];
+                }
+            }
+        }
         listObjPtr = Jim_NewListObj(interp, NULL, 0);
-        while (objPtr) {
+        for (i = 0; i < count; i++) {
+            Jim_Obj *objPtr = live[i];
             char buf[128];
             const char *type = objPtr->typePtr ? objPtr->typePtr->name : "";
 
@@ -12495,8 +16579,8 @@ static int Jim_DebugCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
             Jim_ListAppendElement(interp, subListObjPtr, Jim_NewIntObj(interp, objPtr->refCount));
             Jim_ListAppendElement(interp, subListObjPtr, objPtr);
             Jim_ListAppendElement(interp, listObjPtr, subListObjPtr);
-            objPtr = objPtr->nextObjPtr;
         }
+        Jim_Free(live);
         Jim_SetResult(interp, listObjPtr);
         return JIM_OK;
     }
@@ -12823,7 +16907,7 @@ static int JimAliasCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 
     /* prefixListObj is a list to which the args need to be appended */
     cmdList = Jim_DuplicateObj(interp, prefixListObj);
-    ListInsertElements(cmdList, -1, argc - 1, argv + 1);
+    ListInsertElements(interp, cmdList, -1, argc - 1, argv + 1);
 
     return JimEvalObjList(interp, cmdList);
 }
@@ -13072,10 +17156,225 @@ static int Jim_GlobalCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *a
     return JIM_OK;
 }
 
-/* does the [string map] operation. On error NULL is returned,
- * otherwise a new string object with the result, having refcount = 0,
- * is returned. */
-static Jim_Obj *JimStringMap(Jim_Interp *interp, Jim_Obj *mapListObjPtr,
+/* -----------------------------------------------------------------------------
+ * String Map Object
+ *
+ * [string map] compiles the mapping list into an Aho-Corasick automaton
+ * over the (case folded, for -nocase) chars of the keys, which is kept as
+ * the internal rep of the list object. The input is then scanned once.
+ *
+ * Every key match is recorded against the char position where it starts,
+ * keeping the lowest numbered key for each position. Since no key is
+ * longer than maxLen chars, a position is final once the scan is maxLen
+ * chars past it, so only a ring of maxLen + 1 positions is needed to
+ * replay the original semantics: at each position the first key in the
+ * list which matches there wins, and scanning resumes after it.
+ * ---------------------------------------------------------------------------*/
+typedef struct JimMapNode {
+    int c;              /* Char on the edge into this node */
+    int child;          /* First child, or 0 */
+    int sibling;        /* Next sibling, or 0 */
+    int fail;           /* Node for the longest proper suffix in the trie */
+    int out;            /* Nearest node on the fail chain which ends a key, or 0 */
+    int key;            /* Index of the first key ending here, or -1 */
+    int depth;          /* Length in chars */
+} JimMapNode;
+
+typedef struct Jim_StringMap {
+    int nocase;         /* Keys were folded with utf8_upper() */
+    int maxLen;         /* Length of the longest key in chars */
+    int numNodes;
+    JimMapNode *nodes;  /* nodes[0] is the root */
+    int *keyLen;        /* Length in chars of each key */
+    int rootNext[128];  /* Transitions from the root for ASCII chars */
+    Jim_Obj *pairsObj;  /* List of keys and values */
+} Jim_StringMap;
+
+static void FreeStringMapInternalRep(Jim_Interp *interp, Jim_Obj *objPtr);
+static void DupStringMapInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr);
+static void UpdateStringOfStringMap(struct Jim_Obj *objPtr);
+
+static const Jim_ObjType stringMapObjType = {
+    "string-map",
+    FreeStringMapInternalRep,
+    DupStringMapInternalRep,
+    UpdateStringOfStringMap,
+    JIM_TYPE_NONE,
+};
+
+static void FreeStringMapInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    Jim_StringMap *map = objPtr->internalRep.ptr;
+
+    Jim_DecrRefCount(interp, map->pairsObj);
+    Jim_Free(map->nodes);
+    Jim_Free(map->keyLen);
+    Jim_Free(map);
+}
+
+static void DupStringMapInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
+{
+    JIM_NOTUSED(interp);
+    JIM_NOTUSED(srcPtr);
+
+    /* Just returns an simple string. */
+    dupPtr->typePtr = NULL;
+}
+
+static void UpdateStringOfStringMap(struct Jim_Obj *objPtr)
+{
+    Jim_StringMap *map = objPtr->internalRep.ptr;
+    int len;
+    const char *str = Jim_GetString(map->pairsObj, &len);
+
+    /* The list of keys and values has the same string rep as the original list */
+    Jim_InitStringRep(objPtr, str, len);
+}
+
+/* Returns the child of 'node' for char 'c', or 0 if none */
+static int JimMapChild(const Jim_StringMap *map, int node, int c)
+{
+    int n;
+
+    if (node == 0 && c >= 0 && c < 128) {
+        return map->rootNext[c];
+    }
+    for (n = map->nodes[node].child; n; n = map->nodes[n].sibling) {
+        if (map->nodes[n].c == c) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+/* Returns the state after 'state' on char 'c' */
+static int JimMapNext(const Jim_StringMap *map, int state, int c)
+{
+    while (1) {
+        int n = JimMapChild(map, state, c);
+        if (n || state == 0) {
+            return n;
+        }
+        state = map->nodes[state].fail;
+    }
+}
+
+static Jim_StringMap *JimGetStringMap(Jim_Interp *interp, Jim_Obj *objPtr, int nocase)
+{
+    Jim_StringMap *map;
+    Jim_Obj **elements;
+    int numMaps, i, head, tail;
+    int *queue;
+    int maxNodes = 1;
+
+    if (objPtr->typePtr == &stringMapObjType) {
+        map = objPtr->internalRep.ptr;
+        if (map->nocase == nocase) {
+            return map;
+        }
+    }
+
+    numMaps = Jim_ListLength(interp, objPtr);
+    if (numMaps % 2) {
+        Jim_SetResultString(interp, "list must contain an even number of elements", -1);
+        return NULL;
+    }
+
+    map = Jim_Alloc(sizeof(*map));
+    memset(map, 0, sizeof(*map));
+    map->nocase = nocase;
+    map->keyLen = Jim_Alloc(sizeof(*map->keyLen) * (numMaps / 2 + 1));
+    elements = Jim_Alloc(sizeof(*elements) * (numMaps + 1));
+    for (i = 0; i < numMaps; i++) {
+        elements[i] = Jim_ListGetIndex(interp, objPtr, i);
+        if (i % 2 == 0) {
+            /* No more nodes than key bytes */
+            maxNodes += Jim_Length(elements[i]);
+        }
+    }
+    map->pairsObj = Jim_NewListObj(interp, elements, numMaps);
+    Jim_IncrRefCount(map->pairsObj);
+    Jim_Free(elements);
+
+    /* Build the trie of keys */
+    map->numNodes = 1;
+    map->nodes = Jim_Alloc(sizeof(*map->nodes) * maxNodes);
+    memset(map->nodes, 0, sizeof(*map->nodes));
+    map->nodes[0].key = -1;
+    for (i = 0; i < numMaps / 2; i++) {
+        int len;
+        const char *k = Jim_GetString(Jim_ListGetIndex(interp, map->pairsObj, i * 2), &len);
+        int node = 0;
+        int depth = 0;
+
+        while (len > 0) {
+            int c;
+            int l = utf8_tounicode_case(k, &c, nocase);
+            int n = JimMapChild(map, node, c);
+
+            if (n == 0) {
+                n = map->numNodes++;
+                memset(&map->nodes[n], 0, sizeof(*map->nodes));
+                map->nodes[n].c = c;
+                map->nodes[n].key = -1;
+                map->nodes[n].depth = depth + 1;
+                map->nodes[n].sibling = map->nodes[node].child;
+                map->nodes[node].child = n;
+                if (node == 0 && c >= 0 && c < 128) {
+                    map->rootNext[c] = n;
+                }
+            }
+            node = n;
+            depth++;
+            k += l;
+            len -= l;
+        }
+        map->keyLen[i] = depth;
+        /* Empty keys never match, and the first of any duplicate keys wins */
+        if (node && map->nodes[node].key < 0) {
+            map->nodes[node].key = i;
+        }
+        if (depth > map->maxLen) {
+            map->maxLen = depth;
+        }
+    }
+
+    /* Set the fail and out links breadth first, so that each node's
+     * fail node is done before the node itself */
+    queue = Jim_Alloc(sizeof(*queue) * map->numNodes);
+    head = tail = 0;
+    for (i = map->nodes[0].child; i; i = map->nodes[i].sibling) {
+        queue[tail++] = i;
+    }
+    while (head < tail) {
+        int node = queue[head++];
+
+        for (i = map->nodes[node].child; i; i = map->nodes[i].sibling) {
+            JimMapNode *child = &map->nodes[i];
+            int fail = JimMapNext(map, map->nodes[node].fail, child->c);
+
+            child->fail = fail;
+            child->out = map->nodes[fail].key >= 0 ? fail : map->nodes[fail].out;
+            queue[tail++] = i;
+        }
+    }
+    Jim_Free(queue);
+
+    Jim_FreeIntRep(interp, objPtr);
+    objPtr->typePtr = &stringMapObjType;
+    objPtr->internalRep.ptr = map;
+    return map;
+}
+
+/* Keys up to this many chars don't need to allocate the ring */
+#define JIM_MAP_STATIC_RING 32
+
+/* Smaller jobs than this (chars * keys) are done directly rather than
+ * compiling the list, unless it is already compiled */
+#define JIM_MAP_COMPILE_MIN 256
+
+/* Tries each key at each char position of 'objPtr' */
+static Jim_Obj *JimStringMapDirect(Jim_Interp *interp, Jim_Obj *mapListObjPtr,
     Jim_Obj *objPtr, int nocase)
 {
     int numMaps;
@@ -13084,11 +17383,6 @@ static Jim_Obj *JimStringMap(Jim_Interp *interp, Jim_Obj *mapListObjPtr,
     Jim_Obj *resultObjPtr;
 
     numMaps = Jim_ListLength(interp, mapListObjPtr);
-    if (numMaps % 2) {
-        Jim_SetResultString(interp, "list must contain an even number of elements", -1);
-        return NULL;
-    }
-
     str = Jim_String(objPtr);
     strLen = Jim_Utf8Length(interp, objPtr);
 
@@ -13134,6 +17428,95 @@ static Jim_Obj *JimStringMap(Jim_Interp *interp, Jim_Obj *mapListObjPtr,
     return resultObjPtr;
 }
 
+/* does the [string map] operation. On error NULL is returned,
+ * otherwise a new string object with the result, having refcount = 0,
+ * is returned. */
+static Jim_Obj *JimStringMap(Jim_Interp *interp, Jim_Obj *mapListObjPtr,
+    Jim_Obj *objPtr, int nocase)
+{
+    Jim_StringMap *map;
+    const char *str;
+    int len, pos;
+    int state = 0;
+    int i = 0;          /* Index of the char being scanned */
+    int final = 0;      /* The next position to be resolved */
+    int next = 0;       /* Position where the next match may start */
+    int noMatchStart = 0;
+    int ringSize;
+    int *best;          /* Lowest key matching at each position in the ring */
+    int *offset;        /* Byte offset of each position in the ring */
+    int ring[2 * JIM_MAP_STATIC_RING];
+    Jim_Obj *resultObjPtr;
+
+    str = Jim_GetString(objPtr, &len);
+    if (mapListObjPtr->typePtr != &stringMapObjType) {
+        int numMaps = Jim_ListLength(interp, mapListObjPtr);
+
+        if (numMaps % 2) {
+            Jim_SetResultString(interp, "list must contain an even number of elements", -1);
+            return NULL;
+        }
+        if ((jim_wide)len * numMaps < JIM_MAP_COMPILE_MIN * 2) {
+            return JimStringMapDirect(interp, mapListObjPtr, objPtr, nocase);
+        }
+    }
+    map = JimGetStringMap(interp, mapListObjPtr, nocase);
+    if (map == NULL) {
+        return NULL;
+    }
+    if (map->maxLen == 0) {
+        return Jim_NewStringObj(interp, str, len);
+    }
+    ringSize = map->maxLen + 1;
+    best = ringSize <= JIM_MAP_STATIC_RING ? ring : Jim_Alloc(sizeof(*best) * ringSize * 2);
+    offset = best + ringSize;
+    offset[0] = 0;
+
+    resultObjPtr = Jim_NewStringObj(interp, "", 0);
+    for (pos = 0; final < i || pos < len; ) {
+        if (pos < len) {
+            int c;
+            int node;
+
+            pos += utf8_tounicode_case(str + pos, &c, nocase);
+            best[i % ringSize] = -1;
+            state = JimMapNext(map, state, c);
+            node = map->nodes[state].key >= 0 ? state : map->nodes[state].out;
+            for (; node; node = map->nodes[node].out) {
+                int *b = &best[(i - map->nodes[node].depth + 1) % ringSize];
+                if (*b < 0 || map->nodes[node].key < *b) {
+                    *b = map->nodes[node].key;
+                }
+            }
+            offset[++i % ringSize] = pos;
+            if (i - final < map->maxLen) {
+                /* Not yet sure of any more positions */
+                continue;
+            }
+        }
+
+        /* Position 'final' can't be matched by any later key */
+        if (final == next && best[final % ringSize] >= 0) {
+            int key = best[final % ringSize];
+
+            Jim_AppendString(interp, resultObjPtr, str + noMatchStart, offset[final % ringSize] - noMatchStart);
+            Jim_AppendObj(interp, resultObjPtr, Jim_ListGetIndex(interp, map->pairsObj, key * 2 + 1));
+            next = final + map->keyLen[key];
+            noMatchStart = offset[next % ringSize];
+        }
+        else if (final == next) {
+            next++;
+        }
+        final++;
+    }
+    Jim_AppendString(interp, resultObjPtr, str + noMatchStart, len - noMatchStart);
+
+    if (best != ring) {
+        Jim_Free(best);
+    }
+    return resultObjPtr;
+}
+
 /* [string] */
 static int Jim_StringCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
@@ -13347,7 +17730,7 @@ static int Jim_StringCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *a
                 }
                 else {
                     int c;
-                    int i = utf8_index(str, idx);
+                    int i = JimStringUtf8Offset(interp, argv[2], idx);
                     Jim_SetResultString(interp, str + i, utf8_tounicode(str + i, &c));
                 }
                 return JIM_OK;
@@ -13362,9 +17745,8 @@ static int Jim_StringCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *a
                     Jim_WrongNumArgs(interp, 2, argv, "subString string ?index?");
                     return JIM_ERR;
                 }
-                s1 = Jim_String(argv[2]);
+                s1 = Jim_GetString(argv[2], &l1);
                 s2 = Jim_String(argv[3]);
-                l1 = Jim_Utf8Length(interp, argv[2]);
                 l2 = Jim_Utf8Length(interp, argv[3]);
                 if (argc == 5) {
                     if (Jim_GetIndex(interp, argv[4], &idx) != JIM_OK) {
@@ -13375,12 +17757,19 @@ static int Jim_StringCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *a
                 else if (option == OPT_LAST) {
                     idx = l2;
                 }
+                if (idx < 0) {
+                    idx = 0;
+                }
+                else if (idx > l2) {
+                    idx = l2;
+                }
                 if (option == OPT_FIRST) {
-                    Jim_SetResultInt(interp, JimStringFirst(s1, l1, s2, l2, idx));
+                    Jim_SetResultInt(interp, JimStringFirstObj(interp, argv[2], argv[3], idx));
                 }
                 else {
 #ifdef JIM_UTF8
-                    Jim_SetResultInt(interp, JimStringLastUtf8(s1, l1, s2, idx));
+                    int n = JimStringLast(s1, l1, s2, JimStringUtf8Offset(interp, argv[3], idx));
+                    Jim_SetResultInt(interp, n > 0 ? JimStringUtf8CharIndex(interp, argv[3], n) : n);
 #else
                     Jim_SetResultInt(interp, JimStringLast(s1, l1, s2, idx));
 #endif
@@ -13670,22 +18059,35 @@ static int Jim_SetrefCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *a
     return JIM_OK;
 }
 
-/* [collect] */
+/* [collect ?-step|-stats?] */
 static int Jim_CollectCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
-    if (argc != 1) {
-        Jim_WrongNumArgs(interp, 1, argv, "");
+    static const char * const options[] = {
+        "-step", "-stats", NULL
+    };
+    enum { OPT_STEP, OPT_STATS };
+    int option;
+
+    if (argc > 2) {
+        Jim_WrongNumArgs(interp, 1, argv, "?-step|-stats?");
         return JIM_ERR;
     }
-    Jim_SetResultInt(interp, Jim_Collect(interp));
+    if (argc == 1) {
+        Jim_SetResultInt(interp, Jim_Collect(interp));
 
-    /* Free all the freed objects. */
-    while (interp->freeList) {
-        Jim_Obj *nextObjPtr = interp->freeList->nextObjPtr;
-        Jim_Free(interp->freeList);
-        interp->freeList = nextObjPtr;
+        /* Release any slabs that no longer hold live objects. */
+        JimReleaseObjSlabs(interp);
+        return JIM_OK;
+    }
+    if (Jim_GetEnum(interp, argv[1], options, &option, NULL, JIM_ERRMSG) != JIM_OK) {
+        return JIM_ERR;
+    }
+    if (option == OPT_STEP) {
+        Jim_SetResultInt(interp, JimCollectStep(interp));
+    }
+    else {
+        Jim_SetResult(interp, JimCollectStats(interp));
     }
-
     return JIM_OK;
 }
 
@@ -13753,33 +18155,31 @@ static int Jim_RenameCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *a
 
 #define JIM_DICTMATCH_VALUES 0x0001
 
-typedef void JimDictMatchCallbackType(Jim_Interp *interp, Jim_Obj *listObjPtr, Jim_HashEntry *he, int type);
+typedef void JimDictMatchCallbackType(Jim_Interp *interp, Jim_Obj *listObjPtr, Jim_Obj **pair, int type);
 
-static void JimDictMatchKeys(Jim_Interp *interp, Jim_Obj *listObjPtr, Jim_HashEntry *he, int type)
+static void JimDictMatchKeys(Jim_Interp *interp, Jim_Obj *listObjPtr, Jim_Obj **pair, int type)
 {
-    Jim_ListAppendElement(interp, listObjPtr, (Jim_Obj *)he->key);
+    Jim_ListAppendElement(interp, listObjPtr, pair[0]);
     if (type & JIM_DICTMATCH_VALUES) {
-        Jim_ListAppendElement(interp, listObjPtr, (Jim_Obj *)he->u.val);
+        Jim_ListAppendElement(interp, listObjPtr, pair[1]);
     }
 }
 
 /**
  * Like JimHashtablePatternMatch, but for dictionaries.
  */
-static Jim_Obj *JimDictPatternMatch(Jim_Interp *interp, Jim_HashTable *ht, Jim_Obj *patternObjPtr,
+static Jim_Obj *JimDictPatternMatch(Jim_Interp *interp, Jim_Obj *dictPtr, Jim_Obj *patternObjPtr,
     JimDictMatchCallbackType *callback, int type)
 {
-    Jim_HashEntry *he;
     Jim_Obj *listObjPtr = Jim_NewListObj(interp, NULL, 0);
+    int i, len;
+    Jim_Obj **table = JimDictPairs(dictPtr, &len);
 
-    /* Check for the non-pattern case. We can do this much more efficiently. */
-    Jim_HashTableIterator *htiter = Jim_GetHashTableIterator(ht);
-    while ((he = Jim_NextHashEntry(htiter)) != NULL) {
-        if (patternObjPtr == NULL || JimGlobMatch(Jim_String(patternObjPtr), Jim_String((Jim_Obj *)he->key), 0)) {
-            callback(interp, listObjPtr, he, type);
+    for (i = 0; i < len; i += 2) {
+        if (patternObjPtr == NULL || Jim_StringMatchObj(interp, patternObjPtr, table[i], 0)) {
+            callback(interp, listObjPtr, &table[i], type);
         }
     }
-    Jim_FreeHashTableIterator(htiter);
 
     return listObjPtr;
 }
@@ -13790,7 +18190,7 @@ int Jim_DictKeys(Jim_Interp *interp, Jim_Obj *objPtr, Jim_Obj *patternObjPtr)
     if (SetDictFromAny(interp, objPtr) != JIM_OK) {
         return JIM_ERR;
     }
-    Jim_SetResult(interp, JimDictPatternMatch(interp, objPtr->internalRep.ptr, patternObjPtr, JimDictMatchKeys, 0));
+    Jim_SetResult(interp, JimDictPatternMatch(interp, objPtr, patternObjPtr, JimDictMatchKeys, 0));
     return JIM_OK;
 }
 
@@ -13799,7 +18199,7 @@ int Jim_DictValues(Jim_Interp *interp, Jim_Obj *objPtr, Jim_Obj *patternObjPtr)
     if (SetDictFromAny(interp, objPtr) != JIM_OK) {
         return JIM_ERR;
     }
-    Jim_SetResult(interp, JimDictPatternMatch(interp, objPtr->internalRep.ptr, patternObjPtr, JimDictMatchKeys, JIM_DICTMATCH_VALUES));
+    Jim_SetResult(interp, JimDictPatternMatch(interp, objPtr, patternObjPtr, JimDictMatchKeys, JIM_DICTMATCH_VALUES));
     return JIM_OK;
 }
 
@@ -13808,7 +18208,7 @@ int Jim_DictSize(Jim_Interp *interp, Jim_Obj *objPtr)
     if (SetDictFromAny(interp, objPtr) != JIM_OK) {
         return -1;
     }
-    return ((Jim_HashTable *)objPtr->internalRep.ptr)->used;
+    return ((Jim_Dict *)objPtr->internalRep.ptr)->count;
 }
 
 /* [dict] */
@@ -13817,11 +18217,12 @@ static int Jim_DictCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *arg
     Jim_Obj *objPtr;
     int option;
     static const char * const options[] = {
-        "create", "get", "set", "unset", "exists", "keys", "merge", "size", "with", NULL
+        "create", "get", "set", "unset", "exists", "keys", "merge", "size", "with", "intern", NULL
     };
     enum
     {
         OPT_CREATE, OPT_GET, OPT_SET, OPT_UNSET, OPT_EXIST, OPT_KEYS, OPT_MERGE, OPT_SIZE, OPT_WITH,
+        OPT_INTERN
     };
 
     if (argc < 2) {
@@ -13923,6 +18324,30 @@ static int Jim_DictCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *arg
             objPtr = Jim_NewDictObj(interp, argv + 2, argc - 2);
             Jim_SetResult(interp, objPtr);
             return JIM_OK;
+
+        case OPT_INTERN: {
+            Jim_Obj **table;
+            int i, len;
+
+            if (argc != 3) {
+                Jim_WrongNumArgs(interp, 2, argv, "dictionary");
+                return JIM_ERR;
+            }
+            if (Jim_DictPairs(interp, argv[2], &table, &len) != JIM_OK) {
+                return JIM_ERR;
+            }
+            for (i = 0; i < len; i += 2) {
+                table[i] = Jim_InternObj(interp, table[i]);
+                Jim_IncrRefCount(table[i]);
+            }
+            objPtr = Jim_NewDictObj(interp, table, len);
+            for (i = 0; i < len; i += 2) {
+                Jim_DecrRefCount(interp, table[i]);
+            }
+            Jim_Free(table);
+            Jim_SetResult(interp, objPtr);
+            return JIM_OK;
+        }
     }
     return JIM_ERR;
 }
@@ -14163,9 +18588,7 @@ static int Jim_InfoCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *arg
                         break;
                     case INFO_STATICS:
                         if (cmdPtr->u.proc.staticVars) {
-                            int mode = JIM_VARLIST_LOCALS | JIM_VARLIST_VALUES;
-                            Jim_SetResult(interp, JimHashtablePatternMatch(interp, cmdPtr->u.proc.staticVars,
-                                NULL, JimVariablesMatch, mode));
+                            Jim_SetResult(interp, JimStaticsList(interp, cmdPtr));
                         }
                         break;
                 }
@@ -14315,6 +18738,7 @@ static int Jim_SplitCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
     Jim_Obj *resObjPtr;
     int c;
     int len;
+    int splitBytes;
 
     if (argc != 2 && argc != 3) {
         Jim_WrongNumArgs(interp, 1, argv, "string ?splitChars?");
@@ -14331,9 +18755,10 @@ static int Jim_SplitCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
     if (argc == 2) {
         splitChars = " \n\t\r";
         splitLen = 4;
+        splitBytes = 4;
     }
     else {
-        splitChars = Jim_String(argv[2]);
+        splitChars = Jim_GetString(argv[2], &splitBytes);
         splitLen = Jim_Utf8Length(interp, argv[2]);
     }
 
@@ -14341,7 +18766,36 @@ static int Jim_SplitCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
     resObjPtr = Jim_NewListObj(interp, NULL, 0);
 
     /* Split */
-    if (splitLen) {
+    if (splitLen && JimIsAscii(splitChars, splitBytes)) {
+        /* An ASCII byte is always a whole char, so the string can be scanned
+         * bytewise against a table of the split chars */
+        const char *end = str + len;
+        const char *p;
+        char isSplit[256];
+
+        if (splitBytes == 1) {
+            /* Use memchr(), which is usually vectorised */
+            while ((p = memchr(str, splitChars[0], end - str)) != NULL) {
+                Jim_ListAppendElement(interp, resObjPtr, Jim_NewStringObj(interp, str, p - str));
+                str = p + 1;
+            }
+            Jim_ListAppendElement(interp, resObjPtr, Jim_NewStringObj(interp, str, end - str));
+        }
+        else {
+            memset(isSplit, 0, sizeof(isSplit));
+            while (splitBytes--) {
+                isSplit[(unsigned char)splitChars[splitBytes]] = 1;
+            }
+            for (p = str; p < end; p++) {
+                if (isSplit[(unsigned char)*p]) {
+                    Jim_ListAppendElement(interp, resObjPtr, Jim_NewStringObj(interp, noMatchStart, p - noMatchStart));
+                    noMatchStart = p + 1;
+                }
+            }
+            Jim_ListAppendElement(interp, resObjPtr, Jim_NewStringObj(interp, noMatchStart, end - noMatchStart));
+        }
+    }
+    else if (splitLen) {
         Jim_Obj *objPtr;
         while (strLen--) {
             const char *sc = splitChars;
@@ -14561,7 +19015,7 @@ static int Jim_LrepeatCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *
 
     objPtr = Jim_NewListObj(interp, argv, argc);
     while (--count) {
-        ListInsertElements(objPtr, -1, argc, argv);
+        ListInsertElements(interp, objPtr, -1, argc, argv);
     }
 
     Jim_SetResult(interp, objPtr);
@@ -14666,7 +19120,7 @@ static int Jim_LreverseCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const
     len--;
     revObjPtr = Jim_NewListObj(interp, NULL, 0);
     while (len >= 0)
-        ListAppendElement(revObjPtr, ele[len--]);
+        ListAppendElement(interp, revObjPtr, ele[len--]);
     Jim_SetResult(interp, revObjPtr);
     return JIM_OK;
 }
@@ -14725,7 +19179,7 @@ static int Jim_RangeCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
     }
     objPtr = Jim_NewListObj(interp, NULL, 0);
     for (i = 0; i < len; i++)
-        ListAppendElement(objPtr, Jim_NewIntObj(interp, start + i * step));
+        ListAppendElement(interp, objPtr, Jim_NewIntObj(interp, start + i * step));
     Jim_SetResult(interp, objPtr);
     return JIM_OK;
 }
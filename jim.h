@@ -143,6 +143,14 @@ extern "C" {
 #define JIM_MAX_CALLFRAME_DEPTH 1000 /* default max nesting depth for procs */
 #define JIM_MAX_EVAL_DEPTH 2000 /* default max nesting depth for eval */
 
+/* Jim_NewIntObj() returns shared objects for integers in this range */
+#ifndef JIM_SMALLINT_MIN
+#define JIM_SMALLINT_MIN -256
+#endif
+#ifndef JIM_SMALLINT_MAX
+#define JIM_SMALLINT_MAX 4096
+#endif
+
 /* Some function get an integer argument with flags to change
  * the behaviour. */
 #define JIM_NONE 0    /* no flags set */
@@ -203,7 +211,7 @@ typedef struct Jim_HashEntry {
         void *val;
         int intval;
     } u;
-    struct Jim_HashEntry *next;
+    unsigned int hash;          /* Hash of the key */
 } Jim_HashEntry;
 
 typedef struct Jim_HashTableType {
@@ -213,22 +221,33 @@ typedef struct Jim_HashTableType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    /* If set, used instead of hashFunction, with the table's seed as the initial hash state */
+    unsigned int (*seededHashFunction)(const void *key, unsigned int seed);
 } Jim_HashTableType;
 
 typedef struct Jim_HashTable {
-    Jim_HashEntry **table;
+    Jim_HashEntry *table;       /* Open addressed table of entries */
     const Jim_HashTableType *type;
     unsigned int size;
     unsigned int sizemask;
     unsigned int used;
     unsigned int collisions;
     void *privdata;
+    unsigned int uniq;          /* Seed for the hash of every key, if the type has a seededHashFunction */
+    unsigned int deleted;       /* Number of deleted entries still occupying slots */
+    Jim_HashEntry *oldtable;    /* While resizing, the table whose entries are being migrated */
+    unsigned int oldsize;
+    unsigned int oldused;       /* Number of entries not yet migrated from oldtable */
+    unsigned int rehashidx;     /* Next slot of oldtable to migrate */
+    int iterators;              /* Number of active iterators. Migration is suspended while non-zero */
+    unsigned int rebuilds;      /* Times table was rebuilt while migration was suspended */
 } Jim_HashTable;
 
 typedef struct Jim_HashTableIterator {
     Jim_HashTable *ht;
     int index;
     Jim_HashEntry *entry, *nextEntry;
+    unsigned int rebuilds;      /* ht->rebuilds when the iterator was created */
 } Jim_HashTableIterator;
 
 /* This is the initial size of every hash table */
@@ -262,7 +281,9 @@ typedef struct Jim_HashTableIterator {
         (ht)->type->keyCompare((ht)->privdata, key1, key2) : \
         (key1) == (key2))
 
-#define Jim_HashKey(ht, key) (ht)->type->hashFunction(key)
+#define Jim_HashKey(ht, key) ((ht)->type->seededHashFunction ? \
+        (ht)->type->seededHashFunction(key, (ht)->uniq) : \
+        (ht)->type->hashFunction(key))
 
 #define Jim_GetHashEntryKey(he) ((he)->key)
 #define Jim_GetHashEntryVal(he) ((he)->val)
@@ -275,19 +296,23 @@ typedef struct Jim_HashTableIterator {
  * ---------------------------------------------------------------------------*/
 
 /* -----------------------------------------------------------------------------
- * Jim object. This is mostly the same as Tcl_Obj itself,
- * with the addition of the 'prev' and 'next' pointers.
- * In Jim all the objects are stored into a linked list for GC purposes,
+ * Jim object. This is mostly the same as Tcl_Obj itself.
+ * In Jim all the objects are allocated from per-interpreter slabs,
  * so that it's possible to access every object living in a given interpreter
- * sequentially. When an object is freed, it's moved into a different
+ * sequentially for GC purposes. When an object is freed, it's moved into a
  * linked list, used as object pool.
  *
  * The refcount of a freed object is always -1.
+ *
+ * String representations shorter than JIM_OBJ_INLINE_BYTES bytes are
+ * stored in the object itself (inlineBytes) rather than separately allocated.
  * ---------------------------------------------------------------------------*/
+#define JIM_OBJ_INLINE_BYTES 19
+
 typedef struct Jim_Obj {
     int refCount; /* reference count */
-    char *bytes; /* string representation buffer. NULL = no string repr. */
     int length; /* number of bytes in 'bytes', not including the null term. */
+    char *bytes; /* string representation buffer. NULL = no string repr. */
     const struct Jim_ObjType *typePtr; /* object type. */
     /* Internal representation union */
     union {
@@ -309,10 +334,11 @@ typedef struct Jim_Obj {
             unsigned long callFrameId; /* for caching */
             struct Jim_Var *varPtr;
             int global; /* If the variable name is globally scoped with :: */
+            int slot; /* Local variable slot, or -1. If >= 0, callFrameId is the slots id */
         } varValue;
         /* Command object */
         struct {
-            unsigned long procEpoch; /* for caching */
+            unsigned long procEpoch; /* cmdPtr->cmdEpoch + interp->procEpoch when cached */
             struct Jim_Obj *nsObj;
             struct Jim_Cmd *cmdPtr;
         } cmdValue;
@@ -321,11 +347,13 @@ typedef struct Jim_Obj {
             struct Jim_Obj **ele;    /* Elements vector */
             int len;        /* Length */
             int maxLen;        /* Allocated 'ele' length */
+            struct Jim_ListStore *store; /* If set, 'ele' is a slice of these shared elements */
         } listValue;
         /* String type */
         struct {
             int maxLength;
             int charLength;     /* utf-8 char length. -1 if unknown */
+            struct Jim_Utf8Index *utf8Index; /* Char to byte offset index for long strings, or NULL */
         } strValue;
         /* Reference type */
         struct {
@@ -350,13 +378,13 @@ typedef struct Jim_Obj {
         struct {
             int line;
             int argc;
+            int op;     /* Specialised opcode for this command, or 0 */
         } scriptLineValue;
     } internalRep;
-    /* This are 8 or 16 bytes more for every object
-     * but this is required for efficient garbage collection
-     * of Jim references. */
-    struct Jim_Obj *prevObjPtr; /* pointer to the prev object. */
-    struct Jim_Obj *nextObjPtr; /* pointer to the next object. */
+    unsigned int hash; /* If non-zero, the object is interned and this is the
+                          hash of its string rep with the interpreter's hashSeed */
+    char inlineBytes[JIM_OBJ_INLINE_BYTES]; /* 'bytes' for short strings */
+    unsigned char gcFlags; /* Used by the reference collector */
 } Jim_Obj;
 
 /* Jim_Obj related macros */
@@ -369,12 +397,10 @@ typedef struct Jim_Obj {
 
 /* This macro is used when we allocate a new object using
  * Jim_New...Obj(), but for some error we need to destroy it.
- * Instead to use Jim_IncrRefCount() + Jim_DecrRefCount() we
- * can just call Jim_FreeNewObj. To call Jim_Free directly
- * seems too raw, the object handling may change and we want
- * that Jim_FreeNewObj() can be called only against objects
- * that are belived to have refcount == 0. */
-#define Jim_FreeNewObj Jim_FreeObj
+ * Note that Jim_NewIntObj() may return a shared object, so
+ * this releases a reference rather than freeing the object directly. */
+#define Jim_FreeNewObj(interp, objPtr) \
+    do { Jim_IncrRefCount(objPtr); Jim_DecrRefCount(interp, objPtr); } while (0)
 
 /* Free the internal representation of the object. */
 #define Jim_FreeIntRep(i,o) \
@@ -447,6 +473,9 @@ typedef struct Jim_CallFrame {
     Jim_Obj *fileNameObj;       /* file and line of caller of this proc (if available) */
     int line;
     Jim_Stack *localCommands; /* commands to be destroyed when the call frame is destroyed */
+    struct Jim_LocalSlots *localSlots; /* Local variable slots of the running procedure, or NULL */
+    struct Jim_Var *slots; /* Storage for local variable slots */
+    int maxSlots; /* Allocated length of 'slots' */
 } Jim_CallFrame;
 
 /* The var structure. It just holds the pointer of the referenced
@@ -473,6 +502,8 @@ typedef void (*Jim_DelCmdProc)(struct Jim_Interp *interp, void *privData);
  * two objects referenced by arglistObjPtr and bodyoObjPtr. */
 typedef struct Jim_Cmd {
     int inUse;           /* Reference count */
+    int cacheRefs;       /* Number of command objects caching this command */
+    unsigned long cmdEpoch; /* Incremented when cached lookups of this command become invalid */
     int isproc;          /* Is this a procedure? */
     struct Jim_Cmd *prevCmd;    /* Previous command defn if cmd created 'local' */
     union {
@@ -487,6 +518,7 @@ typedef struct Jim_Cmd {
             Jim_Obj *argListObjPtr;
             Jim_Obj *bodyObjPtr;
             Jim_HashTable *staticVars;  /* Static vars hash table. NULL if no statics. */
+            Jim_Obj *staticNamesObjPtr; /* Names of the statics in declaration order */
             int argListLen;             /* Length of argListObjPtr */
             int reqArity;               /* Number of required parameters */
             int optArity;               /* Number of optional parameters */
@@ -497,6 +529,7 @@ typedef struct Jim_Cmd {
                 Jim_Obj *defaultObjPtr; /* Default value, (or rename for $args) */
             } *arglist;
             Jim_Obj *nsObj;             /* Namespace for this proc */
+            struct Jim_LocalSlots *localSlots; /* Local variable slots. Created on first call */
         } proc;
     } u;
 } Jim_Cmd;
@@ -529,28 +562,37 @@ typedef struct Jim_Interp {
     Jim_CallFrame *framePtr; /* Pointer to the current call frame */
     Jim_CallFrame *topFramePtr; /* toplevel/global frame pointer. */
     struct Jim_HashTable commands; /* Commands hash table */
-    unsigned long procEpoch; /* Incremented every time the result
-                of procedures names lookup caching
-                may no longer be valid. */
+    unsigned long procEpoch; /* Incremented to invalidate every cached
+                command lookup. Changes to a single command
+                increment the cmdEpoch of that command instead. */
+    unsigned long cmdCacheHits; /* Command lookups satisfied by the cache */
+    unsigned long cmdCacheMisses; /* Command lookups which required a hash table lookup */
     unsigned long callFrameEpoch; /* Incremented every time a new
                 callframe is created. This id is used for the
                 'ID' field contained in the Jim_CallFrame
                 structure. */
     int local; /* If 'local' is in effect, newly defined procs keep a reference to the old defn */
-    Jim_Obj *liveList; /* Linked list of all the live objects. */
+    struct Jim_ObjSlab *objSlabs; /* Linked list of the slabs holding every object. */
     Jim_Obj *freeList; /* Linked list of all the unused objects. */
+    int freeObjCount; /* Number of objects in freeList */
+    int freeObjLimit; /* Unused slabs are released once freeObjCount exceeds this */
     Jim_Obj *currentScriptObj; /* Script currently in execution. */
     Jim_Obj *emptyObj; /* Shared empty string object. */
     Jim_Obj *trueObj; /* Shared true int object. */
     Jim_Obj *falseObj; /* Shared false int object. */
     unsigned long referenceNextId; /* Next id for reference. */
     struct Jim_HashTable references; /* References hash table. */
+    struct Jim_HashTable interned; /* Interned strings (see Jim_InternString()) */
+    struct Jim_Obj **smallInts; /* Shared small integer objects, created as needed */
+    int internPurgeSize; /* Unused interned strings are purged when the table grows this big */
     unsigned long lastCollectId; /* reference max Id of the last GC
                 execution. It's set to -1 while the collection
                 is running as sentinel to avoid to recursive
                 calls via the [collect] command inside
                 finalizers. */
     time_t lastCollectTime; /* unix time of the last GC execution */
+    struct Jim_GcState *gcState; /* State and statistics of the incremental
+                reference collector. */
     Jim_Obj *stackTrace; /* Stack trace object. */
     Jim_Obj *errorProc; /* Name of last procedure which returned an error */
     Jim_Obj *unknown; /* Unknown command cache */
@@ -563,6 +605,7 @@ typedef struct Jim_Interp {
     struct Jim_CallFrame *freeFramesList; /* list of CallFrame structures. */
     struct Jim_HashTable assocData; /* per-interp storage for use by packages */
     Jim_PrngState *prngState; /* per interpreter Random Number Gen. state. */
+    unsigned int hashSeed; /* Random seed for hash tables with untrusted keys */
     struct Jim_HashTable packages; /* Provided packages hash table */
     Jim_Stack *loadHandles; /* handles of loaded modules [load] */
 } Jim_Interp;
@@ -618,9 +661,6 @@ typedef struct Jim_Reference {
  * linked itself, and to load extensions compiled with different
  * versions of Jim (as long as the API is still compatible.) */
 
-/* Macros are common for core and extensions */
-#define Jim_FreeHashTableIterator(iter) Jim_Free(iter)
-
 #define JIM_EXPORT
 
 /* Memory allocation */
@@ -684,11 +724,15 @@ JIM_EXPORT Jim_HashTableIterator *Jim_GetHashTableIterator
         (Jim_HashTable *ht);
 JIM_EXPORT Jim_HashEntry * Jim_NextHashEntry
         (Jim_HashTableIterator *iter);
+JIM_EXPORT void Jim_FreeHashTableIterator(Jim_HashTableIterator *iter);
 
 /* objects */
 JIM_EXPORT Jim_Obj * Jim_NewObj (Jim_Interp *interp);
 JIM_EXPORT void Jim_FreeObj (Jim_Interp *interp, Jim_Obj *objPtr);
 JIM_EXPORT void Jim_InvalidateStringRep (Jim_Obj *objPtr);
+JIM_EXPORT Jim_Obj * Jim_InternString (Jim_Interp *interp,
+        const char *str, int len);
+JIM_EXPORT Jim_Obj * Jim_InternObj (Jim_Interp *interp, Jim_Obj *objPtr);
 JIM_EXPORT void Jim_InitStringRep (Jim_Obj *objPtr, const char *bytes,
         int length);
 JIM_EXPORT Jim_Obj * Jim_DuplicateObj (Jim_Interp *interp,
@@ -908,6 +952,7 @@ JIM_EXPORT void Jim_HistoryShow(void);
 /* Misc */
 JIM_EXPORT int Jim_InitStaticExtensions(Jim_Interp *interp);
 JIM_EXPORT int Jim_StringToWide(const char *str, jim_wide *widePtr, int base);
+JIM_EXPORT int Jim_WideToString(char *buf, jim_wide wideValue);
 
 /* jim-load.c */
 JIM_EXPORT int Jim_LoadLibrary(Jim_Interp *interp, const char *pathName);
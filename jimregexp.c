@@ -1222,6 +1222,10 @@ static const char *str_find(const char *string, int c, int nocase)
 		/* The "string" should already be converted to uppercase */
 		c = utf8_upper(c);
 	}
+	if (c > 0 && c < 0x80 && !(nocase && isalpha(c))) {
+		/* An ASCII byte is always a whole char, so use strchr(), which is usually vectorised */
+		return strchr(string, c);
+	}
 	while (*string) {
 		int ch;
 		int n = reg_utf8_tounicode_case(string, &ch, nocase);
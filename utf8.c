@@ -60,16 +60,49 @@ int utf8_charlen(int c)
     return -1;
 }
 
+/**
+ * Returns the number of leading ASCII bytes in 'str', up to 'len'.
+ * Whole words are checked at a time while possible.
+ */
+static int utf8_ascii_span(const char *str, int len)
+{
+    /* 0x80 in every byte of the word */
+    const unsigned long highbits = ((unsigned long)-1 / 0xff) << 7;
+    int n = 0;
+
+    while (len - n >= (int)sizeof(unsigned long)) {
+        unsigned long w;
+
+        memcpy(&w, str + n, sizeof(w));
+        if (w & highbits) {
+            break;
+        }
+        n += sizeof(w);
+    }
+    while (n < len && (str[n] & 0x80) == 0) {
+        n++;
+    }
+    return n;
+}
+
 int utf8_strlen(const char *str, int bytelen)
 {
     int charlen = 0;
     if (bytelen < 0) {
         bytelen = strlen(str);
     }
-    while (bytelen) {
+    while (bytelen > 0) {
         int c;
-        int l = utf8_tounicode(str, &c);
-        charlen++;
+        int l;
+        if ((*str & 0x80) == 0) {
+            /* Each ASCII byte is a char */
+            l = utf8_ascii_span(str, bytelen);
+            charlen += l;
+        }
+        else {
+            l = utf8_tounicode(str, &c);
+            charlen++;
+        }
         str += l;
         bytelen -= l;
     }
@@ -79,9 +112,17 @@ int utf8_strlen(const char *str, int bytelen)
 int utf8_index(const char *str, int index)
 {
     const char *s = str;
-    while (index--) {
+    while (index > 0) {
         int c;
-        s += utf8_tounicode(s, &c);
+        if ((*s & 0x80) == 0) {
+            int l = utf8_ascii_span(s, index);
+            s += l;
+            index -= l;
+        }
+        else {
+            s += utf8_tounicode(s, &c);
+            index--;
+        }
     }
     return s - str;
 }